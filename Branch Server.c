@@ -1,34 +1,101 @@
 /* branch_server.c
-   Usage: ./branch_server <BRANCH_ID> <CSV_FILE> <PORT>
-   Example: ./branch_server A branchA.csv 5001
+   Usage: ./branch_server [OPTIONS] <BRANCH_ID> <CSV_FILE> <PORT>
+          ./branch_server [OPTIONS] [--cache-mb MB] --manifest FILE <HOST_ID> <PORT>
+          ./branch_server [--threads N] [--io-uring] --bench <CSV_FILE> [ROUNDS]
+   Options: [--threads N] [--no-index] [--compress-min BYTES] [--io-uring]
+            [--unix PATH] [--shm NAME]
+   Example: ./branch_server --threads 8 A branchA.csv 5001
+   Build:   gcc -O2 -pthread -o branch_server branch_server.c -lm
+            add -DHAVE_ZSTD ... -lzstd and/or -DHAVE_LZ4 ... -llz4 for compressed
+            replies, and -DHAVE_ZSTD for reading <CSV_FILE>.zst archives
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
-#define BACKLOG 5
+#define BACKLOG 1024
 #define BUF_SZ 4096
 
-/* Read CSV file with header date,amount and compute subtotal and count */
-int compute_subtotal(const char *csvfile, double *subtotal, int *count) {
+#define CSV_MAX_COLS 64
+
+/* Position of the header column called name (ignoring case, blanks and
+   quotes around it), -1 if it is not among the first CSV_MAX_COLS */
+static int csv_column(const char *hdr, size_t len, const char *name) {
+    const char *p = hdr, *end = hdr + len;
+    size_t n = strlen(name);
+    for (int col = 0; col < CSV_MAX_COLS; col++) {
+        const char *q = p;
+        while (q < end && *q != ',' && *q != '\n') q++;
+        const char *s = p, *e = q;
+        while (s < e && (*s == ' ' || *s == '\t' || *s == '"')) s++;
+        while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '"')) e--;
+        if ((size_t)(e - s) == n && strncasecmp(s, name, n) == 0) return col;
+        if (q == end || *q == '\n') break;
+        p = q + 1;
+    }
+    return -1;
+}
+
+/* Original stdio scanner, kept as the reference for --bench.
+   Read CSV file with a header naming its amount column (else date,amount)
+   and compute subtotal and count */
+int compute_subtotal_stdio(const char *csvfile, double *subtotal, int *count) {
     FILE *f = fopen(csvfile, "r");
     if (!f) return -1;
     char line[512];
     *subtotal = 0.0;
     *count = 0;
-    /* skip header */
+    /* header */
     if (!fgets(line, sizeof(line), f)) { fclose(f); return -1; }
+    int col = csv_column(line, strlen(line), "amount");
+    if (col < 0 || csv_column(line, strlen(line), "date") < 0) col = 1;
     while (fgets(line, sizeof(line), f)) {
-        char *p = strchr(line, ',');
+        char *p = line;
+        for (int i = 0; i < col && p; i++)
+            if ((p = strchr(p, ','))) p++;
         if (!p) continue;
-        double amt = atof(p+1);
+        double amt = atof(p);
         *subtotal += amt;
         (*count)++;
     }
@@ -36,6 +103,1504 @@ int compute_subtotal(const char *csvfile, double *subtotal, int *count) {
     return 0;
 }
 
+/* ---- scan kernels ----
+   A kernel classifies one 64-byte block, setting bit i of *comma / *nl when
+   byte i is ',' / '\n'. The scanner walks these bitmaps instead of testing
+   bytes one at a time, so the cost per row does not depend on row length. */
+
+static void masks_scalar(const char *p, size_t n, uint64_t *comma, uint64_t *nl) {
+    uint64_t c = 0, l = 0;
+    for (size_t i = 0; i < n; i++) {
+        c |= (uint64_t)(p[i] == ',') << i;
+        l |= (uint64_t)(p[i] == '\n') << i;
+    }
+    *comma = c;
+    *nl = l;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void masks_sse2(const char *p, size_t n, uint64_t *comma, uint64_t *nl) {
+    if (n < 64) { masks_scalar(p, n, comma, nl); return; }
+    const __m128i vc = _mm_set1_epi8(','), vl = _mm_set1_epi8('\n');
+    uint64_t c = 0, l = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        c |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) << (16 * i);
+        l |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vl)) << (16 * i);
+    }
+    *comma = c;
+    *nl = l;
+}
+
+__attribute__((target("avx2")))
+static void masks_avx2(const char *p, size_t n, uint64_t *comma, uint64_t *nl) {
+    if (n < 64) { masks_scalar(p, n, comma, nl); return; }
+    const __m256i vc = _mm256_set1_epi8(','), vl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i *)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i *)(p + 32));
+    *comma = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vc)) |
+             (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vc)) << 32;
+    *nl = (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, vl)) |
+          (uint64_t)(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, vl)) << 32;
+}
+#endif
+
+struct scan_kernel {
+    const char *name;
+    void (*masks)(const char *p, size_t n, uint64_t *comma, uint64_t *nl);
+};
+
+static const struct scan_kernel scan_kernels[] = {
+#ifdef HAVE_X86_SIMD
+    { "avx2", masks_avx2 },
+    { "sse2", masks_sse2 },
+#endif
+    { "scalar", masks_scalar },
+};
+#define N_SCAN_KERNELS (sizeof(scan_kernels) / sizeof(scan_kernels[0]))
+
+static const struct scan_kernel *scan_kernel = &scan_kernels[N_SCAN_KERNELS - 1];
+
+static int kernel_supported(const struct scan_kernel *k) {
+#ifdef HAVE_X86_SIMD
+    if (k->masks == masks_avx2) return __builtin_cpu_supports("avx2");
+    if (k->masks == masks_sse2) return __builtin_cpu_supports("sse2");
+#endif
+    (void)k;
+    return 1;
+}
+
+/* Pick the widest kernel this CPU can run */
+static void select_scan_kernel(void) {
+    for (size_t i = 0; i < N_SCAN_KERNELS; i++) {
+        if (kernel_supported(&scan_kernels[i])) {
+            scan_kernel = &scan_kernels[i];
+            return;
+        }
+    }
+}
+
+/* Delimiter bitmaps for the 64-byte block of buf currently under the cursor */
+struct delim_cursor {
+    const char *buf;
+    size_t len;
+    size_t block;
+    uint64_t comma, nl;
+};
+
+static void cursor_load(struct delim_cursor *dc, size_t block) {
+    size_t off = block * 64;
+    size_t n = dc->len - off < 64 ? dc->len - off : 64;
+    dc->block = block;
+    scan_kernel->masks(dc->buf + off, n, &dc->comma, &dc->nl);
+}
+
+static void cursor_init(struct delim_cursor *dc, const char *buf, size_t len) {
+    dc->buf = buf;
+    dc->len = len;
+    dc->comma = dc->nl = 0;
+    dc->block = (size_t)-1;
+}
+
+/* Offset of the first newline (or, with want_comma, comma or newline) at or
+   after off; len if there is none */
+static inline size_t cursor_next(struct delim_cursor *dc, size_t off, int want_comma) {
+    if (off >= dc->len) return dc->len;
+    size_t block = off >> 6;
+    if (block != dc->block) cursor_load(dc, block);
+    uint64_t m = (dc->nl | (want_comma ? dc->comma : 0)) & (~0ULL << (off & 63));
+    while (!m) {
+        if (++block * 64 >= dc->len) return dc->len;
+        cursor_load(dc, block);
+        m = dc->nl | (want_comma ? dc->comma : 0);
+    }
+    return block * 64 + (size_t)__builtin_ctzll(m);
+}
+
+/* ---- amount parsing ---- */
+
+/* Amounts are accumulated as integers in 1/AMOUNT_SCALE of the currency unit.
+   Integer addition is associative, so the total does not depend on how rows
+   are split across threads or in which order partial sums are merged. */
+#define AMOUNT_SCALE_DIGITS 4
+#define AMOUNT_SCALE 10000LL
+
+static const long long pow10_i[] = {
+    1LL, 10LL, 100LL, 1000LL, 10000LL, 100000LL, 1000000LL, 10000000LL,
+    100000000LL, 1000000000LL, 10000000000LL, 100000000000LL, 1000000000000LL,
+    10000000000000LL, 100000000000000LL, 1000000000000000LL,
+    10000000000000000LL, 100000000000000000LL, 1000000000000000000LL
+};
+
+/* Totals of a run of rows */
+struct scan_acc {
+    long long units;
+    long long count;
+};
+
+/* parse_amount() for what is not a plain decimal: strtod on a bounded copy
+   of the field starting at start */
+static const char *parse_amount_strtod(const char *start, const char *end, long long *out) {
+    char tmp[128];
+    size_t n = 0;
+    while (start + n < end && start[n] != '\n' && n < sizeof(tmp) - 1) {
+        tmp[n] = start[n];
+        n++;
+    }
+    tmp[n] = '\0';
+    char *ep;
+    double d = strtod(tmp, &ep) * (double)AMOUNT_SCALE;
+    *out = (d > -9e18 && d < 9e18) ? llround(d) : 0;
+    return start + (ep - tmp);
+}
+
+/* Parse the number at p the way atof() would, without needing a NUL, and
+   return it in 1/AMOUNT_SCALE units (extra fraction digits round half away
+   from zero). Plain decimals are read digit by digit into an integer;
+   exponents, hex and very long mantissas go to strtod on a bounded copy of
+   the field. Non-finite values count as 0. Never reads past a newline.
+   Inlined into every row loop, which is why the strtod path is not. */
+static inline __attribute__((always_inline))
+const char *parse_amount(const char *p, const char *end, long long *out) {
+    const char *s = p;
+    while (s < end && (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\v' || *s == '\f')) s++;
+    const char *start = s;
+    int neg = 0;
+    if (s < end && (*s == '-' || *s == '+')) { neg = (*s == '-'); s++; }
+    unsigned long long mant = 0;
+    int digits = 0, frac = 0, seen = 0;
+    for (; s < end && (unsigned)(*s - '0') < 10; s++, seen++) {
+        if (mant == 0 && *s == '0') continue;
+        mant = mant * 10 + (unsigned)(*s - '0');
+        digits++;
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && (unsigned)(*s - '0') < 10; s++, seen++) {
+            frac++;
+            if (mant == 0 && *s == '0') continue;
+            mant = mant * 10 + (unsigned)(*s - '0');
+            digits++;
+        }
+    }
+    int plain = seen > 0 && digits <= 18 &&
+                !(s < end && (*s == 'e' || *s == 'E' || *s == 'x' || *s == 'X'));
+    if (plain && frac <= AMOUNT_SCALE_DIGITS &&
+        digits + AMOUNT_SCALE_DIGITS - frac <= 18) {
+        long long v = (long long)mant * pow10_i[AMOUNT_SCALE_DIGITS - frac];
+        *out = neg ? -v : v;
+        return s;
+    }
+    if (plain && frac > AMOUNT_SCALE_DIGITS) {
+        int drop = frac - AMOUNT_SCALE_DIGITS;
+        long long v = 0;
+        if (drop <= 18) {
+            unsigned long long d = (unsigned long long)pow10_i[drop];
+            v = (long long)(mant / d + (mant % d >= (d + 1) / 2));
+        }
+        *out = neg ? -v : v;
+        return s;
+    }
+    if (seen == 0 && !(s < end && ((*s | 0x20) == 'i' || (*s | 0x20) == 'n'))) {
+        /* no digits at all, e.g. an empty field */
+        *out = 0;
+        return s;
+    }
+    return parse_amount_strtod(start, end, out);
+}
+
+static double units_to_double(long long units) {
+    return (double)units / (double)AMOUNT_SCALE;
+}
+
+/* Exact decimal text of an amount, as sent in text replies: two decimals,
+   more only if it has them, so the aggregator reads back the same units */
+static void format_units(char *buf, size_t n, long long units) {
+    unsigned long long a = units < 0 ? 0ULL - (unsigned long long)units : (unsigned long long)units;
+    unsigned long long frac = a % AMOUNT_SCALE;
+    int digits = AMOUNT_SCALE_DIGITS;
+    while (digits > 2 && frac % 10 == 0) {
+        frac /= 10;
+        digits--;
+    }
+    snprintf(buf, n, "%s%llu.%0*llu", units < 0 ? "-" : "", a / AMOUNT_SCALE, digits, frac);
+}
+
+/* ---- time index ----
+   While scanning, rows are also summed per hour of their date field, so range
+   and GROUP BY queries are answered from the buckets instead of the CSV.
+   Bucket keys are hours since the Unix epoch (UTC), kept sorted; rows whose
+   date does not parse count only towards the plain totals. */
+#define TI_NO_HOUR INT32_MIN
+
+struct time_bucket {
+    int32_t hour;
+    off_t first_off;        /* file offset of the bucket's first row */
+    struct scan_acc acc;
+};
+
+struct time_index {
+    struct time_bucket *v;
+    size_t n, cap;
+    size_t last;            /* bucket of the previous row: rows are mostly in order */
+    int oom;                /* a bucket could not be added; the index is incomplete */
+    int32_t pend_hour;      /* hour of the unterminated last row, if any */
+    off_t base;             /* file offset of the buffer being scanned */
+};
+
+static void ti_reset(struct time_index *ti) {
+    ti->n = ti->last = 0;
+    ti->oom = 0;
+    ti->pend_hour = TI_NO_HOUR;
+}
+
+static void ti_free(struct time_index *ti) {
+    free(ti->v);
+    memset(ti, 0, sizeof(*ti));
+    ti->pend_hour = TI_NO_HOUR;
+}
+
+/* First bucket with hour >= h */
+static size_t ti_lower_bound(const struct time_index *ti, int32_t h) {
+    size_t lo = 0, hi = ti->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ti->v[mid].hour < h) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static void ti_add(struct time_index *ti, int32_t hour, off_t first_off, long long units,
+                   long long count) {
+    size_t i = ti->last;
+    if (i >= ti->n || ti->v[i].hour != hour) {
+        i = ti->n > 0 && ti->v[ti->n - 1].hour < hour ? ti->n : ti_lower_bound(ti, hour);
+        if (i == ti->n || ti->v[i].hour != hour) {
+            if (ti->n == ti->cap) {
+                size_t cap = ti->cap ? ti->cap * 2 : 64;
+                struct time_bucket *v = realloc(ti->v, cap * sizeof(*v));
+                if (!v) { ti->oom = 1; return; }
+                ti->v = v;
+                ti->cap = cap;
+            }
+            memmove(&ti->v[i + 1], &ti->v[i], (ti->n - i) * sizeof(*ti->v));
+            ti->v[i].hour = hour;
+            ti->v[i].first_off = first_off;
+            ti->v[i].acc.units = ti->v[i].acc.count = 0;
+            ti->n++;
+        }
+        ti->last = i;
+    }
+    if (first_off < ti->v[i].first_off) ti->v[i].first_off = first_off;
+    ti->v[i].acc.units += units;
+    ti->v[i].acc.count += count;
+}
+
+static void ti_merge(struct time_index *dst, const struct time_index *src) {
+    for (size_t i = 0; i < src->n; i++)
+        ti_add(dst, src->v[i].hour, src->v[i].first_off, src->v[i].acc.units,
+               src->v[i].acc.count);
+    if (src->oom) dst->oom = 1;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+static int64_t days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return (int64_t)era * 146097 + doe - 719468;
+}
+
+static int digits_at(const char *p, int n) {
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        if ((unsigned)(p[i] - '0') > 9) return -1;
+        v = v * 10 + (p[i] - '0');
+    }
+    return v;
+}
+
+static int days_in_month(int y, int m) {
+    static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return days[m - 1] + (m == 2 && leap);
+}
+
+/* "YYYY-MM-DD" optionally followed by 'T' or ' ' and "HH[...]" -> hours since
+   the epoch; *has_hour tells whether the hour was given. -1 if malformed. */
+static int parse_date_hour(const char *p, size_t len, int32_t *hour, int *has_hour) {
+    while (len > 0 && (*p == ' ' || *p == '"')) { p++; len--; }
+    if (len < 10 || (p[4] != '-' && p[4] != '/') || p[7] != p[4]) return -1;
+    int y = digits_at(p, 4), m = digits_at(p + 5, 2), d = digits_at(p + 8, 2), h = 0;
+    if (y < 0 || m < 1 || m > 12 || d < 1 || d > days_in_month(y, m)) return -1;
+    *has_hour = 0;
+    if (len >= 13 && (p[10] == 'T' || p[10] == ' ') && (h = digits_at(p + 11, 2)) >= 0) {
+        if (h > 23) return -1;
+        *has_hour = 1;
+    } else {
+        h = 0;
+    }
+    *hour = (int32_t)(days_from_civil(y, m, d) * 24 + h);
+    return 0;
+}
+
+/* Per-row date handling for scan_buffer(): a small direct-mapped table keyed
+   by the first 13 bytes of the date field ("YYYY-MM-DDTHH") sums rows before
+   they reach the index, so a date is parsed and its bucket looked up once
+   per table miss rather than once per row, in order or not. */
+#define DATE_KEY_SZ 13
+#define DATE_SLOT_BITS 10
+#define DATE_SLOTS (1u << DATE_SLOT_BITS)
+
+struct date_slot {
+    uint64_t k0, k1;        /* key bytes, zero padded; k1 also holds the length */
+    int32_t hour;
+    off_t first_off;
+    struct scan_acc acc;
+};
+
+struct date_agg {
+    struct time_index *ti;
+    struct date_slot slot[DATE_SLOTS];
+};
+
+static void date_agg_init(struct date_agg *da, struct time_index *ti) {
+    da->ti = ti;
+    for (size_t i = 0; i < DATE_SLOTS; i++) da->slot[i].k1 = UINT64_MAX;
+}
+
+static void date_slot_flush(struct date_agg *da, struct date_slot *sl) {
+    if (sl->k1 != UINT64_MAX && sl->hour != TI_NO_HOUR && sl->acc.count > 0)
+        ti_add(da->ti, sl->hour, sl->first_off, sl->acc.units, sl->acc.count);
+    sl->acc.units = sl->acc.count = 0;
+}
+
+static void date_agg_flush(struct date_agg *da) {
+    for (size_t i = 0; i < DATE_SLOTS; i++) date_slot_flush(da, &da->slot[i]);
+}
+
+/* The table slot for the date field [p, p+len); the key starts where
+   parse_date_hour() does, past any quote or padding */
+static inline struct date_slot *date_agg_slot(struct date_agg *da, const char *p, size_t len) {
+    while (len > 0 && (*p == ' ' || *p == '"')) { p++; len--; }
+    size_t klen = len < DATE_KEY_SZ ? len : DATE_KEY_SZ;
+    unsigned char key[16] = { 0 };
+    memcpy(key, p, klen);
+    key[15] = (unsigned char)klen;
+    uint64_t k0, k1;
+    memcpy(&k0, key, 8);
+    memcpy(&k1, key + 8, 8);
+    uint64_t h = (k0 * 0x9E3779B97F4A7C15ull) ^ (k1 * 0xC2B2AE3D27D4EB4Full);
+    struct date_slot *sl = &da->slot[h >> (64 - DATE_SLOT_BITS)];
+    if (sl->k0 == k0 && sl->k1 == k1) return sl;
+    date_slot_flush(da, sl);
+    int has_hour;
+    if (parse_date_hour(p, len, &sl->hour, &has_hour) != 0) sl->hour = TI_NO_HOUR;
+    sl->k0 = k0;
+    sl->k1 = k1;
+    return sl;
+}
+
+/* ---- CSV layouts ----
+   Which columns hold the date and the amount is read off the header once
+   per file (see csv_column()). The row loop is an inline function of the
+   two positions; each layout in csv_layouts gets its own copies (with and
+   without the time index) with them as constants, so the walk to the
+   amount is unrolled and a skipped field costs one bitmap step, and any
+   other layout shares copies that take them at run time. */
+struct csv_layout;
+typedef size_t (*scan_fn)(const struct csv_layout *lay, const char *buf, size_t len,
+                          struct scan_acc *acc, struct scan_acc *pend, struct time_index *ti);
+
+struct csv_layout {
+    int date_col, amount_col;
+    scan_fn scan;
+};
+
+/* Sum the amount column of every row in [buf, buf+len). Newline-terminated
+   rows go into acc; an unterminated last row goes into pend. Rows that end
+   before the amount column are skipped. With ti, rows are also added to
+   their hour bucket (the pending row only sets ti->pend_hour). Returns bytes
+   consumed, i.e. up to and including the last newline. */
+static inline __attribute__((always_inline))
+size_t scan_rows(const char *buf, size_t len, struct scan_acc *acc, struct scan_acc *pend,
+                 struct time_index *ti, const int date_col, const int amount_col) {
+    const int last = date_col > amount_col ? date_col : amount_col;
+    struct delim_cursor dc;
+    cursor_init(&dc, buf, len);
+    struct date_agg da;
+    if (ti) date_agg_init(&da, ti);
+    size_t off = 0, committed = 0;
+    long long sum = acc->units;
+    long long cnt = acc->count;
+    while (off < len) {
+        size_t fs = off, ds = off, de = off, as = len, nl = len;
+        for (int col = 0; col <= last; col++) {
+            if (col == amount_col) {
+                as = fs;
+                if (col == last) break;
+            }
+            size_t fe = cursor_next(&dc, fs, 1);
+            if (col == date_col) {
+                ds = fs;
+                de = fe;
+            }
+            if (col == last) break;
+            if (fe == len || buf[fe] != ',') {
+                nl = fe;
+                break;
+            }
+            fs = fe + 1;
+        }
+        if (as < len) {
+            long long amt;
+            const char *r = parse_amount(buf + as, buf + len, &amt);
+            nl = cursor_next(&dc, (size_t)(r - buf), 0);
+            struct date_slot *sl = ti ? date_agg_slot(&da, buf + ds, de - ds) : NULL;
+            if (nl == len) {
+                pend->units += amt;
+                pend->count++;
+                if (ti) ti->pend_hour = sl->hour;
+                break;
+            }
+            sum += amt;
+            cnt++;
+            if (sl) {
+                if (sl->acc.count++ == 0) sl->first_off = ti->base + (off_t)off;
+                sl->acc.units += amt;
+            }
+        }
+        if (nl == len) break;
+        off = nl + 1;
+        committed = off;
+    }
+    if (ti) date_agg_flush(&da);
+    acc->units = sum;
+    acc->count = cnt;
+    return committed;
+}
+
+#define SCAN_LAYOUT(d, a) \
+    static size_t scan_d##d##_a##a(const struct csv_layout *lay, const char *buf, size_t len, \
+                                   struct scan_acc *acc, struct scan_acc *pend, \
+                                   struct time_index *ti) { \
+        (void)lay; \
+        return ti ? scan_rows(buf, len, acc, pend, ti, d, a) \
+                  : scan_rows(buf, len, acc, pend, NULL, d, a); \
+    }
+
+SCAN_LAYOUT(0, 1)   /* date,amount */
+SCAN_LAYOUT(0, 2)   /* date,store,amount */
+SCAN_LAYOUT(0, 4)   /* date,store,sku,qty,amount */
+
+static size_t scan_any(const struct csv_layout *lay, const char *buf, size_t len,
+                       struct scan_acc *acc, struct scan_acc *pend, struct time_index *ti) {
+    return ti ? scan_rows(buf, len, acc, pend, ti, lay->date_col, lay->amount_col)
+              : scan_rows(buf, len, acc, pend, NULL, lay->date_col, lay->amount_col);
+}
+
+static const struct csv_layout csv_layouts[] = {
+    { 0, 1, scan_d0_a1 },
+    { 0, 2, scan_d0_a2 },
+    { 0, 4, scan_d0_a4 },
+};
+#define N_CSV_LAYOUTS (sizeof(csv_layouts) / sizeof(csv_layouts[0]))
+
+static int layout_generic;  /* --bench: use scan_any() for every layout */
+
+/* The layout with these columns */
+static void layout_at(int date_col, int amount_col, struct csv_layout *lay) {
+    for (size_t i = 0; !layout_generic && i < N_CSV_LAYOUTS; i++) {
+        if (csv_layouts[i].date_col == date_col && csv_layouts[i].amount_col == amount_col) {
+            *lay = csv_layouts[i];
+            return;
+        }
+    }
+    lay->date_col = date_col;
+    lay->amount_col = amount_col;
+    lay->scan = scan_any;
+}
+
+/* The layout of a file whose header is [hdr, hdr+len); one without both a
+   date and an amount column is read as date,amount */
+static void layout_of(const char *hdr, size_t len, struct csv_layout *lay) {
+    int d = csv_column(hdr, len, "date"), a = csv_column(hdr, len, "amount");
+    if (d < 0 || a < 0) d = 0, a = 1;
+    layout_at(d, a, lay);
+}
+
+static inline size_t scan_buffer(const struct csv_layout *lay, const char *buf, size_t len,
+                                 struct scan_acc *acc, struct scan_acc *pend, struct time_index *ti) {
+    return lay->scan(lay, buf, len, acc, pend, ti);
+}
+
+/* Offset just past the header line, or 0 if it is not terminated yet */
+static size_t skip_header(const char *buf, size_t len) {
+    const char *nl = memchr(buf, '\n', len);
+    return nl ? (size_t)(nl + 1 - buf) : 0;
+}
+
+/* ---- parallel scanning ----
+   Large ranges are cut into chunks that each end on a newline, scanned by a
+   fixed pool of worker threads, and the per-chunk totals are added up. */
+
+#define SCAN_CHUNK_MIN (4u << 20)   /* below this, splitting costs more than it saves */
+#define SCAN_CHUNKS_PER_THREAD 4
+
+struct scan_chunk {
+    const struct csv_layout *lay;
+    const char *buf;
+    size_t len;
+    struct scan_acc acc, pend;
+    size_t consumed;
+    int indexed;
+    struct time_index ti;
+};
+
+struct scan_pool {
+    int nthreads;               /* including the calling thread */
+    pthread_t *tids;
+    pthread_mutex_t mu;
+    pthread_cond_t work_cv, done_cv;
+    struct scan_chunk *chunks;
+    int nchunks, next, done;
+    unsigned gen;
+};
+
+static struct scan_pool scan_pool = {
+    .nthreads = 1,
+    .mu = PTHREAD_MUTEX_INITIALIZER,
+    .work_cv = PTHREAD_COND_INITIALIZER,
+    .done_cv = PTHREAD_COND_INITIALIZER,
+};
+
+static void scan_chunk_run(struct scan_chunk *ch) {
+    ch->acc.units = ch->pend.units = 0;
+    ch->acc.count = ch->pend.count = 0;
+    off_t base = ch->ti.base;
+    ti_reset(&ch->ti);
+    ch->ti.base = base;
+    ch->consumed = scan_buffer(ch->lay, ch->buf, ch->len, &ch->acc, &ch->pend,
+                               ch->indexed ? &ch->ti : NULL);
+}
+
+/* Take chunks until none are left; called with mu held, returns with it held */
+static void scan_pool_drain(struct scan_pool *sp) {
+    while (sp->next < sp->nchunks) {
+        struct scan_chunk *ch = &sp->chunks[sp->next++];
+        pthread_mutex_unlock(&sp->mu);
+        scan_chunk_run(ch);
+        pthread_mutex_lock(&sp->mu);
+        if (++sp->done == sp->nchunks) pthread_cond_signal(&sp->done_cv);
+    }
+}
+
+static void *scan_worker(void *arg) {
+    struct scan_pool *sp = arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&sp->mu);
+    for (;;) {
+        while (sp->gen == seen) pthread_cond_wait(&sp->work_cv, &sp->mu);
+        seen = sp->gen;
+        scan_pool_drain(sp);
+    }
+    return NULL;
+}
+
+/* Start nthreads-1 workers; the thread calling scan_range() is the last one */
+int scan_pool_start(int nthreads) {
+    struct scan_pool *sp = &scan_pool;
+    sp->tids = calloc((size_t)nthreads, sizeof(pthread_t));
+    if (!sp->tids) return -1;
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&sp->tids[i], NULL, scan_worker, sp) != 0) return -1;
+        pthread_detach(sp->tids[i]);
+        sp->nthreads++;
+    }
+    return 0;
+}
+
+/* scan_buffer() over [buf, buf+len), in parallel when it is worth it */
+static size_t scan_range(const struct csv_layout *lay, const char *buf, size_t len,
+                         struct scan_acc *acc, struct scan_acc *pend, struct time_index *ti) {
+    struct scan_pool *sp = &scan_pool;
+    size_t want = (size_t)sp->nthreads * SCAN_CHUNKS_PER_THREAD;
+    if (sp->nthreads <= 1 || len < 2 * SCAN_CHUNK_MIN)
+        return scan_buffer(lay, buf, len, acc, pend, ti);
+    if (len / want < SCAN_CHUNK_MIN) want = len / SCAN_CHUNK_MIN;
+
+    struct scan_chunk *chunks = calloc(want, sizeof(*chunks));
+    if (!chunks) return scan_buffer(lay, buf, len, acc, pend, ti);
+    size_t n = 0, off = 0;
+    while (off < len) {
+        size_t stop = n + 1 == want ? len : off + len / want;
+        if (stop < len) {
+            /* move the cut forward to just past the next newline */
+            const char *nl = memchr(buf + stop, '\n', len - stop);
+            stop = nl ? (size_t)(nl + 1 - buf) : len;
+        }
+        chunks[n].lay = lay;
+        chunks[n].buf = buf + off;
+        chunks[n].len = stop - off;
+        chunks[n].indexed = ti != NULL;
+        chunks[n].ti.base = ti ? ti->base + (off_t)off : 0;
+        n++;
+        off = stop;
+    }
+
+    pthread_mutex_lock(&sp->mu);
+    sp->chunks = chunks;
+    sp->nchunks = (int)n;
+    sp->next = sp->done = 0;
+    sp->gen++;
+    pthread_cond_broadcast(&sp->work_cv);
+    scan_pool_drain(sp);
+    while (sp->done < sp->nchunks) pthread_cond_wait(&sp->done_cv, &sp->mu);
+    sp->chunks = NULL;
+    sp->nchunks = 0;
+    pthread_mutex_unlock(&sp->mu);
+
+    /* every chunk but the last ends on a newline, so only it can be pending */
+    if (ti && chunks[n-1].pend.count > 0) ti->pend_hour = chunks[n-1].ti.pend_hour;
+    for (size_t i = 0; i < n; i++) {
+        acc->units += chunks[i].acc.units;
+        acc->count += chunks[i].acc.count;
+        if (ti) ti_merge(ti, &chunks[i].ti);
+        ti_free(&chunks[i].ti);
+    }
+    pend->units += chunks[n-1].pend.units;
+    pend->count += chunks[n-1].pend.count;
+    size_t consumed = (size_t)(chunks[n-1].buf - buf) + chunks[n-1].consumed;
+    free(chunks);
+    return consumed;
+}
+
+/* A read-only sequential view of [offset, size) of an open file */
+struct file_map {
+    void *base;
+    size_t maplen;
+    const char *data;
+    size_t len;
+};
+
+static int map_range(int fd, off_t offset, off_t size, struct file_map *m) {
+    long pg = sysconf(_SC_PAGESIZE);
+    off_t aligned = offset - offset % pg;
+    m->base = NULL;
+    m->data = NULL;
+    m->len = (size_t)(size - offset);
+    m->maplen = (size_t)(size - aligned);
+    if (m->len == 0) return 0;
+    m->base = mmap(NULL, m->maplen, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (m->base == MAP_FAILED) { m->base = NULL; return -1; }
+    madvise(m->base, m->maplen, MADV_SEQUENTIAL);
+    m->data = (const char *)m->base + (offset - aligned);
+    return 0;
+}
+
+static void unmap_range(struct file_map *m) {
+    if (m->base) munmap(m->base, m->maplen);
+    m->base = NULL;
+}
+
+/* ---- compressed branch files ----
+   A CSV file named *.zst (an archive) is inflated as it is read: the text
+   goes into a window, which is scanned up to its last newline while the
+   rest slides to the front for the next pass. Offsets in the time index
+   then count decompressed bytes. Without HAVE_ZSTD such a file is refused. */
+
+#define ZST_WINDOW (16u << 20)  /* decompressed text per pass; big enough to scan in parallel */
+#define ZST_IN_SZ (128u << 10)
+
+static int is_zst(const char *csvfile) {
+    size_t n = strlen(csvfile);
+    return n > 4 && strcmp(csvfile + n - 4, ".zst") == 0;
+}
+
+/* The rows of the compressed CSV on fd, as scan_buffer() counts them; *lay
+   is set to the layout its header names and *text to the decompressed
+   length. Returns -1 on a read error, a corrupt or truncated stream, or a
+   line longer than the window. */
+static int scan_zst(int fd, struct csv_layout *lay, struct scan_acc *acc, struct scan_acc *pend,
+                    struct time_index *ti, uint64_t *text) {
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *ds = ZSTD_createDStream();
+    char *win = malloc(ZST_WINDOW);
+    unsigned char *in = malloc(ZST_IN_SZ);
+    int rc = -1, eof = 0, header = 0;
+    size_t have = 0, zr = 0;
+    uint64_t pos = 0;       /* text offset of win[0] */
+    ZSTD_inBuffer ib = { in, 0, 0 };
+    if (!ds || !win || !in || ZSTD_isError(ZSTD_initDStream(ds))) goto out;
+    for (;;) {
+        while (have < ZST_WINDOW && !eof) {
+            if (ib.pos == ib.size) {
+                ssize_t r = read(fd, in, ZST_IN_SZ);
+                if (r < 0 && errno == EINTR) continue;
+                if (r < 0) goto out;
+                if (r == 0) {
+                    eof = 1;
+                    break;
+                }
+                ib.size = (size_t)r;
+                ib.pos = 0;
+            }
+            ZSTD_outBuffer ob = { win + have, ZST_WINDOW - have, 0 };
+            zr = ZSTD_decompressStream(ds, &ob, &ib);
+            if (ZSTD_isError(zr)) goto out;
+            have += ob.pos;
+        }
+        if (eof && zr != 0) goto out;   /* truncated frame */
+        size_t start = 0;
+        if (!header) {
+            start = skip_header(win, have);
+            layout_of(win, start, lay);
+            if (start == 0) {
+                /* no complete header line: nothing to count, as with a plain file */
+                if (!eof) goto out;
+                rc = have > 0 ? 0 : -1;
+                break;
+            }
+            header = 1;
+        }
+        struct scan_acc p = { 0, 0 };
+        if (ti) {
+            ti->base = (off_t)(pos + start);
+            ti->pend_hour = TI_NO_HOUR;
+        }
+        size_t used = start + scan_range(lay, win + start, have - start, acc, &p, ti);
+        if (eof) {
+            pend->units += p.units;
+            pend->count += p.count;
+            pos += have;
+            rc = 0;
+            break;
+        }
+        if (used == 0) goto out;        /* one line fills the window */
+        memmove(win, win + used, have - used);
+        have -= used;
+        pos += used;
+    }
+    *text = pos;
+out:
+    ZSTD_freeDStream(ds);
+    free(win);
+    free(in);
+    return rc;
+#else
+    (void)fd; (void)lay; (void)acc; (void)pend; (void)ti; (void)text;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* ---- io_uring ----
+   A minimal ring over the raw system calls (no liburing). One thread owns
+   it; there is no SQ polling, so the kernel reads SQEs only inside
+   io_uring_enter() and an SQE may be filled in after uring_sqe() returns.
+   Without <linux/io_uring.h>, or on a kernel that refuses io_uring_setup(),
+   uring_init() fails and callers keep to plain system calls. */
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+    void *sq_ring, *cq_ring, *sqe_mem;
+    size_t sq_len, cq_len, sqe_len;
+    unsigned queued;        /* SQEs filled in since the last uring_submit() */
+};
+
+static void uring_free(struct uring *u) {
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_len);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED) munmap(u->cq_ring, u->cq_len);
+    if (u->sqe_mem && u->sqe_mem != MAP_FAILED) munmap(u->sqe_mem, u->sqe_len);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static int uring_init(struct uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+#ifdef HAVE_IO_URING
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    u->entries = p.sq_entries;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_CQ_RING);
+    u->sqe_mem = mmap(NULL, u->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqe_mem == MAP_FAILED) {
+        uring_free(u);
+        return -1;
+    }
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->sqes = u->sqe_mem;
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+#else
+    (void)entries;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/* The next SQE, zeroed, or NULL if the submission ring is full */
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) return NULL;
+    unsigned i = tail & *u->sq_mask;
+    memset(&u->sqes[i], 0, sizeof(u->sqes[i]));
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return &u->sqes[i];
+}
+
+/* Submit the queued SQEs and wait for wait_nr completions */
+static int uring_submit(struct uring *u, unsigned wait_nr) {
+    unsigned n = u->queued;
+    u->queued = 0;
+    for (;;) {
+        long r = syscall(__NR_io_uring_enter, u->fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+        if (r >= 0) return 0;
+        if (errno != EINTR) return -1;
+        n = 0;      /* an interrupted wait has submitted them already */
+    }
+}
+
+/* Take the next completion: 1 and *cqe, or 0 if there is none */
+static int uring_reap(struct uring *u, struct io_uring_cqe *cqe) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *cqe = u->cqes[head & *u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+#endif
+
+/* Full scans of large plain files (--io-uring): the scan thread reads the
+   file into URING_BUFS registered buffers, keeping every buffer's read in
+   flight, and scans each chunk as soon as it is in while the next ones
+   load. The line cut off at the end of a chunk is copied into the headroom
+   in front of the next one. Appends and small files stay on mmap. */
+#define URING_BUFS 4
+#define URING_CHUNK (16u << 20)     /* bytes per read; big enough to scan in parallel */
+#define URING_CARRY (64u << 10)     /* headroom for the line cut off the previous chunk */
+#define URING_MIN (32u << 20)       /* smaller files are simply mapped */
+
+static struct uring scan_ring = { .fd = -1 };
+static char *uring_buf[URING_BUFS];
+static int use_uring;               /* --io-uring, and the ring is set up */
+
+/* Set up the scan ring and register its buffers */
+static int uring_scan_setup(void) {
+    struct iovec iov[URING_BUFS];
+    int n = 0;
+    if (uring_init(&scan_ring, URING_BUFS) != 0) return -1;
+    for (; n < URING_BUFS; n++) {
+        uring_buf[n] = aligned_alloc(4096, URING_CARRY + URING_CHUNK);
+        if (!uring_buf[n]) break;
+        iov[n].iov_base = uring_buf[n] + URING_CARRY;
+        iov[n].iov_len = URING_CHUNK;
+    }
+#ifdef HAVE_IO_URING
+    if (n == URING_BUFS &&
+        syscall(__NR_io_uring_register, scan_ring.fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) == 0) {
+        use_uring = 1;
+        return 0;
+    }
+#else
+    (void)iov;
+#endif
+    while (n > 0) free(uring_buf[--n]);
+    uring_free(&scan_ring);
+    return -1;
+}
+
+#ifdef HAVE_IO_URING
+/* Queue the read of [off, off+len) into the data area of buffer b, at 'at' */
+static int uring_read(int fd, int b, size_t at, off_t off, size_t len) {
+    struct io_uring_sqe *sqe = uring_sqe(&scan_ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)off;
+    sqe->addr = (uintptr_t)(uring_buf[b] + URING_CARRY + at);
+    sqe->len = (unsigned)len;
+    sqe->buf_index = (uint16_t)b;
+    sqe->user_data = (uint64_t)b;
+    return 0;
+}
+#endif
+
+/* scan_range() over bytes [start, size) of fd, read through the scan ring.
+   Returns the file offset just past the last newline, or -1 on a read
+   error, a file that shrank or a line longer than URING_CARRY; acc, pend
+   and ti are then only partly filled in. */
+static off_t scan_uring(const struct csv_layout *lay, int fd, off_t start, off_t size,
+                        struct scan_acc *acc, struct scan_acc *pend, struct time_index *ti) {
+#ifdef HAVE_IO_URING
+    size_t nchunks = (size_t)((size - start + URING_CHUNK - 1) / URING_CHUNK);
+    size_t want[URING_BUFS], have[URING_BUFS], next = 0, carry = 0;
+    off_t at[URING_BUFS], end = -1;
+    int pending = 0;        /* reads the kernel has not completed */
+    for (size_t k = 0; k < nchunks; k++) {
+        /* keep the reads URING_BUFS chunks ahead; chunk k-1's buffer is free */
+        for (; next < nchunks && next < k + URING_BUFS; next++) {
+            int b = (int)(next % URING_BUFS);
+            at[b] = start + (off_t)next * URING_CHUNK;
+            want[b] = (size_t)(size - at[b] < URING_CHUNK ? size - at[b] : URING_CHUNK);
+            have[b] = 0;
+            if (uring_read(fd, b, 0, at[b], want[b]) != 0) goto out;
+            pending++;
+        }
+        int b = (int)(k % URING_BUFS);
+        while (have[b] < want[b]) {
+            struct io_uring_cqe cqe;
+            if (!uring_reap(&scan_ring, &cqe)) {
+                if (uring_submit(&scan_ring, 1) != 0) goto out;
+                continue;
+            }
+            int cb = (int)cqe.user_data;
+            pending--;
+            if (cqe.res <= 0) goto out;
+            have[cb] += (size_t)cqe.res;
+            if (have[cb] < want[cb]) {
+                /* short read: fetch the rest into the same buffer */
+                if (uring_read(fd, cb, have[cb], at[cb] + (off_t)have[cb], want[cb] - have[cb]) != 0)
+                    goto out;
+                pending++;
+            }
+        }
+        char *data = uring_buf[b] + URING_CARRY - carry;
+        size_t len = carry + have[b];
+        struct scan_acc p = { 0, 0 };
+        if (ti) {
+            ti->base = at[b] - (off_t)carry;
+            ti->pend_hour = TI_NO_HOUR;
+        }
+        size_t used = scan_range(lay, data, len, acc, &p, ti);
+        if (k + 1 == nchunks) {
+            pend->units += p.units;
+            pend->count += p.count;
+            end = at[b] - (off_t)carry + (off_t)used;
+            break;
+        }
+        carry = len - used;
+        if (carry > URING_CARRY) goto out;
+        memcpy(uring_buf[(k + 1) % URING_BUFS] + URING_CARRY - carry, data + used, carry);
+    }
+out:
+    /* an abandoned scan leaves reads in flight into the buffers */
+    if (scan_ring.queued && uring_submit(&scan_ring, 0) != 0) pending = -1;
+    while (pending > 0) {
+        struct io_uring_cqe cqe;
+        if (uring_reap(&scan_ring, &cqe)) pending--;
+        else if (uring_submit(&scan_ring, 1) != 0) pending = -1;
+    }
+    if (pending < 0) use_uring = 0;     /* buffers may still be written to: leave them */
+    return end;
+#else
+    (void)lay; (void)fd; (void)start; (void)size; (void)acc; (void)pend; (void)ti;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int scan_file(const char *csvfile, double *subtotal, int *count, struct time_index *ti);
+int compute_subtotal_units(const char *csvfile, struct scan_acc *out, struct time_index *ti);
+
+/* Read CSV file with a header (see layout_of()) and compute subtotal and count */
+int compute_subtotal(const char *csvfile, double *subtotal, int *count) {
+    return scan_file(csvfile, subtotal, count, NULL);
+}
+
+/* Same, also building the time index (for --bench) */
+static int compute_subtotal_indexed(const char *csvfile, double *subtotal, int *count) {
+    static struct time_index ti;
+    ti_reset(&ti);
+    return scan_file(csvfile, subtotal, count, &ti);
+}
+
+/* The exact totals of csvfile, in 1/AMOUNT_SCALE units */
+int compute_subtotal_units(const char *csvfile, struct scan_acc *out, struct time_index *ti) {
+    int fd = open(csvfile, O_RDONLY);
+    if (fd < 0) return -1;
+    if (is_zst(csvfile)) {
+        struct scan_acc acc = { 0, 0 }, pend = { 0, 0 };
+        struct csv_layout lay;
+        uint64_t text;
+        int rc = scan_zst(fd, &lay, &acc, &pend, ti, &text);
+        close(fd);
+        out->units = acc.units + pend.units;
+        out->count = acc.count + pend.count;
+        return rc;
+    }
+    struct stat st;
+    struct file_map m;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || map_range(fd, 0, st.st_size, &m) != 0) {
+        close(fd);
+        return -1;
+    }
+    struct scan_acc acc = { 0, 0 }, pend = { 0, 0 };
+    struct csv_layout lay;
+    /* skip header */
+    size_t hdr = skip_header(m.data, m.len);
+    layout_of(m.data, hdr, &lay);
+    if (ti) ti->base = (off_t)hdr;
+    if (hdr > 0 && !(use_uring && st.st_size >= URING_MIN &&
+                     scan_uring(&lay, fd, (off_t)hdr, st.st_size, &acc, &pend, ti) >= 0)) {
+        /* mapped scan, or start over on the mapping */
+        acc.units = acc.count = pend.units = pend.count = 0;
+        if (ti) {
+            ti_reset(ti);
+            ti->base = (off_t)hdr;
+        }
+        scan_range(&lay, m.data + hdr, m.len - hdr, &acc, &pend, ti);
+    }
+    close(fd);
+    unmap_range(&m);
+    out->units = acc.units + pend.units;
+    out->count = acc.count + pend.count;
+    return 0;
+}
+
+static int scan_file(const char *csvfile, double *subtotal, int *count, struct time_index *ti) {
+    struct scan_acc acc;
+    if (compute_subtotal_units(csvfile, &acc, ti) != 0) return -1;
+    *subtotal = units_to_double(acc.units);
+    *count = (int)acc.count;
+    return 0;
+}
+
+/* ---- metrics ----
+   Counters and latency histograms are kept in one block per thread. Only the
+   owning thread writes its block, with plain relaxed stores (no locks, no
+   read-modify-write); STATS sums all blocks with relaxed loads. Threads
+   past the first METRICS_THREADS share the last block and add to it
+   atomically. Bucket i of a histogram counts latencies of at most 2^i
+   microseconds. */
+#define HIST_BUCKETS 24
+#define METRICS_THREADS 8
+
+struct histogram {
+    uint64_t count, sum_us;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+/* only uint64_t members: metrics_snapshot() adds blocks word by word */
+struct metrics {
+    uint64_t connections, requests, errors, stats_requests, pushes;
+    uint64_t bytes_in, bytes_out, reply_cache_hits, compressed_frames, compressed_saved;
+    uint64_t scan_bytes, cache_hits, cache_appends, cache_rescans, cache_evictions;
+    struct histogram request_us;    /* request line seen -> reply queued */
+    struct histogram scan_us;       /* one cache_subtotal() call */
+    struct histogram wait_us;       /* time blocked in epoll_wait() */
+};
+
+static struct metrics metrics_slot[METRICS_THREADS];
+static int metrics_used = 1;        /* slot 0 belongs to the main thread */
+static __thread struct metrics *tm = &metrics_slot[0];
+static __thread int tm_shared;      /* tm is the last block, which may be shared */
+
+/* Give the calling thread its own block; once all are taken, the last one
+   is shared, and everyone on it (its first owner too) adds atomically */
+static void metrics_register(void) {
+    int i = __atomic_fetch_add(&metrics_used, 1, __ATOMIC_RELAXED);
+    tm = &metrics_slot[i < METRICS_THREADS ? i : METRICS_THREADS - 1];
+    tm_shared = i >= METRICS_THREADS - 1;
+}
+
+static inline void stat_add(uint64_t *p, uint64_t v) {
+    if (__builtin_expect(tm_shared, 0)) __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+    else __atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+static void hist_record(struct histogram *h, uint64_t us) {
+    int i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+    stat_add(&h->count, 1);
+    stat_add(&h->sum_us, us);
+    stat_add(&h->bucket[i], 1);
+}
+
+/* Upper bound (us) of the bucket holding quantile q */
+static uint64_t hist_quantile(const struct histogram *h, double q) {
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) return 1ull << i;
+    }
+    return 1ull << (HIST_BUCKETS - 1);
+}
+
+static void metrics_snapshot(struct metrics *out) {
+    int n = __atomic_load_n(&metrics_used, __ATOMIC_RELAXED);
+    if (n > METRICS_THREADS) n = METRICS_THREADS;
+    memset(out, 0, sizeof(*out));
+    uint64_t *dst = (uint64_t *)out;
+    for (int t = 0; t < n; t++) {
+        const uint64_t *src = (const uint64_t *)&metrics_slot[t];
+        for (size_t k = 0; k < sizeof(*out) / sizeof(uint64_t); k++)
+            dst[k] += __atomic_load_n(&src[k], __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Running subtotal for one branch CSV. Rows up to 'offset' (always just past a
+   newline) have been folded into 'acc'; the file identity fields tell us
+   whether those rows can still be trusted on the next REQUEST. */
+#define CACHE_TAIL_SZ 64
+#define DELTA_HISTORY 256
+
+struct subtotal_cache {
+    int valid;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    off_t offset;
+    struct scan_acc acc;
+    struct csv_layout lay;  /* read off the header at the last full scan */
+    /* unterminated last row, counted in replies but not committed */
+    struct scan_acc pend;
+    /* per-hour totals of the committed rows (plus the pending row's hour) */
+    struct time_index ti;
+    /* last bytes before 'offset', used to spot in-place rewrites */
+    char tail[CACHE_TAIL_SZ];
+    size_t tail_len;
+    unsigned gen;           /* bumped whenever the state above changes */
+    /* reported totals (acc + pend) of the last DELTA_HISTORY generations,
+       to answer REQUEST SINCE; slot gen % DELTA_HISTORY */
+    unsigned hist_gen[DELTA_HISTORY];
+    struct scan_acc hist[DELTA_HISTORY];
+};
+
+/* The state changed: start a new generation and remember its totals */
+static void cache_commit(struct subtotal_cache *c) {
+    c->gen++;
+    unsigned i = c->gen % DELTA_HISTORY;
+    c->hist_gen[i] = c->gen;
+    c->hist[i].units = c->acc.units + c->pend.units;
+    c->hist[i].count = c->acc.count + c->pend.count;
+}
+
+/* Totals as of generation gen, if still remembered */
+static int cache_history(const struct subtotal_cache *c, unsigned gen, struct scan_acc *out) {
+    unsigned i = gen % DELTA_HISTORY;
+    if (gen == 0 || c->hist_gen[i] != gen) return -1;
+    *out = c->hist[i];
+    return 0;
+}
+
+/* Remember the bytes just before c->offset */
+static int cache_load_tail(struct subtotal_cache *c, int fd) {
+    off_t start = c->offset > CACHE_TAIL_SZ ? c->offset - CACHE_TAIL_SZ : 0;
+    c->tail_len = (size_t)(c->offset - start);
+    return pread(fd, c->tail, c->tail_len, start) == (ssize_t)c->tail_len ? 0 : -1;
+}
+
+/* Check that the previously consumed prefix is still what we parsed */
+static int cache_tail_matches(const struct subtotal_cache *c, int fd) {
+    char buf[CACHE_TAIL_SZ];
+    off_t start = c->offset - (off_t)c->tail_len;
+    if (pread(fd, buf, c->tail_len, start) != (ssize_t)c->tail_len) return 0;
+    return memcmp(buf, c->tail, c->tail_len) == 0;
+}
+
+/* cache_subtotal() for a compressed file: an archive is not appended to, so
+   any change means a full rescan */
+static int cache_subtotal_zst(struct subtotal_cache *c, int fd, const struct stat *st,
+                              struct scan_acc *out) {
+    uint64_t text = 0;
+    stat_add(&tm->cache_rescans, 1);
+    c->valid = 0;
+    c->acc.units = c->acc.count = 0;
+    c->pend.units = c->pend.count = 0;
+    ti_reset(&c->ti);
+    int rc = scan_zst(fd, &c->lay, &c->acc, &c->pend, &c->ti, &text);
+    close(fd);
+    if (rc != 0) return -1;
+    stat_add(&tm->scan_bytes, text);
+    c->offset = (off_t)text;
+    c->tail_len = 0;
+    c->dev = st->st_dev;
+    c->ino = st->st_ino;
+    c->size = st->st_size;
+    c->mtime = st->st_mtim;
+    c->valid = 1;
+    cache_commit(c);
+    out->units = c->acc.units + c->pend.units;
+    out->count = c->acc.count + c->pend.count;
+    return 0;
+}
+
+/* Bring the cache up to date with csvfile and report current totals.
+   Only bytes appended since the last call are parsed; a truncated, replaced or
+   rewritten file triggers a full rescan. */
+int cache_subtotal(struct subtotal_cache *c, const char *csvfile, struct scan_acc *out) {
+    int fd = open(csvfile, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return -1; }
+
+    int same_file = c->valid && st.st_dev == c->dev && st.st_ino == c->ino;
+    int unchanged = same_file && st.st_size == c->size &&
+                    st.st_mtim.tv_sec == c->mtime.tv_sec &&
+                    st.st_mtim.tv_nsec == c->mtime.tv_nsec;
+    if (unchanged) {
+        /* nothing new: reply straight from memory */
+        stat_add(&tm->cache_hits, 1);
+        close(fd);
+        out->units = c->acc.units + c->pend.units;
+        out->count = c->acc.count + c->pend.count;
+        return 0;
+    }
+
+    if (is_zst(csvfile)) return cache_subtotal_zst(c, fd, &st, out);
+
+    int appended = same_file && c->offset > 0 && st.st_size >= c->size &&
+                   cache_tail_matches(c, fd);
+    struct file_map m;
+    if (map_range(fd, appended ? c->offset : 0, st.st_size, &m) != 0) {
+        c->valid = 0;
+        close(fd);
+        return -1;
+    }
+    const char *p = m.data, *end = m.data + m.len;
+    stat_add(appended ? &tm->cache_appends : &tm->cache_rescans, 1);
+    stat_add(&tm->scan_bytes, m.len);
+    if (!appended) {
+        /* first scan, truncation, replacement or in-place edit */
+        c->valid = 0;
+        c->acc.units = 0;
+        c->acc.count = 0;
+        ti_reset(&c->ti);
+        if (m.len == 0) { close(fd); return -1; }
+        /* skip header; if it is not finished yet there is nothing to commit */
+        c->offset = (off_t)skip_header(p, m.len);
+        layout_of(p, (size_t)c->offset, &c->lay);
+        p += c->offset;
+    }
+    c->pend.units = 0;
+    c->pend.count = 0;
+    c->ti.pend_hour = TI_NO_HOUR;
+    c->ti.base = c->offset;
+    off_t done = -1;
+    if (c->offset > 0 && !appended && use_uring && st.st_size >= URING_MIN) {
+        done = scan_uring(&c->lay, fd, c->offset, st.st_size, &c->acc, &c->pend, &c->ti);
+        if (done < 0) {
+            /* start over on the mapping */
+            c->acc.units = c->acc.count = c->pend.units = c->pend.count = 0;
+            ti_reset(&c->ti);
+            c->ti.base = c->offset;
+        }
+    }
+    if (done >= 0)
+        c->offset = done;
+    else if (c->offset > 0)
+        c->offset += (off_t)scan_range(&c->lay, p, (size_t)(end - p), &c->acc, &c->pend, &c->ti);
+    unmap_range(&m);
+
+    if (cache_load_tail(c, fd) != 0) { close(fd); return -1; }
+    close(fd);
+    c->dev = st.st_dev;
+    c->ino = st.st_ino;
+    c->size = st.st_size;
+    c->mtime = st.st_mtim;
+    c->valid = 1;
+    cache_commit(c);
+
+    out->units = c->acc.units + c->pend.units;
+    out->count = c->acc.count + c->pend.count;
+    return 0;
+}
+
+/* ---- sidecar index ----
+   The cache, time index included, is saved next to the CSV as <CSV>.idx so a
+   restarted server answers from it right away; the usual identity, size,
+   mtime and tail checks in cache_subtotal() then decide whether it is still
+   current, needs only the appended rows parsed, or must be rebuilt. The file
+   is a cache, written with temp + rename and a checksum but not fsync'ed:
+   anything that fails to validate is ignored.
+
+   Layout (host byte order): struct sidecar_hdr, then nbuckets x struct
+   sidecar_bucket sorted by hour, with running (prefix) totals so a reader
+   of the mapped file can total any range from two entries. */
+#define SIDECAR_MAGIC "BSIDX002"
+#define SIDECAR_INTERVAL_US 1000000     /* save at most once a second */
+
+struct sidecar_hdr {
+    char magic[8];
+    uint32_t byte_order;    /* 0x01020304 as written */
+    uint32_t scale;         /* AMOUNT_SCALE */
+    uint64_t dev, ino;
+    int64_t size, mtime_sec, mtime_nsec;
+    int64_t offset;
+    int64_t units, count;
+    int64_t pend_units, pend_count;
+    int32_t pend_hour;
+    int32_t date_col, amount_col;   /* the layout the totals were read with */
+    uint32_t tail_len;
+    char tail[CACHE_TAIL_SZ];
+    uint64_t nbuckets;
+    uint64_t checksum;      /* FNV-1a of header (this field 0) and buckets */
+};
+
+struct sidecar_bucket {
+    int32_t hour;
+    uint32_t pad;
+    int64_t first_off;
+    int64_t cum_units, cum_count;   /* totals of this and all earlier buckets */
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+static int sidecar_save(const struct subtotal_cache *c, const char *path) {
+    if (!c->valid || c->ti.oom) return 0;
+    struct sidecar_hdr h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SIDECAR_MAGIC, 8);
+    h.byte_order = 0x01020304;
+    h.scale = (uint32_t)AMOUNT_SCALE;
+    h.dev = (uint64_t)c->dev;
+    h.ino = (uint64_t)c->ino;
+    h.size = c->size;
+    h.mtime_sec = c->mtime.tv_sec;
+    h.mtime_nsec = c->mtime.tv_nsec;
+    h.offset = c->offset;
+    h.units = c->acc.units;
+    h.count = c->acc.count;
+    h.pend_units = c->pend.units;
+    h.pend_count = c->pend.count;
+    h.pend_hour = c->ti.pend_hour;
+    h.date_col = c->lay.date_col;
+    h.amount_col = c->lay.amount_col;
+    h.tail_len = (uint32_t)c->tail_len;
+    memcpy(h.tail, c->tail, c->tail_len);
+    h.nbuckets = c->ti.n;
+
+    size_t blen = c->ti.n * sizeof(struct sidecar_bucket);
+    struct sidecar_bucket *b = malloc(blen ? blen : 1);
+    if (!b) return -1;
+    int64_t cu = 0, cc = 0;
+    for (size_t i = 0; i < c->ti.n; i++) {
+        cu += c->ti.v[i].acc.units;
+        cc += c->ti.v[i].acc.count;
+        b[i].hour = c->ti.v[i].hour;
+        b[i].pad = 0;
+        b[i].first_off = c->ti.v[i].first_off;
+        b[i].cum_units = cu;
+        b[i].cum_count = cc;
+    }
+    h.checksum = fnv1a(fnv1a(0xcbf29ce484222325ull, &h, sizeof(h)), b, blen);
+
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int rc = -1;
+    if (fd >= 0) {
+        rc = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+             (blen == 0 || write(fd, b, blen) == (ssize_t)blen) ? 0 : -1;
+        if (close(fd) != 0) rc = -1;
+        if (rc == 0) rc = rename(tmp, path);
+        if (rc != 0) unlink(tmp);
+    }
+    free(b);
+    return rc;
+}
+
+/* Restore the cache from path; 0 if it was loaded */
+static int sidecar_load(struct subtotal_cache *c, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    struct file_map m;
+    int rc = -1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct sidecar_hdr) ||
+        map_range(fd, 0, st.st_size, &m) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    struct sidecar_hdr h;
+    memcpy(&h, m.data, sizeof(h));
+    const struct sidecar_bucket *b = (const void *)(m.data + sizeof(h));
+    uint64_t sum = h.checksum;
+    h.checksum = 0;
+    if (memcmp(h.magic, SIDECAR_MAGIC, 8) != 0 || h.byte_order != 0x01020304 ||
+        h.scale != (uint32_t)AMOUNT_SCALE || h.tail_len > CACHE_TAIL_SZ ||
+        h.date_col < 0 || h.date_col >= CSV_MAX_COLS || h.amount_col < 0 || h.amount_col >= CSV_MAX_COLS ||
+        h.nbuckets > (m.len - sizeof(h)) / sizeof(*b) ||
+        m.len != sizeof(h) + h.nbuckets * sizeof(*b))
+        goto out;
+    if (fnv1a(fnv1a(0xcbf29ce484222325ull, &h, sizeof(h)), b, h.nbuckets * sizeof(*b)) != sum)
+        goto out;
+
+    ti_reset(&c->ti);
+    int64_t pu = 0, pc = 0;
+    for (uint64_t i = 0; i < h.nbuckets; i++) {
+        ti_add(&c->ti, b[i].hour, (off_t)b[i].first_off, b[i].cum_units - pu, b[i].cum_count - pc);
+        pu = b[i].cum_units;
+        pc = b[i].cum_count;
+    }
+    c->ti.pend_hour = h.pend_hour;
+    layout_at(h.date_col, h.amount_col, &c->lay);
+    c->dev = (dev_t)h.dev;
+    c->ino = (ino_t)h.ino;
+    c->size = (off_t)h.size;
+    c->mtime.tv_sec = (time_t)h.mtime_sec;
+    c->mtime.tv_nsec = (long)h.mtime_nsec;
+    c->offset = (off_t)h.offset;
+    c->acc.units = h.units;
+    c->acc.count = h.count;
+    c->pend.units = h.pend_units;
+    c->pend.count = h.pend_count;
+    c->tail_len = h.tail_len;
+    memcpy(c->tail, h.tail, h.tail_len);
+    c->valid = !c->ti.oom;
+    if (c->valid) cache_commit(c);
+    rc = c->valid ? 0 : -1;
+out:
+    unmap_range(&m);
+    return rc;
+}
+
 int start_server(const char *port) {
     struct addrinfo hints, *res, *rp;
     int sfd = -1;
@@ -50,7 +1615,7 @@ int start_server(const char *port) {
         int opt = 1;
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
         if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0) {
-            if (listen(sfd, BACKLOG) == 0) break;
+            if (listen(sfd, BACKLOG) == 0 && fcntl(sfd, F_SETFL, O_NONBLOCK) == 0) break;
         }
         close(sfd);
         sfd = -1;
@@ -59,6 +1624,26 @@ int start_server(const char *port) {
     return sfd;
 }
 
+/* Listener on a Unix socket at path (--unix), for clients on this host; a
+   stale socket left by an earlier run is replaced */
+static int start_unix_server(const char *path) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    struct stat st;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(sa.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    int sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0) return -1;
+    if (bind(sfd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(sfd, BACKLOG) != 0) {
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+
 ssize_t robust_recv(int fd, void *buf, size_t count) {
     ssize_t r;
     while (1) {
@@ -81,62 +1666,1635 @@ ssize_t robust_send(int fd, const void *buf, size_t count) {
     return sent;
 }
 
-int handle_client(int cfd, const char *branch_id, const char *csvfile) {
-    char req[128];
-    ssize_t r = robust_recv(cfd, req, sizeof(req)-1);
-    if (r <= 0) return -1;
-    req[r] = '\0';
-    if (strstr(req, "REQUEST") == NULL) {
-        // Unexpected; ignore
+/* ---- event loop ----
+   One thread multiplexes every connection with epoll; CSV scanning runs on a
+   separate scan thread so a long scan never blocks accepts or replies.
+   Requests that arrive while a scan is running wait for that scan's result
+   instead of starting another one.
+
+   A connection carries one REQUEST and is closed after the reply, unless the
+   client opens with "HELLO KEEPALIVE". Then it stays open and may pipeline
+   any number of newline-terminated requests; replies come back in order,
+   each framed by a terminating "END" line, or as length-prefixed binary
+   frames after "HELLO BINARY". Requests are always text lines. "STATS"
+   returns the metrics block, and "GET /metrics" (HTTP) the same data in the
+   Prometheus text format. */
+
+#define MAX_EVENTS 64
+#define CONN_IN_SZ 4096
+#define REPLY_SZ 512
+
+struct scan_result {
+    int rc;
+    struct scan_acc totals;
+    /* the scanner's cache, for range queries; only read while the scan
+       thread is idle, i.e. before the next scanner_kick() */
+    const struct subtotal_cache *cache;
+};
+
+struct conn {
+    int fd;
+    int keepalive;      /* negotiated with HELLO KEEPALIVE */
+    int binary;         /* negotiated with HELLO BINARY: replies are binary frames */
+    int codec;          /* ... and HELLO ZSTD or LZ4: FRAME_F_* of compressed ones, or 0 */
+    int waiting;        /* parked on the scanner; input is not parsed meanwhile */
+    int eof;            /* peer shut down its sending side */
+    int done;           /* no more requests will be served; close once drained */
+    int dead;           /* hung up while parked; freed when the scan returns */
+    char in[CONN_IN_SZ];
+    size_t inlen;
+    char *out;
+    size_t outlen, outoff, outcap;
+    struct conn *next_waiter;
+    uint64_t req_start_us;  /* when the REQUEST being answered was first seen */
+    int target;             /* while waiting: branch index, or ROUTE_ALL */
+    unsigned long long seq; /* seq of the last delta reply sent */
+    struct branch *sub;     /* on this branch's subscriber list, see SUBSCRIBE */
+    struct conn *sub_prev, *sub_next;
+};
+
+/* One scan thread serves every hosted branch. It owns their caches: a cache
+   is written only there, and the event loop reads one only while that
+   branch is 'held', from its scanner_kick() until scanner_release() after
+   the loop has handled the result; eviction leaves held caches alone. The
+   loop queues branches and the scan thread hands them back through efd. */
+struct scanner {
+    const char *csvfile;
+    struct subtotal_cache cache;
+    struct scan_result last;
+    int held;               /* queued, scanning or result not yet handled (mu) */
+    struct scanner *next;   /* on the queue or the done list (mu) */
+    uint64_t used_us;       /* last scan, to pick eviction victims */
+    /* sidecar index: saved by the scan thread when it is idle */
+    const char *idxpath;    /* NULL with --no-index */
+    unsigned saved_gen;
+    uint64_t saved_us;
+    int save_failed;
+};
+
+struct scan_service {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    struct scanner *head, *tail;    /* waiting for a scan, in order */
+    struct scanner *done;           /* scanned, result not collected yet */
+    int efd;
+    struct scanner **all;
+    size_t n;
+    size_t budget;          /* bytes of time index over all branches, 0: no limit */
+};
+
+static void scanner_save(struct scanner *sc) {
+    if (sidecar_save(&sc->cache, sc->idxpath) != 0 && !sc->save_failed) {
+        perror("save index");
+        sc->save_failed = 1;
+    }
+    sc->saved_gen = sc->cache.gen;
+    sc->saved_us = now_us();
+}
+
+/* Wait for the next scan request (mu held); meanwhile save each sidecar once
+   it is dirty and SIDECAR_INTERVAL_US has passed since its last save */
+static void scanner_wait(struct scan_service *ss) {
+    while (!ss->head) {
+        struct scanner *due_sc = NULL;
+        uint64_t due = 0;
+        for (size_t i = 0; i < ss->n; i++) {
+            struct scanner *sc = ss->all[i];
+            if (!sc->idxpath || !sc->cache.valid || sc->cache.gen == sc->saved_gen) continue;
+            if (!due_sc || sc->saved_us + SIDECAR_INTERVAL_US < due) {
+                due_sc = sc;
+                due = sc->saved_us + SIDECAR_INTERVAL_US;
+            }
+        }
+        if (!due_sc) {
+            pthread_cond_wait(&ss->cv, &ss->mu);
+            continue;
+        }
+        uint64_t now = now_us();
+        if (now >= due) {
+            pthread_mutex_unlock(&ss->mu);
+            scanner_save(due_sc);
+            pthread_mutex_lock(&ss->mu);
+            continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_nsec + (due - now) * 1000;
+        ts.tv_sec += (time_t)(ns / 1000000000);
+        ts.tv_nsec = (long)(ns % 1000000000);
+        pthread_cond_timedwait(&ss->cv, &ss->mu, &ts);
+    }
+}
+
+/* Keep the time indexes of all branches within the budget (mu held) by
+   dropping the least recently scanned ones that are not held; such a
+   branch rescans its CSV on its next request */
+static void scan_evict(struct scan_service *ss) {
+    if (!ss->budget) return;
+    for (;;) {
+        size_t total = 0;
+        struct scanner *lru = NULL;
+        for (size_t i = 0; i < ss->n; i++) {
+            struct scanner *sc = ss->all[i];
+            total += sc->cache.ti.cap * sizeof(struct time_bucket);
+            if (!sc->held && sc->cache.ti.cap && (!lru || sc->used_us < lru->used_us)) lru = sc;
+        }
+        if (total <= ss->budget || !lru) return;
+        ti_free(&lru->cache.ti);
+        lru->cache.valid = 0;
+        stat_add(&tm->cache_evictions, 1);
+    }
+}
+
+static void *scan_thread(void *arg) {
+    struct scan_service *ss = arg;
+    metrics_register();
+    for (;;) {
+        pthread_mutex_lock(&ss->mu);
+        scanner_wait(ss);
+        struct scanner *sc = ss->head;
+        ss->head = sc->next;
+        if (!ss->head) ss->tail = NULL;
+        pthread_mutex_unlock(&ss->mu);
+
+        struct scan_result res = { 0, { 0, 0 }, &sc->cache };
+        uint64_t t0 = now_us();
+        res.rc = cache_subtotal(&sc->cache, sc->csvfile, &res.totals);
+        sc->used_us = now_us();
+        hist_record(&tm->scan_us, sc->used_us - t0);
+
+        pthread_mutex_lock(&ss->mu);
+        sc->last = res;
+        sc->next = ss->done;
+        ss->done = sc;
+        scan_evict(ss);
+        pthread_mutex_unlock(&ss->mu);
+        uint64_t one = 1;
+        while (write(ss->efd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+static void scanner_kick(struct scan_service *ss, struct scanner *sc) {
+    pthread_mutex_lock(&ss->mu);
+    sc->held = 1;
+    sc->next = NULL;
+    if (ss->tail) ss->tail->next = sc;
+    else ss->head = sc;
+    ss->tail = sc;
+    pthread_cond_signal(&ss->cv);
+    pthread_mutex_unlock(&ss->mu);
+}
+
+/* Take the finished scans (their results stay valid until released) */
+static struct scanner *scanner_collect(struct scan_service *ss) {
+    pthread_mutex_lock(&ss->mu);
+    struct scanner *list = ss->done;
+    ss->done = NULL;
+    pthread_mutex_unlock(&ss->mu);
+    return list;
+}
+
+static void scanner_release(struct scan_service *ss, struct scanner *sc) {
+    pthread_mutex_lock(&ss->mu);
+    sc->held = 0;
+    pthread_mutex_unlock(&ss->mu);
+}
+
+/* Make room for len more bytes of output */
+static int conn_reserve(struct conn *c, size_t len) {
+    if (c->outlen + len > c->outcap) {
+        size_t cap = c->outcap ? c->outcap : REPLY_SZ;
+        while (cap < c->outlen + len) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if (!p) return -1;
+        c->out = p;
+        c->outcap = cap;
+    }
+    return 0;
+}
+
+/* Append len bytes to the connection's output */
+static int conn_append(struct conn *c, const char *data, size_t len) {
+    if (conn_reserve(c, len) != 0) return -1;
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
+    return 0;
+}
+
+/* Binary reply frame, negotiated with HELLO BINARY (all integers big-endian):
+     u8 magic 0xB1 | u8 type | u16 flags | u32 payload length | payload
+   FRAME_TOTALS payload: u8 id length | id | i64 records | i64 subtotal in
+   1/AMOUNT_SCALE units. FRAME_ERROR payload: message text. The magic byte is
+   not ASCII, so a reader can tell binary frames from text replies.
+   A client that also sent HELLO ZSTD or LZ4 (the first one we support wins)
+   gets payloads of --compress-min bytes or more compressed, if that makes
+   them smaller: the flags name the codec and the payload becomes u32
+   original length | compressed data. */
+#define FRAME_MAGIC 0xB1
+#define FRAME_HDR_SZ 8
+#define FRAME_TOTALS 1
+#define FRAME_ERROR 2
+#define FRAME_STATS 3   /* payload: the text STATS body */
+#define FRAME_BUCKETS 4 /* TOTALS payload, then u8 group | u32 n | n x
+                           (i64 bucket start, unix time | i64 records | i64 subtotal) */
+#define FRAME_DELTA 5   /* reply to REQUEST SINCE, see append_delta_reply() */
+#define FRAME_BRANCHES 6 /* reply to REQUEST ALL, see append_all_reply() */
+#define FRAME_F_ZSTD 0x0001 /* payload is a zstd frame */
+#define FRAME_F_LZ4 0x0002  /* payload is an LZ4 block */
+#define COMPRESS_MIN 512    /* --compress-min default */
+#define ZSTD_LEVEL 1        /* fast: replies are compressed on the event loop */
+
+static size_t compress_min = COMPRESS_MIN;
+
+static unsigned char *put_be(unsigned char *p, unsigned long long v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+    return p + bytes;
+}
+
+/* The FRAME_F_* flag for a HELLO feature, if it names a codec built in */
+static int codec_of(const char *feature) {
+#ifdef HAVE_ZSTD
+    if (strcmp(feature, "ZSTD") == 0) return FRAME_F_ZSTD;
+#endif
+#ifdef HAVE_LZ4
+    if (strcmp(feature, "LZ4") == 0) return FRAME_F_LZ4;
+#endif
+    (void)feature;
+    return 0;
+}
+
+/* Append the frame compressed with c's codec, straight into c's output.
+   Returns 1, with nothing appended, if that would not make it smaller. */
+static int append_packed(struct conn *c, int type, const unsigned char *payload, size_t len) {
+    size_t bound = 0, n = 0;
+#ifdef HAVE_ZSTD
+    static ZSTD_CCtx *cctx;
+    if (c->codec == FRAME_F_ZSTD && (cctx || (cctx = ZSTD_createCCtx()))) bound = ZSTD_compressBound(len);
+#endif
+#ifdef HAVE_LZ4
+    if (c->codec == FRAME_F_LZ4 && len <= LZ4_MAX_INPUT_SIZE) bound = (size_t)LZ4_compressBound((int)len);
+#endif
+    if (bound == 0 || len > UINT32_MAX) return 1;
+    if (conn_reserve(c, FRAME_HDR_SZ + 4 + bound) != 0) return -1;
+    unsigned char *f = (unsigned char *)c->out + c->outlen, *dst = f + FRAME_HDR_SZ + 4;
+    (void)dst;
+    (void)payload;      /* without a codec built in */
+#ifdef HAVE_ZSTD
+    if (c->codec == FRAME_F_ZSTD) {
+        n = ZSTD_compressCCtx(cctx, dst, bound, payload, len, ZSTD_LEVEL);
+        if (ZSTD_isError(n)) n = 0;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (c->codec == FRAME_F_LZ4) {
+        int r = LZ4_compress_default((const char *)payload, (char *)dst, (int)len, (int)bound);
+        n = r > 0 ? (size_t)r : 0;
+    }
+#endif
+    if (n == 0 || n + 4 >= len) return 1;
+    f[0] = FRAME_MAGIC;
+    f[1] = (unsigned char)type;
+    put_be(f + 2, (unsigned long long)c->codec, 2);
+    put_be(f + 4, n + 4, 4);
+    put_be(f + FRAME_HDR_SZ, len, 4);
+    c->outlen += FRAME_HDR_SZ + 4 + n;
+    stat_add(&tm->compressed_frames, 1);
+    stat_add(&tm->compressed_saved, len - n - 4);
+    return 0;
+}
+
+static int append_frame(struct conn *c, int type, const unsigned char *payload, size_t len) {
+    if (c->codec && len >= compress_min) {
+        int rc = append_packed(c, type, payload, len);
+        if (rc <= 0) return rc;
+    }
+    unsigned char hdr[FRAME_HDR_SZ], *p = hdr;
+    *p++ = FRAME_MAGIC;
+    *p++ = (unsigned char)type;
+    p = put_be(p, 0, 2);
+    put_be(p, len, 4);
+    if (conn_append(c, (const char *)hdr, sizeof(hdr)) != 0) return -1;
+    return conn_append(c, (const char *)payload, len);
+}
+
+static int format_reply(struct conn *c, const char *branch_id, const struct scan_result *res) {
+    if (c->binary) {
+        unsigned char payload[1 + 255 + 16], *p = payload;
+        if (res->rc != 0) {
+            const char *msg = "cannot read CSV";
+            return append_frame(c, FRAME_ERROR, (const unsigned char *)msg, strlen(msg));
+        }
+        size_t idlen = strlen(branch_id);
+        if (idlen > 255) idlen = 255;
+        *p++ = (unsigned char)idlen;
+        memcpy(p, branch_id, idlen);
+        p += idlen;
+        p = put_be(p, (unsigned long long)res->totals.count, 8);
+        p = put_be(p, (unsigned long long)res->totals.units, 8);
+        return append_frame(c, FRAME_TOTALS, payload, (size_t)(p - payload));
+    }
+    char out[REPLY_SZ], amt[32];
+    int len;
+    format_units(amt, sizeof(amt), res->totals.units);
+    if (res->rc != 0)
+        len = snprintf(out, sizeof(out), "ERROR: cannot read CSV\nEND\n");
+    else
+        len = snprintf(out, sizeof(out), "BRANCH_ID: %s\nRECORDS: %lld\nSUBTOTAL: %s\nEND\n",
+                       branch_id, res->totals.count, amt);
+    if (len < 0 || (size_t)len >= sizeof(out)) return -1;
+    return conn_append(c, out, (size_t)len);
+}
+
+/* The plain REQUEST reply only changes with the cache generation, so it is
+   formatted once per generation and copied from here until the next one.
+   There is a copy per encoding a connection may get: text, and binary with
+   each codec (a frame over --compress-min goes out compressed). Used by the
+   event loop thread only. */
+#define REPLY_SLOTS (2 + FRAME_F_LZ4)
+
+struct reply_cache {
+    unsigned gen[REPLY_SLOTS];  /* 0: empty */
+    size_t len[REPLY_SLOTS];
+    char buf[REPLY_SLOTS][REPLY_SZ];
+};
+
+/* ---- hosted branches ----
+   A server hosts one branch, or every branch of a --manifest on one port.
+   Requests pick theirs with "BRANCH <id>"; "REQUEST ALL" (the default for
+   a plain REQUEST with a manifest) answers for all of them at once. */
+#define ROUTE_ALL (-1)
+#define ROUTE_NONE (-2)     /* unknown branch, or no result at hand */
+
+struct branch {
+    const char *id;
+    uint32_t boot;              /* high half of its seqs, see append_delta_reply() */
+    struct scanner sc;
+    struct scan_result res;     /* of its last finished scan */
+    struct conn *waiters;       /* parked until its running scan finishes */
+    struct conn *subscribers;   /* get a delta pushed after every scan */
+    int inflight;               /* queued on the scan thread or scanning */
+    int rescan;                 /* scan again once the running one is back */
+    int changed;                /* inotify saw a change; scan when the timer fires */
+    int in_sweep;               /* the running REQUEST ALL waits for this one */
+    int wd;                     /* inotify watch while it has subscribers */
+    struct reply_cache replies;
+};
+
+struct host {
+    const char *id;             /* BRANCH_ID of ALL replies and STATS */
+    struct branch *v;
+    size_t n;
+    int multi;                  /* --manifest: a plain REQUEST means ALL */
+    struct conn *all_waiters;   /* parked on the running sweep */
+    size_t sweep_pending;       /* branches the sweep still waits for */
+    struct scan_service scans;
+    struct shm_slot *shm;       /* --shm: one slot per branch, else NULL */
+};
+
+static int find_branch(const struct host *h, const char *id) {
+    for (size_t i = 0; i < h->n; i++)
+        if (strcmp(h->v[i].id, id) == 0) return (int)i;
+    return ROUTE_NONE;
+}
+
+static void sub_link(struct branch *b, struct conn *c) {
+    c->sub = b;
+    c->sub_prev = NULL;
+    c->sub_next = b->subscribers;
+    if (b->subscribers) b->subscribers->sub_prev = c;
+    b->subscribers = c;
+}
+
+static void sub_unlink(struct conn *c) {
+    if (!c->sub) return;
+    if (c->sub_prev) c->sub_prev->sub_next = c->sub_next;
+    else c->sub->subscribers = c->sub_next;
+    if (c->sub_next) c->sub_next->sub_prev = c->sub_prev;
+    c->sub = NULL;
+}
+
+static int append_reply(struct conn *c, struct branch *b, const struct scan_result *res) {
+    struct reply_cache *rc = &b->replies;
+    int slot = c->binary ? 1 + c->codec : 0;
+    unsigned gen = res->rc == 0 && res->cache ? res->cache->gen : 0;
+    if (gen && rc->gen[slot] == gen) {
+        stat_add(&tm->reply_cache_hits, 1);
+        return conn_append(c, rc->buf[slot], rc->len[slot]);
+    }
+    size_t start = c->outlen;
+    if (format_reply(c, b->id, res) != 0) return -1;
+    size_t len = c->outlen - start;
+    if (gen && len <= sizeof(rc->buf[slot])) {
+        memcpy(rc->buf[slot], c->out + start, len);
+        rc->len[slot] = len;
+        rc->gen[slot] = gen;
+    }
+    return 0;
+}
+
+static int append_error(struct conn *c, const char *msg) {
+    if (c->binary) return append_frame(c, FRAME_ERROR, (const unsigned char *)msg, strlen(msg));
+    char out[REPLY_SZ];
+    int len = snprintf(out, sizeof(out), "ERROR: %s\nEND\n", msg);
+    return conn_append(c, out, (size_t)len);
+}
+
+/* REQUEST [BRANCH <id> | ALL] [FROM <date>] [TO <date>] [GROUP BY day|hour]
+   Dates are YYYY-MM-DD or YYYY-MM-DDTHH, both bounds inclusive (TO a bare
+   date covers that whole day). A plain REQUEST totals every row; a windowed
+   one only rows whose date parses.
+   REQUEST SINCE <seq> asks for the change since the reply that carried seq
+   (0 = none yet); see append_delta_reply(). */
+#define GROUP_NONE 0
+#define GROUP_DAY 1
+#define GROUP_HOUR 2
+
+struct range_query {
+    int windowed;
+    int32_t lo, hi;         /* hour range */
+    int group;
+    int delta;              /* SINCE given */
+    unsigned long long since;
+    int all;                /* ALL given */
+    char branch[256];       /* BRANCH given, else empty */
+};
+
+/* Parse the words after REQUEST; -1 if they are not a valid query */
+static int parse_query(const char *args, struct range_query *q) {
+    q->windowed = 0;
+    q->lo = INT32_MIN;
+    q->hi = INT32_MAX;
+    q->group = GROUP_NONE;
+    q->delta = 0;
+    q->since = 0;
+    q->all = 0;
+    q->branch[0] = '\0';
+    char copy[CONN_IN_SZ];
+    snprintf(copy, sizeof(copy), "%s", args);
+    char *save, *tok = strtok_r(copy, " \t", &save);
+    for (; tok; tok = strtok_r(NULL, " \t", &save)) {
+        int32_t h;
+        int has_hour;
+        if (strcasecmp(tok, "FROM") == 0 || strcasecmp(tok, "TO") == 0) {
+            int from = tok[0] == 'F' || tok[0] == 'f';
+            char *d = strtok_r(NULL, " \t", &save);
+            if (!d || parse_date_hour(d, strlen(d), &h, &has_hour) != 0) return -1;
+            if (from) q->lo = h;
+            else q->hi = has_hour ? h : h + 23;
+        } else if (strcasecmp(tok, "GROUP") == 0) {
+            char *by = strtok_r(NULL, " \t", &save);
+            char *unit = strtok_r(NULL, " \t", &save);
+            if (!by || !unit || strcasecmp(by, "BY") != 0) return -1;
+            if (strcasecmp(unit, "day") == 0) q->group = GROUP_DAY;
+            else if (strcasecmp(unit, "hour") == 0) q->group = GROUP_HOUR;
+            else return -1;
+        } else if (strcasecmp(tok, "SINCE") == 0) {
+            char *v = strtok_r(NULL, " \t", &save), *end;
+            if (!v) return -1;
+            errno = 0;
+            q->since = strtoull(v, &end, 10);
+            if (errno || *end) return -1;
+            q->delta = 1;
+            continue;
+        } else if (strcasecmp(tok, "BRANCH") == 0) {
+            char *id = strtok_r(NULL, " \t", &save);
+            if (!id || strlen(id) >= sizeof(q->branch)) return -1;
+            strcpy(q->branch, id);
+            continue;
+        } else if (strcasecmp(tok, "ALL") == 0) {
+            q->all = 1;
+            continue;
+        } else {
+            return -1;
+        }
+        q->windowed = 1;
+    }
+    /* deltas are of the plain totals only; ALL is plain totals only */
+    if (q->all && (q->branch[0] || q->delta || q->windowed)) return -1;
+    return q->delta && q->windowed ? -1 : 0;
+}
+
+/* Sequence numbers: the branch's boot id (this process's, offset per hosted
+   branch) in the high 32 bits, the cache generation in the low ones, so a
+   number from before a restart or of another branch is never mistaken for a
+   current one */
+static uint32_t boot_id;
+
+#define DELTA_FULL 0
+#define DELTA_CHANGED 1
+#define DELTA_UNCHANGED 2
+
+/* Reply to REQUEST SINCE: the difference between the current totals and
+   those of the generation named by 'since' (DELTA_CHANGED, or
+   DELTA_UNCHANGED if there is none), or the full totals when that
+   generation is unknown (DELTA_FULL: first request, restart, or too old).
+   Text replies carry "SEQ: <n>" to send next time and exact amounts:
+     BRANCH_ID / SEQ / RECORDS + SUBTOTAL           (full)
+     BRANCH_ID / SEQ / DELTA_RECORDS + DELTA_SUBTOTAL
+     BRANCH_ID / SEQ / UNCHANGED
+   Binary: FRAME_DELTA, TOTALS-style id then u64 seq | u8 kind | i64 records
+   | i64 subtotal. */
+static int append_delta_reply(struct conn *c, struct branch *b, const struct scan_result *res,
+                              const struct range_query *q) {
+    if (res->rc != 0) return append_reply(c, b, res);
+    const char *branch_id = b->id;
+    const struct subtotal_cache *cache = res->cache;
+    unsigned long long seq = (unsigned long long)b->boot << 32 | cache->gen;
+    struct scan_acc base, d = res->totals;
+    int kind = DELTA_FULL;
+    if ((uint32_t)(q->since >> 32) == b->boot &&
+        cache_history(cache, (unsigned)(q->since & 0xffffffffu), &base) == 0) {
+        d.units -= base.units;
+        d.count -= base.count;
+        kind = d.units == 0 && d.count == 0 ? DELTA_UNCHANGED : DELTA_CHANGED;
+    }
+    if (c->binary) {
+        unsigned char payload[1 + 255 + 25], *p = payload;
+        size_t idlen = strlen(branch_id);
+        if (idlen > 255) idlen = 255;
+        *p++ = (unsigned char)idlen;
+        memcpy(p, branch_id, idlen);
+        p += idlen;
+        p = put_be(p, seq, 8);
+        *p++ = (unsigned char)kind;
+        p = put_be(p, (unsigned long long)d.count, 8);
+        p = put_be(p, (unsigned long long)d.units, 8);
+        c->seq = seq;
+        return append_frame(c, FRAME_DELTA, payload, (size_t)(p - payload));
+    }
+    char out[REPLY_SZ], amt[48];
+    format_units(amt, sizeof(amt), d.units);
+    int len;
+    if (kind == DELTA_UNCHANGED)
+        len = snprintf(out, sizeof(out), "BRANCH_ID: %s\nSEQ: %llu\nUNCHANGED\nEND\n",
+                       branch_id, seq);
+    else
+        len = snprintf(out, sizeof(out), "BRANCH_ID: %s\nSEQ: %llu\n%sRECORDS: %lld\n%sSUBTOTAL: %s\nEND\n",
+                       branch_id, seq, kind == DELTA_FULL ? "" : "DELTA_", d.count,
+                       kind == DELTA_FULL ? "" : "DELTA_", amt);
+    if (len < 0 || (size_t)len >= sizeof(out)) return -1;
+    c->seq = seq;
+    return conn_append(c, out, (size_t)len);
+}
+
+#define PUSH_COALESCE_MS 50     /* appends within this window share one scan and push */
+#define PUSH_BACKLOG_MAX (64u << 10)    /* drop subscribers that stop reading */
+
+/* After a scan: send a subscriber what changed since its last reply. Returns
+   -1 if it should be dropped. */
+static int push_delta(struct conn *c, struct branch *b, const struct scan_result *res) {
+    if (res->rc != 0) return 0;
+    unsigned long long seq = (unsigned long long)b->boot << 32 | res->cache->gen;
+    if (c->seq == seq) return 0;
+    struct scan_acc base;
+    if ((uint32_t)(c->seq >> 32) == b->boot &&
+        cache_history(res->cache, (unsigned)(c->seq & 0xffffffffu), &base) == 0 &&
+        base.units == res->totals.units && base.count == res->totals.count) {
+        c->seq = seq;   /* e.g. only a partial last row changed: nothing to send */
+        return 0;
+    }
+    if (c->outlen - c->outoff > PUSH_BACKLOG_MAX) return -1;
+    struct range_query q = { .delta = 1, .since = c->seq };
+    if (append_delta_reply(c, b, res, &q) != 0) return -1;
+    stat_add(&tm->pushes, 1);
+    return 0;
+}
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+struct query_group {
+    int64_t key;            /* day or hour number */
+    struct scan_acc acc;
+};
+
+/* Add one hour's totals to the result; hours arrive in order except for the
+   pending row, which may land anywhere */
+static int group_add(struct query_group **v, size_t *n, size_t *cap, int64_t key,
+                     const struct scan_acc *a) {
+    size_t i = *n;
+    while (i > 0 && (*v)[i-1].key > key) i--;
+    if (i > 0 && (*v)[i-1].key == key) {
+        (*v)[i-1].acc.units += a->units;
+        (*v)[i-1].acc.count += a->count;
+        return 0;
+    }
+    if (*n == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        struct query_group *nv = realloc(*v, ncap * sizeof(**v));
+        if (!nv) return -1;
+        *v = nv;
+        *cap = ncap;
+    }
+    memmove(&(*v)[i + 1], &(*v)[i], (*n - i) * sizeof(**v));
+    (*v)[i].key = key;
+    (*v)[i].acc = *a;
+    (*n)++;
+    return 0;
+}
+
+/* Answer a windowed query from the time index: O(buckets in range) */
+static int append_query_reply(struct conn *c, struct branch *b, const struct scan_result *res,
+                              const struct range_query *q) {
+    const char *branch_id = b->id;
+    const struct subtotal_cache *cache = res->cache;
+    if (res->rc != 0) return append_reply(c, b, res);
+    if (cache->ti.oom) return append_error(c, "time index incomplete");
+    struct scan_acc total = { 0, 0 };
+    struct query_group *groups = NULL;
+    size_t ng = 0, gcap = 0;
+    int64_t div = q->group == GROUP_DAY ? 24 : 1;
+    int rc = 0;
+    const struct time_index *ti = &cache->ti;
+    for (size_t i = ti_lower_bound(ti, q->lo); i < ti->n && ti->v[i].hour <= q->hi; i++) {
+        total.units += ti->v[i].acc.units;
+        total.count += ti->v[i].acc.count;
+        if (q->group && group_add(&groups, &ng, &gcap, floor_div(ti->v[i].hour, div),
+                                  &ti->v[i].acc) != 0) rc = -1;
+    }
+    if (cache->pend.count > 0 && ti->pend_hour != TI_NO_HOUR &&
+        ti->pend_hour >= q->lo && ti->pend_hour <= q->hi) {
+        total.units += cache->pend.units;
+        total.count += cache->pend.count;
+        if (q->group && group_add(&groups, &ng, &gcap, floor_div(ti->pend_hour, div),
+                                  &cache->pend) != 0) rc = -1;
+    }
+    if (rc != 0) { free(groups); return -1; }
+
+    /* not through append_reply(): the reply cache holds the plain totals */
+    struct scan_result window = { 0, total, cache };
+    if (!q->group) return format_reply(c, branch_id, &window);
+    if (c->binary) {
+        size_t idlen = strlen(branch_id);
+        if (idlen > 255) idlen = 255;
+        size_t plen = 1 + idlen + 16 + 1 + 4 + ng * 24;
+        unsigned char *payload = malloc(plen), *p = payload;
+        if (!payload) { free(groups); return -1; }
+        *p++ = (unsigned char)idlen;
+        memcpy(p, branch_id, idlen);
+        p += idlen;
+        p = put_be(p, (unsigned long long)total.count, 8);
+        p = put_be(p, (unsigned long long)total.units, 8);
+        *p++ = (unsigned char)q->group;
+        p = put_be(p, ng, 4);
+        for (size_t i = 0; i < ng; i++) {
+            p = put_be(p, (unsigned long long)(groups[i].key * div * 3600), 8);
+            p = put_be(p, (unsigned long long)groups[i].acc.count, 8);
+            p = put_be(p, (unsigned long long)groups[i].acc.units, 8);
+        }
+        rc = append_frame(c, FRAME_BUCKETS, payload, plen);
+        free(payload);
+        free(groups);
+        return rc;
+    }
+    char line[REPLY_SZ], amt[32];
+    format_units(amt, sizeof(amt), total.units);
+    int len = snprintf(line, sizeof(line), "BRANCH_ID: %s\nRECORDS: %lld\nSUBTOTAL: %s\n",
+                       branch_id, total.count, amt);
+    rc = len < 0 || (size_t)len >= sizeof(line) ? -1 : conn_append(c, line, (size_t)len);
+    for (size_t i = 0; i < ng && rc == 0; i++) {
+        time_t t = (time_t)(groups[i].key * div * 3600);
+        struct tm tm;
+        char when[32];
+        gmtime_r(&t, &tm);
+        strftime(when, sizeof(when), q->group == GROUP_DAY ? "%Y-%m-%d" : "%Y-%m-%dT%H", &tm);
+        format_units(amt, sizeof(amt), groups[i].acc.units);
+        len = snprintf(line, sizeof(line), "BUCKET: %s %lld %s\n", when, groups[i].acc.count, amt);
+        rc = conn_append(c, line, (size_t)len);
+    }
+    if (rc == 0) rc = conn_append(c, "END\n", 4);
+    free(groups);
+    return rc;
+}
+
+static unsigned char *put_id(unsigned char *p, const char *id) {
+    size_t idlen = strlen(id);
+    if (idlen > 255) idlen = 255;
+    *p++ = (unsigned char)idlen;
+    memcpy(p, id, idlen);
+    return p + idlen;
+}
+
+/* REQUEST ALL: the combined totals of the hosted branches, then one line per
+   branch (ERROR for one whose CSV cannot be read):
+     BRANCH_ID: <host> / RECORDS / SUBTOTAL / BRANCH: <id> <records> <subtotal>... / END
+   Binary: FRAME_BRANCHES, TOTALS payload then u32 n | n x (u8 id length |
+   id | u8 ok | i64 records | i64 subtotal). Sets *failed if any branch
+   could not be read. */
+static int append_all_reply(struct conn *c, const struct host *h, int *failed) {
+    struct scan_acc total = { 0, 0 };
+    *failed = 0;
+    for (size_t i = 0; i < h->n; i++) {
+        const struct scan_result *res = &h->v[i].res;
+        if (res->rc != 0) { *failed = 1; continue; }
+        total.units += res->totals.units;
+        total.count += res->totals.count;
+    }
+    if (c->binary) {
+        unsigned char *payload = malloc(1 + 255 + 16 + 4 + h->n * (1 + 255 + 17)), *p = payload;
+        if (!payload) return -1;
+        p = put_id(p, h->id);
+        p = put_be(p, (unsigned long long)total.count, 8);
+        p = put_be(p, (unsigned long long)total.units, 8);
+        p = put_be(p, h->n, 4);
+        for (size_t i = 0; i < h->n; i++) {
+            const struct scan_result *res = &h->v[i].res;
+            p = put_id(p, h->v[i].id);
+            *p++ = res->rc == 0;
+            p = put_be(p, (unsigned long long)(res->rc == 0 ? res->totals.count : 0), 8);
+            p = put_be(p, (unsigned long long)(res->rc == 0 ? res->totals.units : 0), 8);
+        }
+        int rc = append_frame(c, FRAME_BRANCHES, payload, (size_t)(p - payload));
+        free(payload);
+        return rc;
+    }
+    char line[REPLY_SZ], amt[32];
+    format_units(amt, sizeof(amt), total.units);
+    int len = snprintf(line, sizeof(line), "BRANCH_ID: %s\nRECORDS: %lld\nSUBTOTAL: %s\n",
+                       h->id, total.count, amt);
+    int rc = len < 0 || (size_t)len >= sizeof(line) ? -1 : conn_append(c, line, (size_t)len);
+    for (size_t i = 0; i < h->n && rc == 0; i++) {
+        const struct scan_result *res = &h->v[i].res;
+        format_units(amt, sizeof(amt), res->totals.units);
+        if (res->rc != 0)
+            len = snprintf(line, sizeof(line), "BRANCH: %s ERROR\n", h->v[i].id);
+        else
+            len = snprintf(line, sizeof(line), "BRANCH: %s %lld %s\n", h->v[i].id,
+                           res->totals.count, amt);
+        rc = len < 0 || (size_t)len >= sizeof(line) ? -1 : conn_append(c, line, (size_t)len);
+    }
+    if (rc == 0) rc = conn_append(c, "END\n", 4);
+    return rc;
+}
+
+/* HELLO <feature>...: echo back the features we support, in the order asked */
+static int append_hello(struct conn *c, const char *line) {
+    char out[REPLY_SZ] = "HELLO";
+    char copy[CONN_IN_SZ];
+    snprintf(copy, sizeof(copy), "%s", line);
+    char *save, *tok = strtok_r(copy + 5, " \t", &save);
+    for (; tok; tok = strtok_r(NULL, " \t", &save)) {
+        if (strcmp(tok, "KEEPALIVE") == 0 && !c->keepalive) {
+            c->keepalive = 1;
+            strcat(out, " KEEPALIVE");
+        } else if (strcmp(tok, "BINARY") == 0 && !c->binary) {
+            c->binary = 1;
+            strcat(out, " BINARY");
+        } else if (c->binary && !c->codec && (c->codec = codec_of(tok)) != 0) {
+            strcat(out, " ");
+            strcat(out, tok);
+        }
+    }
+    strcat(out, "\nEND\n");
+    return conn_append(c, out, strlen(out));
+}
+
+static void stats_hist_text(FILE *f, const char *name, const struct histogram *h) {
+    fprintf(f, "%s_count %llu\n%s_sum %llu\n", name, (unsigned long long)h->count,
+            name, (unsigned long long)h->sum_us);
+    fprintf(f, "%s_p50 %llu\n%s_p99 %llu\n%s_p999 %llu\n",
+            name, (unsigned long long)hist_quantile(h, 0.50),
+            name, (unsigned long long)hist_quantile(h, 0.99),
+            name, (unsigned long long)hist_quantile(h, 0.999));
+}
+
+static void stats_hist_prom(FILE *f, const char *name, const char *id, const struct histogram *h) {
+    fprintf(f, "# TYPE %s histogram\n", name);
+    uint64_t cum = 0;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        cum += h->bucket[i];
+        fprintf(f, "%s_bucket{branch=\"%s\",le=\"%g\"} %llu\n", name, id,
+                (double)(1ull << i) / 1e6, (unsigned long long)cum);
+    }
+    fprintf(f, "%s_bucket{branch=\"%s\",le=\"+Inf\"} %llu\n", name, id,
+            (unsigned long long)h->count);
+    fprintf(f, "%s_sum{branch=\"%s\"} %.6f\n", name, id, h->sum_us / 1e6);
+    fprintf(f, "%s_count{branch=\"%s\"} %llu\n", name, id, (unsigned long long)h->count);
+}
+
+/* Render the metrics as "key value" lines (STATS) or in the Prometheus text
+   format (GET /metrics). Returns a malloc'ed buffer. */
+static char *format_stats(const char *branch_id, int prom, size_t *len) {
+    struct metrics m;
+    metrics_snapshot(&m);
+    char *buf = NULL;
+    FILE *f = open_memstream(&buf, len);
+    if (!f) return NULL;
+    uint64_t lookups = m.cache_hits + m.cache_appends + m.cache_rescans;
+    const struct { const char *name; uint64_t v; } counters[] = {
+        { "connections", m.connections },
+        { "requests", m.requests },
+        { "errors", m.errors },
+        { "stats_requests", m.stats_requests },
+        { "pushes", m.pushes },
+        { "received_bytes", m.bytes_in },
+        { "sent_bytes", m.bytes_out },
+        { "reply_cache_hits", m.reply_cache_hits },
+        { "scanned_bytes", m.scan_bytes },
+        { "cache_hits", m.cache_hits },
+        { "cache_appends", m.cache_appends },
+        { "cache_rescans", m.cache_rescans },
+        { "cache_evictions", m.cache_evictions },
+        { "compressed_frames", m.compressed_frames },
+        { "compressed_saved_bytes", m.compressed_saved },
+    };
+    size_t nc = sizeof(counters) / sizeof(counters[0]);
+    if (prom) {
+        for (size_t i = 0; i < nc; i++)
+            fprintf(f, "# TYPE branch_%s_total counter\nbranch_%s_total{branch=\"%s\"} %llu\n",
+                    counters[i].name, counters[i].name, branch_id,
+                    (unsigned long long)counters[i].v);
+        stats_hist_prom(f, "branch_request_duration_seconds", branch_id, &m.request_us);
+        stats_hist_prom(f, "branch_scan_duration_seconds", branch_id, &m.scan_us);
+        stats_hist_prom(f, "branch_epoll_wait_seconds", branch_id, &m.wait_us);
+    } else {
+        fprintf(f, "STATS %s\n", branch_id);
+        for (size_t i = 0; i < nc; i++)
+            fprintf(f, "%s %llu\n", counters[i].name, (unsigned long long)counters[i].v);
+        fprintf(f, "cache_hit_ratio %.4f\n", lookups ? (double)m.cache_hits / lookups : 0.0);
+        stats_hist_text(f, "request_us", &m.request_us);
+        stats_hist_text(f, "scan_us", &m.scan_us);
+        stats_hist_text(f, "wait_us", &m.wait_us);
+        fputs("END\n", f);
+    }
+    if (fclose(f) != 0) { free(buf); return NULL; }
+    return buf;
+}
+
+/* STATS in the connection's reply format, or an HTTP/1.0 response for
+   "GET /metrics" (any other path gets a 404); HTTP closes after the reply */
+static int append_stats(struct conn *c, const char *branch_id, const char *line) {
+    int http = strncmp(line, "GET ", 4) == 0;
+    int found = !http || strncmp(line + 4, "/metrics", 8) == 0;
+    size_t len = 0;
+    char *body = found ? format_stats(branch_id, http, &len) : strdup("not found\n");
+    if (!body) return -1;
+    if (!found) len = strlen(body);
+    stat_add(&tm->stats_requests, 1);
+    int rc;
+    if (http) {
+        char hdr[256];
+        int hl = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                          found ? "200 OK" : "404 Not Found", len);
+        rc = conn_append(c, hdr, (size_t)hl) != 0 || conn_append(c, body, len) != 0 ? -1 : 0;
+        c->done = 1;
+    } else if (c->binary) {
+        rc = append_frame(c, FRAME_STATS, (const unsigned char *)body, len);
+    } else {
+        rc = conn_append(c, body, len);
+    }
+    free(body);
+    return rc;
+}
+
+/* Serve the complete request lines buffered on c, in order. A REQUEST needs
+   fresh totals: unless they just came in for its target ('ready': a branch
+   index, ROUTE_ALL, or ROUTE_NONE for none) the connection is parked on that
+   target (return 1) and parsing resumes from that line once its scan, or
+   sweep, reports back. Returns 0 when all buffered input is handled, -1 to
+   drop the connection. */
+int handle_client(struct conn *c, struct host *h, int ready) {
+    while (!c->done && c->inlen > 0) {
+        char *nl = memchr(c->in, '\n', c->inlen);
+        size_t linelen = nl ? (size_t)(nl - c->in) : c->inlen;
+        if (!nl) {
+            c->in[c->inlen] = '\0';
+            /* one-shot clients may omit the newline (or never send one) */
+            int legacy = !c->keepalive && strstr(c->in, "REQUEST") != NULL;
+            if (!legacy && !c->eof) {
+                if (c->inlen == sizeof(c->in) - 1) return -1;  /* line too long */
+                return 0;
+            }
+        }
+        char line[CONN_IN_SZ];
+        memcpy(line, c->in, linelen);
+        line[linelen] = '\0';
+        if (linelen > 0 && line[linelen-1] == '\r') line[--linelen] = '\0';
+
+        if (strncmp(line, "HELLO", 5) == 0 && (line[5] == '\0' || line[5] == ' ')) {
+            if (append_hello(c, line) != 0) return -1;
+        } else if (strncmp(line, "STATS", 5) == 0 || strncmp(line, "GET ", 4) == 0) {
+            if (append_stats(c, h->id, line) != 0) return -1;
+            if (!c->keepalive) c->done = 1;
+        } else if ((strncmp(line, "SUBSCRIBE", 9) == 0 && (line[9] == '\0' || line[9] == ' ')) ||
+                   strstr(line, "REQUEST") != NULL) {
+            /* SUBSCRIBE [SINCE <seq>] answers like REQUEST SINCE, then keeps
+               the connection open for pushed deltas */
+            int sub = line[0] == 'S';
+            struct range_query q;
+            int target = ROUTE_ALL;
+            const char *bad = NULL;
+            if (parse_query(sub ? line + 9 : strstr(line, "REQUEST") + 7, &q) != 0 ||
+                (sub && (q.windowed || q.all)))
+                bad = "bad query";
+            else if (q.branch[0])
+                bad = (target = find_branch(h, q.branch)) == ROUTE_NONE ? "unknown branch" : NULL;
+            else if (h->multi && !q.all && (sub || q.delta || q.windowed))
+                bad = "branch required";
+            else if (!q.all && !h->multi)
+                target = 0;
+            if (bad) {
+                if (append_error(c, bad) != 0) return -1;
+                if (!c->keepalive) c->done = 1;
+                goto next;
+            }
+            if (!c->req_start_us) c->req_start_us = now_us();
+            if (target != ready) {
+                c->waiting = 1;
+                c->target = target;
+                return 1;
+            }
+            int failed;
+            if (target == ROUTE_ALL) {
+                if (append_all_reply(c, h, &failed) != 0) return -1;
+            } else {
+                struct branch *b = &h->v[target];
+                const struct scan_result *res = &b->res;
+                if (sub) {
+                    q.delta = 1;
+                    c->keepalive = 1;
+                    if (c->sub != b) {
+                        sub_unlink(c);
+                        sub_link(b, c);
+                    }
+                }
+                if ((q.delta ? append_delta_reply(c, b, res, &q)
+                     : q.windowed ? append_query_reply(c, b, res, &q)
+                     : append_reply(c, b, res)) != 0) return -1;
+                failed = res->rc != 0;
+            }
+            stat_add(&tm->requests, 1);
+            if (failed) stat_add(&tm->errors, 1);
+            hist_record(&tm->request_us, now_us() - c->req_start_us);
+            c->req_start_us = 0;
+            if (!c->keepalive) c->done = 1;
+        } else if (linelen > 0) {
+            // Unexpected; one-shot clients are dropped as before
+            if (!c->keepalive) return -1;
+            if (append_error(c, "unknown command") != 0) return -1;
+        }
+next:;
+        size_t used = nl ? (size_t)(nl - c->in) + 1 : c->inlen;
+        memmove(c->in, c->in + used, c->inlen - used);
+        c->inlen -= used;
+    }
+    return 0;
+}
+
+static void conn_close(int epfd, struct conn *c) {
+    sub_unlink(c);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+/* Write as much pending output as the socket takes. Returns 1 when all of it
+   is out, 0 if the rest must wait for EPOLLOUT, -1 on error. */
+static int conn_flush(struct conn *c) {
+    while (c->outoff < c->outlen) {
+        ssize_t r = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->outoff += (size_t)r;
+        stat_add(&tm->bytes_out, (uint64_t)r);
+    }
+    c->outoff = c->outlen = 0;
+    return 1;
+}
+
+/* Pull in whatever the client has sent. Returns -1 on a read error. */
+static int conn_read(struct conn *c) {
+    while (c->inlen < sizeof(c->in) - 1) {
+        ssize_t r = robust_recv(c->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        if (r == 0) { c->eof = 1; return 0; }
+        c->inlen += (size_t)r;
+        stat_add(&tm->bytes_in, (uint64_t)r);
+    }
+    return 0;
+}
+
+/* After any progress: flush output, then close the connection or re-arm epoll
+   for what it waits on next */
+static void conn_settle(int epfd, struct conn *c) {
+    int flushed = conn_flush(c);
+    if (flushed < 0) { conn_close(epfd, c); return; }
+    int idle = !c->waiting && (c->done || c->eof);
+    if (flushed && idle) { conn_close(epfd, c); return; }
+    struct epoll_event ev = { .events = 0, .data.ptr = c };
+    if (!c->waiting && !c->done && !c->eof) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (!flushed) ev.events |= EPOLLOUT;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* ---- shared-memory totals ----
+   --shm NAME publishes every branch's latest totals in the POSIX shared
+   memory segment NAME (/dev/shm/NAME), so a process on the same host (the
+   aggregator's shm:NAME branches) reads them with plain loads, no system
+   call per poll. Each slot is a seqlock like the aggregator's branch_state:
+   the event loop, its only writer, makes 'ver' odd, updates the slot and
+   makes it even again. The CSVs are then watched with inotify whether or
+   not anyone subscribed, and rescanned shortly after each change, so the
+   slots stay current without requests.
+
+   Layout (host byte order): struct shm_hdr, then nslots x struct shm_slot
+   in the order of the branches. */
+#define SHM_MAGIC "BSSHM001"
+
+struct shm_hdr {
+    _Alignas(64) char magic[8];     /* written last */
+    uint32_t nslots;
+    uint32_t slot_size;             /* sizeof(struct shm_slot) */
+};
+
+struct shm_slot {
+    _Alignas(64) uint64_t ver;      /* odd while an update is in progress */
+    uint64_t seq;                   /* as on SEQ: lines: boot << 32 | generation */
+    int64_t records, units;         /* units of 1/AMOUNT_SCALE */
+    int64_t updated_ns;             /* CLOCK_REALTIME of the scan */
+    char id[64];
+};
+
+/* Create (or take over) the segment with a slot per hosted branch */
+static struct shm_slot *shm_setup(const char *name, const struct host *h) {
+    size_t len = sizeof(struct shm_hdr) + h->n * sizeof(struct shm_slot);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0) return NULL;
+    /* never shrink it under a reader's mapping */
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < len && ftruncate(fd, (off_t)len) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    struct shm_hdr *hdr = p;
+    struct shm_slot *slots = (struct shm_slot *)(hdr + 1);
+    memset(hdr->magic, 0, sizeof(hdr->magic));
+    for (size_t i = 0; i < h->n; i++) {
+        memset(&slots[i], 0, sizeof(slots[i]));
+        snprintf(slots[i].id, sizeof(slots[i].id), "%s", h->v[i].id);
+    }
+    hdr->nslots = (uint32_t)h->n;
+    hdr->slot_size = sizeof(struct shm_slot);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
+    return slots;
+}
+
+static void shm_publish(struct shm_slot *s, uint64_t seq, const struct scan_acc *t) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    __atomic_store_n(&s->ver, s->ver + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&s->seq, seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->records, t->count, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->units, t->units, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->updated_ns, (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->ver, s->ver + 1, __ATOMIC_RELEASE);
+}
+
+static void branch_scan(struct host *h, struct branch *b) {
+    b->inflight = 1;
+    scanner_kick(&h->scans, &b->sc);
+}
+
+/* Park c on the target it waits for, starting its scan (or a sweep over all
+   branches) unless one is already running; a sweep shares the scans that
+   are running when it starts */
+static void conn_park(struct host *h, struct conn *c) {
+    if (c->target == ROUTE_ALL) {
+        c->next_waiter = h->all_waiters;
+        h->all_waiters = c;
+        if (h->sweep_pending) return;
+        h->sweep_pending = h->n;
+        for (size_t i = 0; i < h->n; i++) {
+            h->v[i].in_sweep = 1;
+            if (!h->v[i].inflight) branch_scan(h, &h->v[i]);
+        }
+        return;
+    }
+    struct branch *b = &h->v[c->target];
+    c->next_waiter = b->waiters;
+    b->waiters = c;
+    if (!b->inflight) branch_scan(h, b);
+}
+
+/* The result c waited for ('ready') is in: serve it, freeing it instead if it
+   hung up meanwhile */
+static void conn_resume(int epfd, struct host *h, struct conn *c, int ready) {
+    c->waiting = 0;
+    if (c->dead) {
+        sub_unlink(c);
+        close(c->fd);
+        free(c->out);
+        free(c);
+        return;
+    }
+    int r = handle_client(c, h, ready);
+    if (r < 0) {
+        conn_close(epfd, c);
+        return;
+    }
+    if (r > 0) conn_park(h, c);
+    conn_settle(epfd, c);
+}
+
+/* A branch's scan is back. Its cache is read for the waiters and pushes
+   while the branch is still marked in flight, so nothing re-queues it
+   before scanner_release(). */
+static void branch_done(int epfd, struct host *h, struct branch *b) {
+    b->res = b->sc.last;
+    if (h->shm && b->res.rc == 0)
+        shm_publish(&h->shm[b - h->v], (uint64_t)b->boot << 32 | b->res.cache->gen, &b->res.totals);
+    /* one scan answers everyone who asked while it was running */
+    struct conn *list = b->waiters;
+    b->waiters = NULL;
+    while (list) {
+        struct conn *c = list;
+        list = c->next_waiter;
+        conn_resume(epfd, h, c, (int)(b - h->v));
+    }
+    for (struct conn *c = b->subscribers, *next; c; c = next) {
+        next = c->sub_next;
+        if (c->waiting) continue;
+        if (push_delta(c, b, &b->res) < 0) conn_close(epfd, c);
+        else conn_settle(epfd, c);
+    }
+    scanner_release(&h->scans, &b->sc);
+    b->inflight = 0;
+    if (b->in_sweep) {
+        b->in_sweep = 0;
+        if (--h->sweep_pending == 0) {
+            list = h->all_waiters;
+            h->all_waiters = NULL;
+            while (list) {
+                struct conn *c = list;
+                list = c->next_waiter;
+                conn_resume(epfd, h, c, ROUTE_ALL);
+            }
+        }
+    }
+    /* asked for meanwhile, or the running scan may have missed a change */
+    if (!b->inflight && (b->waiters || b->rescan)) {
+        b->rescan = 0;
+        branch_scan(h, b);
+    }
+}
+
+static int event_loop(int sfd, int ufd, struct host *h) {
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { perror("epoll_create1"); return -1; }
+    /* the listeners and the other fds are told apart from conns by address */
+    static char listen_tag, unix_tag, scan_tag, notify_tag, timer_tag;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+    ev.data.ptr = &unix_tag;
+    if (ufd >= 0) epoll_ctl(epfd, EPOLL_CTL_ADD, ufd, &ev);
+    ev.data.ptr = &scan_tag;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, h->scans.efd, &ev);
+    /* while a branch has subscribers (or with --shm), its CSV is watched;
+       a change arms a short timer so a burst of appends costs one scan and
+       one push */
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ifd < 0 || tfd < 0) perror("inotify/timerfd (SUBSCRIBE pushes follow requests only)");
+    ev.data.ptr = &notify_tag;
+    if (ifd >= 0) epoll_ctl(epfd, EPOLL_CTL_ADD, ifd, &ev);
+    ev.data.ptr = &timer_tag;
+    if (tfd >= 0) epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+    int timer_armed = 0;
+    struct epoll_event events[MAX_EVENTS];
+    /* fill the shared-memory slots */
+    for (size_t k = 0; h->shm && k < h->n; k++) branch_scan(h, &h->v[k]);
+    while (1) {
+        for (size_t k = 0; ifd >= 0 && tfd >= 0 && k < h->n; k++) {
+            struct branch *b = &h->v[k];
+            int watch = b->subscribers || h->shm;
+            if (watch && b->wd < 0) {
+                b->wd = inotify_add_watch(ifd, b->sc.csvfile, IN_MODIFY | IN_CLOSE_WRITE |
+                                          IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+            } else if (!watch && b->wd >= 0) {
+                inotify_rm_watch(ifd, b->wd);
+                b->wd = -1;
+            }
+        }
+        uint64_t t0 = now_us();
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        hist_record(&tm->wait_us, now_us() - t0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_tag || tag == &unix_tag) {
+                while (1) {
+                    int cfd = accept4(tag == &listen_tag ? sfd : ufd, NULL, NULL,
+                                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if (cfd < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+                        break;
+                    }
+                    struct conn *c = calloc(1, sizeof(*c));
+                    if (!c) { close(cfd); continue; }
+                    c->fd = cfd;
+                    /* every flush is one send() of whole replies, so Nagle
+                       would only hold back the last segment of a burst */
+                    int one = 1;
+                    if (tag == &listen_tag) setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    stat_add(&tm->connections, 1);
+                    struct epoll_event cev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+                    if (epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &cev) != 0) {
+                        close(cfd);
+                        free(c);
+                    }
+                }
+            } else if (tag == &notify_tag) {
+                char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                ssize_t r;
+                int any = 0;
+                while ((r = read(ifd, evbuf, sizeof(evbuf))) > 0) {
+                    for (char *p = evbuf; p < evbuf + r;) {
+                        const struct inotify_event *ie = (const struct inotify_event *)p;
+                        p += sizeof(*ie) + ie->len;
+                        struct branch *b = NULL;
+                        for (size_t k = 0; k < h->n && !b; k++)
+                            if (h->v[k].wd == ie->wd) b = &h->v[k];
+                        if (!b) continue;
+                        b->changed = any = 1;
+                        /* replaced or removed: watch the path again next time round */
+                        if (ie->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF)) {
+                            if (!(ie->mask & IN_IGNORED)) inotify_rm_watch(ifd, b->wd);
+                            b->wd = -1;
+                        }
+                    }
+                }
+                if (any && !timer_armed) {
+                    struct itimerspec its = { .it_value = { 0, PUSH_COALESCE_MS * 1000000L } };
+                    if (timerfd_settime(tfd, 0, &its, NULL) == 0) timer_armed = 1;
+                }
+            } else if (tag == &timer_tag) {
+                uint64_t cnt;
+                while (read(tfd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+                    ;
+                timer_armed = 0;
+                for (size_t k = 0; k < h->n; k++) {
+                    struct branch *b = &h->v[k];
+                    if (!b->changed || !(b->subscribers || h->shm)) continue;
+                    b->changed = 0;
+                    if (b->inflight) b->rescan = 1;    /* the running scan may have missed it */
+                    else branch_scan(h, b);
+                }
+            } else if (tag == &scan_tag) {
+                uint64_t cnt;
+                while (read(h->scans.efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+                    ;
+                for (struct scanner *sc = scanner_collect(&h->scans), *next; sc; sc = next) {
+                    next = sc->next;
+                    branch_done(epfd, h, (struct branch *)((char *)sc - offsetof(struct branch, sc)));
+                }
+            } else {
+                struct conn *c = tag;
+                uint32_t evs = events[i].events;
+                if (c->waiting) {
+                    if (evs & (EPOLLHUP | EPOLLERR)) {
+                        /* still on a waiter list, so only detach it here */
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                        c->dead = 1;
+                        continue;
+                    }
+                    conn_settle(epfd, c);
+                    continue;
+                }
+                if ((evs & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && conn_read(c) != 0) {
+                    conn_close(epfd, c);
+                    continue;
+                }
+                int r = handle_client(c, h, ROUTE_NONE);
+                if (r < 0) {
+                    conn_close(epfd, c);
+                    continue;
+                }
+                if (r > 0) conn_park(h, c);
+                conn_settle(epfd, c);
+            }
+        }
+    }
+    close(epfd);
+    return -1;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*subtotal_fn)(const char *csvfile, double *subtotal, int *count);
+
+/* Time 'rounds' full scans of csvfile and print throughput */
+static int bench_one(const char *label, subtotal_fn fn, const char *csvfile, int rounds,
+                     off_t bytes, double *subtotal, int *count) {
+    /* warm-up pass so every variant sees a hot page cache */
+    if (fn(csvfile, subtotal, count) != 0) return -1;
+    double t0 = now_sec();
+    for (int i = 0; i < rounds; i++) {
+        if (fn(csvfile, subtotal, count) != 0) return -1;
+    }
+    double dt = (now_sec() - t0) / rounds;
+    printf("%-10s rows=%d subtotal=%.2f  %8.2f Mrows/s  %8.1f MB/s\n", label, *count,
+           *subtotal, *count / dt / 1e6, bytes / dt / 1e6);
+    return 0;
+}
+
+/* --bench: compare the original stdio scanner with the mmap scanner on every
+   kernel this CPU supports, single-threaded and (with --threads) in parallel.
+   All variants must print the same totals; the fixed-point ones must also
+   agree exactly with each other whatever the thread count. */
+static int run_bench(const char *csvfile, int rounds) {
+    struct stat st;
+    if (stat(csvfile, &st) != 0) { perror("stat"); return 1; }
+    double ref_sub, fix_sub = 0.0, sub;
+    int ref_cnt, cnt;
+    char ref_txt[64], txt[64];
+    if (bench_one("stdio", compute_subtotal_stdio, csvfile, rounds, st.st_size,
+                  &ref_sub, &ref_cnt) != 0) {
+        fprintf(stderr, "cannot read %s\n", csvfile);
+        return 1;
+    }
+    snprintf(ref_txt, sizeof(ref_txt), "%.2f", ref_sub);
+    int rc = 0, first = 1;
+    int threads = scan_pool.nthreads;
+    for (int pass = 0; pass < (threads > 1 ? 2 : 1); pass++) {
+        scan_pool.nthreads = pass ? threads : 1;
+        for (size_t i = 0; i < N_SCAN_KERNELS; i++) {
+            if (!kernel_supported(&scan_kernels[i])) continue;
+            scan_kernel = &scan_kernels[i];
+            char label[32];
+            snprintf(label, sizeof(label), "%s x%d", scan_kernel->name, scan_pool.nthreads);
+            if (bench_one(label, compute_subtotal, csvfile, rounds, st.st_size,
+                          &sub, &cnt) != 0) return 1;
+            snprintf(txt, sizeof(txt), "%.2f", sub);
+            if (strcmp(txt, ref_txt) != 0 || cnt != ref_cnt) {
+                fprintf(stderr, "MISMATCH: %s differs from stdio\n", label);
+                rc = 1;
+            }
+            if (!first && sub != fix_sub) {
+                fprintf(stderr, "MISMATCH: %s not bit-identical to other kernels\n", label);
+                rc = 1;
+            }
+            fix_sub = sub;
+            first = 0;
+        }
+    }
+    /* what the server actually runs: best kernel plus the time index */
+    select_scan_kernel();
+    char label[32];
+    snprintf(label, sizeof(label), "index x%d", scan_pool.nthreads);
+    if (bench_one(label, compute_subtotal_indexed, csvfile, rounds, st.st_size,
+                  &sub, &cnt) != 0) return 1;
+    if (sub != fix_sub || cnt != ref_cnt) {
+        fprintf(stderr, "MISMATCH: %s differs from the plain scan\n", label);
+        rc = 1;
+    }
+    /* the same, with the columns taken at run time instead of specialised */
+    layout_generic = 1;
+    snprintf(label, sizeof(label), "generic x%d", scan_pool.nthreads);
+    if (bench_one(label, compute_subtotal, csvfile, rounds, st.st_size, &sub, &cnt) != 0) return 1;
+    layout_generic = 0;
+    if (sub != fix_sub || cnt != ref_cnt) {
+        fprintf(stderr, "MISMATCH: %s differs from the specialised scan\n", label);
+        rc = 1;
+    }
+    /* the exact total, and how far the double accumulation drifted from it */
+    struct scan_acc exact;
+    char amt[32];
+    if (compute_subtotal_units(csvfile, &exact, NULL) == 0) {
+        format_units(amt, sizeof(amt), exact.units);
+        printf("%-10s rows=%lld subtotal=%s  stdio drift=%.6g\n", "exact", exact.count, amt,
+               ref_sub - units_to_double(exact.units));
+    }
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [OPTIONS] <BRANCH_ID> <CSV_FILE> <PORT>\n"
+                    "       %s [OPTIONS] [--cache-mb MB] --manifest FILE <HOST_ID> <PORT>\n"
+                    "       %s [--threads N] [--io-uring] --bench <CSV_FILE> [ROUNDS]\n"
+                    "Options: [--threads N] [--no-index] [--compress-min BYTES] [--io-uring]\n"
+                    "         [--unix PATH] [--shm NAME]\n",
+            prog, prog, prog);
+}
+
+static int add_hosted(struct host *h, size_t *cap, const char *id, const char *csvfile) {
+    if (strlen(id) > 255 || find_branch(h, id) != ROUTE_NONE) {
+        fprintf(stderr, "Bad or duplicate branch id '%s'\n", id);
         return -1;
     }
-    double subtotal = 0.0;
-    int count = 0;
-    if (compute_subtotal(csvfile, &subtotal, &count) != 0) {
-        // send error
-        const char *err = "ERROR: cannot read CSV\nEND\n";
-        robust_send(cfd, err, strlen(err));
+    if (h->n == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 16;
+        struct branch *v = realloc(h->v, ncap * sizeof(*v));
+        if (!v) { perror("realloc"); return -1; }
+        h->v = v;
+        *cap = ncap;
+    }
+    struct branch *b = &h->v[h->n];
+    memset(b, 0, sizeof(*b));
+    b->id = strdup(id);
+    b->sc.csvfile = strdup(csvfile);
+    if (!b->id || !b->sc.csvfile) { perror("strdup"); return -1; }
+    b->wd = -1;
+    h->n++;
+    return 0;
+}
+
+/* Manifest: one "<BRANCH_ID> <CSV_FILE>" per line; blank lines and anything
+   after '#' are ignored */
+static int load_manifest(const char *path, struct host *h) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("fopen manifest"); return -1; }
+    char line[2048], id[256], csv[1024];
+    int lineno = 0;
+    size_t cap = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        int n = sscanf(line, "%255s %1023s", id, csv);
+        if (n <= 0) continue;
+        if (n < 2) {
+            fprintf(stderr, "%s:%d: expected <BRANCH_ID> <CSV_FILE>\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        if (add_hosted(h, &cap, id, csv) != 0) { fclose(f); return -1; }
+    }
+    fclose(f);
+    if (h->n == 0) {
+        fprintf(stderr, "%s: no branches\n", path);
         return -1;
     }
-    char out[512];
-    snprintf(out, sizeof(out),
-             "BRANCH_ID: %s\nRECORDS: %d\nSUBTOTAL: %.2f\nEND\n",
-             branch_id, count, subtotal);
-    robust_send(cfd, out, strlen(out));
     return 0;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <BRANCH_ID> <CSV_FILE> <PORT>\n", argv[0]);
+    static const struct option opts[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "bench",   no_argument,       NULL, 'b' },
+        { "no-index", no_argument,      NULL, 'n' },
+        { "manifest", required_argument, NULL, 'm' },
+        { "cache-mb", required_argument, NULL, 'c' },
+        { "compress-min", required_argument, NULL, 'z' },
+        { "io-uring", no_argument,      NULL, 'u' },
+        { "unix",     required_argument, NULL, 'U' },
+        { "shm",      required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *manifest = NULL, *unix_path = NULL, *shm_name = NULL;
+    long cache_mb = 0;
+    int threads = 1, bench = 0, use_index = 1, io_uring = 0, opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            if (threads < 1) { usage(argv[0]); return 1; }
+            break;
+        case 'b':
+            bench = 1;
+            break;
+        case 'n':
+            use_index = 0;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'c':
+            cache_mb = atol(optarg);
+            if (cache_mb < 0) { usage(argv[0]); return 1; }
+            break;
+        case 'z':
+            compress_min = (size_t)atol(optarg);
+            break;
+        case 'u':
+            io_uring = 1;
+            break;
+        case 'U':
+            unix_path = optarg;
+            break;
+        case 'S':
+            shm_name = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    select_scan_kernel();
+    if (threads > 1 && scan_pool_start(threads) != 0) {
+        perror("scan_pool_start");
+        return 1;
+    }
+    if (io_uring && uring_scan_setup() != 0)
+        fprintf(stderr, "io_uring unavailable (%s), scanning through mmap\n", strerror(errno));
+    if (bench) {
+        if (argc - optind < 1) { usage(argv[0]); return 1; }
+        int rounds = argc - optind > 1 ? atoi(argv[optind + 1]) : 5;
+        return run_bench(argv[optind], rounds > 0 ? rounds : 1);
+    }
+    if (argc - optind != (manifest ? 2 : 3)) {
+        usage(argv[0]);
         return 1;
     }
-    const char *branch_id = argv[1];
-    const char *csvfile = argv[2];
-    const char *port = argv[3];
+    /* totals survive across connections; each REQUEST only parses new rows */
+    static struct host h = {
+        .scans = { .mu = PTHREAD_MUTEX_INITIALIZER, .cv = PTHREAD_COND_INITIALIZER },
+    };
+    h.id = argv[optind];
+    h.multi = manifest != NULL;
+    h.scans.budget = (size_t)cache_mb << 20;
+    size_t cap = 0;
+    if (manifest ? load_manifest(manifest, &h) != 0
+                 : add_hosted(&h, &cap, argv[optind], argv[optind + 1]) != 0) return 1;
+    const char *port = argv[argc - 1];
+    struct timespec boot;
+    clock_gettime(CLOCK_REALTIME, &boot);
+    boot_id = (uint32_t)(boot.tv_sec ^ boot.tv_nsec ^ ((uint32_t)getpid() << 16));
 
     int sfd = start_server(port);
     if (sfd < 0) {
         perror("start_server");
         return 1;
     }
-    printf("Branch %s server listening on port %s (CSV=%s)\n", branch_id, port, csvfile);
+    int ufd = unix_path ? start_unix_server(unix_path) : -1;
+    if (unix_path && ufd < 0) {
+        perror(unix_path);
+        return 1;
+    }
+    if (shm_name && !(h.shm = shm_setup(shm_name, &h))) {
+        perror(shm_name);
+        return 1;
+    }
+    if (manifest)
+        printf("Host %s server listening on port %s (%zu branches from %s, scan=%s%s, threads=%d)\n",
+               h.id, port, h.n, manifest, scan_kernel->name, use_uring ? "+io_uring" : "",
+               scan_pool.nthreads);
+    else
+        printf("Branch %s server listening on port %s (CSV=%s, scan=%s%s, threads=%d)\n",
+               h.id, port, h.v[0].sc.csvfile, scan_kernel->name, use_uring ? "+io_uring" : "",
+               scan_pool.nthreads);
 
-    while (1) {
-        struct sockaddr_storage peer;
-        socklen_t plen = sizeof(peer);
-        int cfd = accept(sfd, (struct sockaddr*)&peer, &plen);
-        if (cfd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
-            break;
-        }
-        /* handle client in the same process (single request per connection) */
-        if (handle_client(cfd, branch_id, csvfile) != 0) {
-            // error; already logged by client
-        }
-        close(cfd);
+    h.scans.all = malloc(h.n * sizeof(*h.scans.all));
+    if (!h.scans.all) { perror("malloc"); return 1; }
+    for (size_t i = 0; i < h.n; i++) {
+        struct branch *b = &h.v[i];
+        struct scanner *sc = &b->sc;
+        h.scans.all[h.scans.n++] = sc;
+#ifndef HAVE_ZSTD
+        if (is_zst(sc->csvfile))
+            fprintf(stderr, "%s: built without HAVE_ZSTD, requests for it will fail\n", sc->csvfile);
+#endif
+        b->boot = boot_id + (uint32_t)i * 0x9e3779b9u;
+        size_t plen = strlen(sc->csvfile) + 5;
+        char *idxpath = use_index ? malloc(plen) : NULL;
+        if (!idxpath) continue;
+        snprintf(idxpath, plen, "%s.idx", sc->csvfile);
+        sc->idxpath = idxpath;
+        if (sidecar_load(&sc->cache, idxpath) == 0)
+            printf("Loaded index %s (%lld rows, %zu buckets)\n", idxpath,
+                   sc->cache.acc.count, sc->cache.ti.n);
+        sc->saved_gen = sc->cache.gen;
+    }
+    h.scans.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t tid;
+    if (h.scans.efd < 0 || pthread_create(&tid, NULL, scan_thread, &h.scans) != 0) {
+        perror("scan thread");
+        return 1;
     }
+    pthread_detach(tid);
+
+    if (unix_path) printf("Also listening on %s\n", unix_path);
+    if (shm_name) printf("Publishing totals in shared memory %s\n", shm_name);
+    event_loop(sfd, ufd, &h);
     close(sfd);
     return 0;
 }
@@ -0,0 +1,456 @@
+/* load_generator.c
+   Benchmark harness: generates synthetic branch CSVs, starts the branch
+   servers, drives them with direct clients at a fixed request rate and runs
+   the aggregator against them.
+   Usage: ./load_generator [--branches N] [--rows R] [--rate QPS] [--duration SEC]
+                           [--clients C] [--keepalive] [--rounds N] [--port-base P]
+                           [--dir DIR] [--server PATH] [--aggregator PATH]
+   Build:   gcc -O2 -pthread -o load_generator load_generator.c -lm
+   Example: ./load_generator --branches 8 --rows 1000000 --rate 2000 --duration 10
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#define BUF_SZ 4096
+
+struct config {
+    int branches;
+    long long rows;
+    double rate;
+    double duration;
+    int clients;
+    int keepalive;
+    int rounds;
+    int port_base;
+    const char *dir;
+    const char *server;
+    const char *aggregator;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_until(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+/* ---- synthetic data ---- */
+
+static void csv_path(const struct config *cfg, int i, char *buf, size_t n) {
+    snprintf(buf, n, "%s/branch%d.csv", cfg->dir, i);
+}
+
+/* Write 'rows' rows of "date,amount" with amounts in [0.01, 999.99] */
+static int gen_csv(const char *path, long long rows, unsigned seed) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror("fopen csv"); return -1; }
+    static char buf[1 << 16];
+    setvbuf(f, buf, _IOFBF, sizeof(buf));
+    fprintf(f, "date,amount\n");
+    unsigned x = seed * 2654435761u + 1;
+    for (long long r = 0; r < rows; r++) {
+        x = x * 1103515245u + 12345u;
+        unsigned cents = (x >> 8) % 99999 + 1;
+        fprintf(f, "2025-%02d-%02d,%u.%02u\n",
+                (int)(r / 28 % 12) + 1, (int)(r % 28) + 1, cents / 100, cents % 100);
+    }
+    if (fclose(f) != 0) { perror("fclose csv"); return -1; }
+    return 0;
+}
+
+/* ---- child processes ---- */
+
+static pid_t spawn(char *const argv[], int out_fd) {
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        } else {
+            int null = open("/dev/null", O_WRONLY);
+            if (null >= 0) { dup2(null, STDOUT_FILENO); close(null); }
+        }
+        execv(argv[0], argv);
+        fprintf(stderr, "exec %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    return pid;
+}
+
+static int connect_port(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr*)&a, sizeof(a)) < 0) { close(fd); return -1; }
+    return fd;
+}
+
+/* Wait (up to 5 s) until the server on port accepts connections */
+static int wait_listening(int port) {
+    double end = now_sec() + 5.0;
+    while (now_sec() < end) {
+        int fd = connect_port(port);
+        if (fd >= 0) { close(fd); return 0; }
+        usleep(10000);
+    }
+    return -1;
+}
+
+/* Run the server's own --bench on one CSV (prints rows/sec per kernel) */
+static int run_scan_bench(const struct config *cfg) {
+    char path[512];
+    csv_path(cfg, 0, path, sizeof(path));
+    char *argv[] = { (char*)cfg->server, "--bench", path, "3", NULL };
+    printf("== compute_subtotal() on %lld rows ==\n", cfg->rows);
+    fflush(stdout);
+    pid_t pid = spawn(argv, dup(STDOUT_FILENO));
+    if (pid < 0) return -1;
+    int st;
+    waitpid(pid, &st, 0);
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0 ? 0 : -1;
+}
+
+/* ---- direct clients ----
+   Open loop: requests are scheduled at a fixed rate and latency is measured
+   from the scheduled send time, so a stalled server shows up as queueing
+   delay instead of silently lowering the offered load. */
+
+struct client {
+    pthread_t tid;
+    const struct config *cfg;
+    int id;
+    double start, interval;
+    double *lat;
+    size_t nlat, cap;
+    long errors;
+};
+
+/* Read one reply (up to its END line); 0 on success */
+static int read_reply(int fd, char *buf, size_t cap) {
+    size_t len = 0;
+    while (len + 1 < cap) {
+        ssize_t r = recv(fd, buf + len, cap - 1 - len, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        len += (size_t)r;
+        buf[len] = '\0';
+        if (strstr(buf, "END\n")) return strncmp(buf, "ERROR", 5) == 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+static int send_line(int fd, const char *s) {
+    size_t n = strlen(s), off = 0;
+    while (off < n) {
+        ssize_t w = send(fd, s + off, n - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        off += (size_t)w;
+    }
+    return 0;
+}
+
+static int client_open(const struct client *c, int port) {
+    int fd = connect_port(port);
+    if (fd < 0) return -1;
+    char buf[BUF_SZ];
+    if (c->cfg->keepalive &&
+        (send_line(fd, "HELLO KEEPALIVE\n") < 0 || read_reply(fd, buf, sizeof(buf)) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *client_main(void *arg) {
+    struct client *c = arg;
+    const struct config *cfg = c->cfg;
+    char buf[BUF_SZ];
+    int *fds = malloc(sizeof(int) * (size_t)cfg->branches);
+    if (!fds) return NULL;
+    for (int i = 0; i < cfg->branches; i++) fds[i] = -1;
+
+    double end = c->start + cfg->duration;
+    for (long k = 0;; k++) {
+        double sched = c->start + c->interval * ((double)k + (double)c->id / cfg->clients);
+        if (sched >= end) break;
+        sleep_until(sched);
+        int b = (int)((k * cfg->clients + c->id) % cfg->branches);
+        int port = cfg->port_base + b;
+
+        int fd = fds[b] >= 0 ? fds[b] : client_open(c, port);
+        int ok = fd >= 0 && send_line(fd, "REQUEST\n") == 0 && read_reply(fd, buf, sizeof(buf)) == 0;
+        double done = now_sec();
+        if (!ok) {
+            c->errors++;
+            if (fd >= 0) close(fd);
+            fds[b] = -1;
+            continue;
+        }
+        if (cfg->keepalive) {
+            fds[b] = fd;
+        } else {
+            close(fd);
+        }
+        if (c->nlat == c->cap) {
+            size_t ncap = c->cap ? c->cap * 2 : 1024;
+            double *nl = realloc(c->lat, ncap * sizeof(double));
+            if (!nl) break;
+            c->lat = nl;
+            c->cap = ncap;
+        }
+        c->lat[c->nlat++] = done - sched;
+    }
+    for (int i = 0; i < cfg->branches; i++)
+        if (fds[i] >= 0) close(fds[i]);
+    free(fds);
+    return NULL;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *v, size_t n, double q) {
+    if (n == 0) return 0.0;
+    size_t i = (size_t)(q * (double)(n - 1) + 0.5);
+    return v[i];
+}
+
+static int run_clients(const struct config *cfg) {
+    struct client *cl = calloc((size_t)cfg->clients, sizeof(*cl));
+    if (!cl) { perror("calloc"); return -1; }
+    double start = now_sec() + 0.05;
+    int started = 0;
+    for (int i = 0; i < cfg->clients; i++) {
+        cl[i].cfg = cfg;
+        cl[i].id = i;
+        cl[i].start = start;
+        cl[i].interval = cfg->clients / cfg->rate;
+        if (pthread_create(&cl[i].tid, NULL, client_main, &cl[i]) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+    size_t total = 0;
+    long errors = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(cl[i].tid, NULL);
+        total += cl[i].nlat;
+        errors += cl[i].errors;
+    }
+    double elapsed = now_sec() - start;
+
+    double *all = malloc((total ? total : 1) * sizeof(double));
+    size_t n = 0;
+    for (int i = 0; i < started; i++) {
+        if (all) memcpy(all + n, cl[i].lat, cl[i].nlat * sizeof(double));
+        n += cl[i].nlat;
+        free(cl[i].lat);
+    }
+    free(cl);
+    if (!all) { perror("malloc"); return -1; }
+    qsort(all, n, sizeof(double), cmp_double);
+
+    printf("== direct clients ==\n");
+    printf("requests=%zu errors=%ld achieved=%.0f req/s\n", n, errors, n / elapsed);
+    printf("latency p50=%.3f ms p99=%.3f ms p999=%.3f ms max=%.3f ms\n",
+           percentile(all, n, 0.50) * 1e3, percentile(all, n, 0.99) * 1e3,
+           percentile(all, n, 0.999) * 1e3, n ? all[n - 1] * 1e3 : 0.0);
+    free(all);
+    return started == 0 ? -1 : 0;
+}
+
+/* ---- aggregator ---- */
+
+static int run_aggregator(const struct config *cfg) {
+    char list[512], main_csv[512], rounds[32];
+    snprintf(list, sizeof(list), "%s/branches.conf", cfg->dir);
+    snprintf(main_csv, sizeof(main_csv), "%s/main.csv", cfg->dir);
+    snprintf(rounds, sizeof(rounds), "%d", cfg->rounds);
+    FILE *f = fopen(list, "w");
+    if (!f) { perror("fopen branches.conf"); return -1; }
+    for (int i = 0; i < cfg->branches; i++)
+        fprintf(f, "127.0.0.1 %d\n", cfg->port_base + i);
+    fclose(f);
+    /* fresh main CSV each run: update_main_csv() cost grows with its size */
+    f = fopen(main_csv, "w");
+    if (!f) { perror("fopen main csv"); return -1; }
+    fprintf(f, "timestamp,branch,records,subtotal,ts\n");
+    fclose(f);
+
+    int pfd[2];
+    if (pipe(pfd) < 0) { perror("pipe"); return -1; }
+    char *argv[16];
+    int a = 0;
+    argv[a++] = (char*)cfg->aggregator;
+    argv[a++] = "--timing";
+    argv[a++] = "--branches";
+    argv[a++] = list;
+    if (cfg->keepalive) argv[a++] = "--keepalive";
+    argv[a++] = "--rounds";
+    argv[a++] = rounds;
+    argv[a++] = main_csv;
+    argv[a] = NULL;
+
+    pid_t pid = spawn(argv, pfd[1]);
+    close(pfd[1]);
+    if (pid < 0) { close(pfd[0]); return -1; }
+    FILE *out = fdopen(pfd[0], "r");
+    char line[BUF_SZ], timing[BUF_SZ] = "", stats[BUF_SZ] = "";
+    long updated = 0;
+    while (out && fgets(line, sizeof(line), out)) {
+        if (strncmp(line, "TIMING:", 7) == 0) snprintf(timing, sizeof(timing), "%s", line);
+        else if (strncmp(line, "STATS:", 6) == 0) snprintf(stats, sizeof(stats), "%s", line + 7);
+        else if (strncmp(line, "main CSV updated", 16) == 0) updated++;
+    }
+    if (out) fclose(out);
+    int st;
+    waitpid(pid, &st, 0);
+
+    printf("== aggregator (%d branches, %d rounds) ==\n", cfg->branches, cfg->rounds);
+    double wall = 0, write_ms = 0;
+    int writes = 0;
+    if (sscanf(timing, "TIMING: wall_ms=%lf csv_writes=%d csv_write_ms=%lf",
+               &wall, &writes, &write_ms) != 3) {
+        fprintf(stderr, "aggregator printed no TIMING line (exit %d)\n",
+                WIFEXITED(st) ? WEXITSTATUS(st) : -1);
+        return -1;
+    }
+    printf("wall=%.3f ms main CSV writes=%d (%ld reported) update_main_csv=%.3f ms (%.1f%%, %.3f ms/write)\n",
+           wall, writes, updated, write_ms, wall > 0 ? 100.0 * write_ms / wall : 0.0,
+           writes ? write_ms / writes : 0.0);
+    if (stats[0]) printf("%s", stats);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--branches N] [--rows R] [--rate QPS] [--duration SEC]\n"
+                    "       %*s [--clients C] [--keepalive] [--rounds N] [--port-base P]\n"
+                    "       %*s [--dir DIR] [--server PATH] [--aggregator PATH]\n",
+            prog, (int)strlen(prog), "", (int)strlen(prog), "");
+}
+
+int main(int argc, char *argv[]) {
+    struct config cfg = {
+        .branches = 4, .rows = 100000, .rate = 1000, .duration = 5, .clients = 4,
+        .keepalive = 0, .rounds = 1, .port_base = 6001, .dir = "bench",
+        .server = "./branch_server", .aggregator = "./main_aggregator",
+    };
+    static const struct option opts[] = {
+        { "branches",   required_argument, NULL, 'b' },
+        { "rows",       required_argument, NULL, 'r' },
+        { "rate",       required_argument, NULL, 'q' },
+        { "duration",   required_argument, NULL, 'd' },
+        { "clients",    required_argument, NULL, 'c' },
+        { "keepalive",  no_argument,       NULL, 'k' },
+        { "rounds",     required_argument, NULL, 'n' },
+        { "port-base",  required_argument, NULL, 'P' },
+        { "dir",        required_argument, NULL, 'D' },
+        { "server",     required_argument, NULL, 'S' },
+        { "aggregator", required_argument, NULL, 'A' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'b': cfg.branches = atoi(optarg); break;
+        case 'r': cfg.rows = atoll(optarg); break;
+        case 'q': cfg.rate = atof(optarg); break;
+        case 'd': cfg.duration = atof(optarg); break;
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'k': cfg.keepalive = 1; break;
+        case 'n': cfg.rounds = atoi(optarg); break;
+        case 'P': cfg.port_base = atoi(optarg); break;
+        case 'D': cfg.dir = optarg; break;
+        case 'S': cfg.server = optarg; break;
+        case 'A': cfg.aggregator = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc || cfg.branches < 1 || cfg.rows < 0 || cfg.rate <= 0 ||
+        cfg.duration < 0 || cfg.clients < 1 || cfg.rounds < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mkdir(cfg.dir, 0755) < 0 && errno != EEXIST) { perror("mkdir"); return 1; }
+    char path[512];
+    for (int i = 0; i < cfg.branches; i++) {
+        csv_path(&cfg, i, path, sizeof(path));
+        if (gen_csv(path, cfg.rows, (unsigned)i) < 0) return 1;
+    }
+    printf("generated %d CSVs x %lld rows in %s\n", cfg.branches, cfg.rows, cfg.dir);
+
+    int rc = run_scan_bench(&cfg) == 0 ? 0 : 1;
+
+    pid_t *pids = calloc((size_t)cfg.branches, sizeof(pid_t));
+    if (!pids) { perror("calloc"); return 1; }
+    for (int i = 0; i < cfg.branches; i++) {
+        char id[32], port[16];
+        snprintf(id, sizeof(id), "B%d", i);
+        snprintf(port, sizeof(port), "%d", cfg.port_base + i);
+        csv_path(&cfg, i, path, sizeof(path));
+        char *sargv[] = { (char*)cfg.server, id, path, port, NULL };
+        pids[i] = spawn(sargv, -1);
+        if (pids[i] < 0 || wait_listening(cfg.port_base + i) < 0) {
+            fprintf(stderr, "branch server on port %d did not start\n", cfg.port_base + i);
+            rc = 1;
+            goto out;
+        }
+    }
+
+    /* first request per branch builds the cache; measure steady state only */
+    for (int i = 0; i < cfg.branches; i++) {
+        char buf[BUF_SZ];
+        int fd = connect_port(cfg.port_base + i);
+        if (fd >= 0) {
+            if (send_line(fd, "REQUEST\n") == 0) read_reply(fd, buf, sizeof(buf));
+            close(fd);
+        }
+    }
+
+    if (cfg.duration > 0 && run_clients(&cfg) < 0) rc = 1;
+    if (run_aggregator(&cfg) < 0) rc = 1;
+
+out:
+    for (int i = 0; i < cfg.branches; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    free(pids);
+    return rc;
+}
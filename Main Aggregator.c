@@ -1,11 +1,27 @@
 /* main_aggregator.c
-   Usage: ./main_aggregator <MAIN_CSV> <BRANCH1_HOST> <BRANCH1_PORT> <BRANCH2_HOST> <BRANCH2_PORT>
+   Usage: ./main_aggregator [--branches FILE] [--timeout MS] [--keepalive] [--binary] [--compress] [--append]
+                            [--store DIR [--export-every N]] [--io-uring]
+                            [--rounds N | --daemon] [--interval MS] [--jitter MS] [--pipeline D] [--timing]
+                            [--metrics FILE] [--range "FROM <date> TO <date>" | --delta | --subscribe SECS]
+                            <MAIN_CSV> [<BRANCH_HOST> <BRANCH_PORT>]...
+          ./main_aggregator --store DIR --query BRANCH_ID [--since TIME] [--until TIME]
+          ./main_aggregator --compact hour|day|month [--until TIME] [--threads N] <MAIN_CSV>
+          ./main_aggregator --serve PORT [--id ID] [--stale MS] [--branches FILE] [--timeout MS]
+                            [--keepalive] [--binary] [--compress] [--metrics FILE] [<BRANCH_HOST> <BRANCH_PORT>]...
+   Build:   gcc -O2 -pthread -o main_aggregator main_aggregator.c -lm
+            add -DHAVE_ZSTD ... -lzstd and/or -DHAVE_LZ4 ... -llz4 for --compress
    Example: ./main_aggregator main.csv localhost 5001 localhost 5002
+            ./main_aggregator --branches branches.conf --keepalive --rounds 100 main.csv
+            ./main_aggregator --branches branches.conf --subscribe 0 --append main.csv
+            ./main_aggregator --branches branches.conf --daemon --interval 60000 main.csv
+            ./main_aggregator --compact day --threads 4 main.csv
 */
 
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -16,7 +32,35 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/signalfd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
 #define BUF_SZ 4096
 #define TIMEOUT_SEC 5
@@ -24,7 +68,7 @@
 ssize_t robust_send(int fd, const void *buf, size_t count) {
     size_t sent = 0;
     while (sent < count) {
-        ssize_t r = send(fd, (const char*)buf + sent, count - sent, 0);
+        ssize_t r = send(fd, (const char*)buf + sent, count - sent, MSG_NOSIGNAL);
         if (r < 0) {
             if (errno == EINTR) continue;
             return -1;
@@ -34,6 +78,30 @@ ssize_t robust_send(int fd, const void *buf, size_t count) {
     return sent;
 }
 
+/* Like robust_send() for a gather list; iov is consumed on partial writes */
+ssize_t robust_writev(int fd, struct iovec *iov, int iovcnt) {
+    size_t sent = 0;
+    while (iovcnt > 0) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += r;
+        while (iovcnt > 0 && (size_t)r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return sent;
+}
+
 ssize_t robust_recv(int fd, void *buf, size_t count) {
     ssize_t r;
     while (1) {
@@ -43,39 +111,235 @@ ssize_t robust_recv(int fd, void *buf, size_t count) {
     }
 }
 
-/* Connect to host:port -> returns socket fd or -1 */
-int connect_to(const char *host, const char *port) {
-    struct addrinfo hints, *res, *rp;
-    int sfd = -1;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET; // IPv4 for simplicity
-    hints.ai_socktype = SOCK_STREAM;
-    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
-    for (rp = res; rp != NULL; rp = rp->ai_next) {
-        sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sfd < 0) continue;
-        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) == 0) break;
-        close(sfd);
-        sfd = -1;
+/* Start a non-blocking connect to one resolved address -> socket fd or -1.
+   The connect may still be in progress; completion is signalled by EPOLLOUT. */
+int connect_addr(const struct sockaddr_storage *addr, socklen_t addrlen) {
+    int sfd = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0) return -1;
+    /* requests are small and already batched per write */
+    int one = 1;
+    setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(sfd, (const struct sockaddr *)addr, addrlen) == 0 || errno == EINPROGRESS) return sfd;
+    close(sfd);
+    return -1;
+}
+
+/* Amounts are exact fixed-point integers in 1/AMOUNT_SCALE units from the
+   branch CSV to the main CSV; they are only ever turned into text. */
+#define AMOUNT_SCALE 10000LL
+#define AMOUNT_SCALE_DIGITS 4
+
+/* Parse a decimal amount exactly into 1/AMOUNT_SCALE units (extra fraction
+   digits round half away from zero, as on the branch server) */
+static int parse_units(const char *p, long long *units) {
+    while (*p == ' ') p++;
+    int neg = *p == '-';
+    if (*p == '-' || *p == '+') p++;
+    if ((unsigned)(*p - '0') > 9) return -1;
+    long long v = 0;
+    for (; (unsigned)(*p - '0') <= 9; p++) v = v * 10 + (*p - '0');
+    int frac = 0, up = 0;
+    if (*p == '.') {
+        for (p++; (unsigned)(*p - '0') <= 9; p++) {
+            if (frac < AMOUNT_SCALE_DIGITS) { v = v * 10 + (*p - '0'); frac++; }
+            else if (frac++ == AMOUNT_SCALE_DIGITS) up = *p >= '5';
+        }
     }
-    freeaddrinfo(res);
-    return sfd;
+    for (; frac < AMOUNT_SCALE_DIGITS; frac++) v *= 10;
+    v += up;
+    *units = neg ? -v : v;
+    return 0;
+}
+
+/* Exact decimal text of an amount: two decimals, more only if it has them */
+static void format_units(char *buf, size_t n, long long units) {
+    unsigned long long a = units < 0 ? 0ULL - (unsigned long long)units : (unsigned long long)units;
+    unsigned long long frac = a % AMOUNT_SCALE;
+    int digits = AMOUNT_SCALE_DIGITS;
+    while (digits > 2 && frac % 10 == 0) {
+        frac /= 10;
+        digits--;
+    }
+    snprintf(buf, n, "%s%llu.%0*llu", units < 0 ? "-" : "", a / AMOUNT_SCALE, digits, frac);
 }
 
 /* Parse branch reply text and extract values */
-int parse_reply(const char *reply, char *branch_id, size_t bid_len, int *records, double *subtotal) {
+int parse_reply(const char *reply, char *branch_id, size_t bid_len, long long *records, long long *units) {
     const char *p = strstr(reply, "BRANCH_ID:");
     if (!p) return -1;
-    if (sscanf(p, "BRANCH_ID: %s", branch_id) != 1) return -1;
+    char fmt[32];
+    int used = 0;
+    snprintf(fmt, sizeof(fmt), "BRANCH_ID: %%%zus%%n", bid_len - 1);
+    /* an id longer than branch_id is refused, not cut short */
+    if (sscanf(p, fmt, branch_id, &used) != 1 || !strchr(" \t\r\n", p[used])) return -1;
     p = strstr(reply, "RECORDS:");
     if (!p) return -1;
-    if (sscanf(p, "RECORDS: %d", records) != 1) return -1;
+    if (sscanf(p, "RECORDS: %lld", records) != 1) return -1;
     p = strstr(reply, "SUBTOTAL:");
     if (!p) return -1;
-    if (sscanf(p, "SUBTOTAL: %lf", subtotal) != 1) return -1;
+    return parse_units(p + 9, units);
+}
+
+/* Binary reply frame (see the branch server), all integers big-endian:
+     u8 magic 0xB1 | u8 type | u16 flags | u32 payload length | payload
+   FRAME_TOTALS payload: u8 id length | id | i64 records | i64 subtotal in
+   1/AMOUNT_SCALE units. FRAME_ERROR payload: message text. FRAME_DELTA
+   (reply to REQUEST SINCE): u8 id length | id | u64 seq | u8 kind |
+   i64 records | i64 subtotal. FRAME_BRANCHES (reply to REQUEST ALL from a
+   multi-branch host): TOTALS payload, then u32 n | n x (u8 id length | id |
+   u8 ok | i64 records | i64 subtotal). With --compress, flags FRAME_F_ZSTD
+   or FRAME_F_LZ4 mark a compressed payload: u32 original length | data. */
+#define FRAME_MAGIC 0xB1
+#define FRAME_HDR_SZ 8
+#define FRAME_TOTALS 1
+#define FRAME_ERROR 2
+#define FRAME_DELTA 5
+#define FRAME_BRANCHES 6
+#define FRAME_F_ZSTD 0x0001
+#define FRAME_F_LZ4 0x0002
+
+#define DELTA_FULL 0        /* absolute totals */
+#define DELTA_CHANGED 1     /* change since the seq we sent */
+#define DELTA_UNCHANGED 2
+
+static unsigned long long get_be(const unsigned char *p, int bytes) {
+    unsigned long long v = 0;
+    for (int i = 0; i < bytes; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+static unsigned char *put_be(unsigned char *p, unsigned long long v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+    return p + bytes;
+}
+
+/* Decode a FRAME_TOTALS frame of len bytes (header included), or the
+   combined totals of a FRAME_BRANCHES one */
+int parse_frame(const unsigned char *frame, size_t len, char *branch_id, size_t bid_len,
+                long long *records, long long *units) {
+    if (len < FRAME_HDR_SZ + 1 || frame[0] != FRAME_MAGIC ||
+        (frame[1] != FRAME_TOTALS && frame[1] != FRAME_BRANCHES)) return -1;
+    const unsigned char *p = frame + FRAME_HDR_SZ;
+    size_t idlen = p[0], want = FRAME_HDR_SZ + 1 + idlen + 16;
+    if ((frame[1] == FRAME_TOTALS ? len != want : len < want + 4) || idlen >= bid_len) return -1;
+    memcpy(branch_id, p + 1, idlen);
+    branch_id[idlen] = '\0';
+    p += 1 + idlen;
+    *records = (long long)get_be(p, 8);
+    *units = (long long)get_be(p + 8, 8);
     return 0;
 }
 
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long now_ms(void) {
+    return now_us() / 1000;
+}
+
+/* ---- metrics ----
+   Every field has a single writing thread (the network loop, or the
+   persistence thread for write_us/fsync_us), so updates are plain adds
+   published with relaxed stores for the metrics writer to read. Bucket i
+   of a histogram counts latencies of at most 2^i microseconds. */
+#define HIST_BUCKETS 24
+
+struct histogram {
+    uint64_t count, sum_us;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+static struct {
+    uint64_t connect_failures, timeouts, bytes_in, bytes_out;
+    uint64_t dns_hits, dns_lookups;
+    uint64_t hedges, hedge_wins, late;  /* hedged REQUESTs, ... the replica answered first;
+                                           rounds closed without a branch */
+    uint64_t cache_hits, cache_misses, cache_revalidations;    /* --serve: answered from the
+                                           cache, waited for a refresh, kept by a check */
+    struct histogram resolve_us;    /* one getaddrinfo() */
+    struct histogram connect_us;    /* first connect attempt -> connection established */
+    struct histogram reply_us;      /* REQUEST sent -> reply parsed */
+    struct histogram wait_us;       /* time blocked in epoll_wait() */
+    struct histogram write_us;      /* one update_main_csv() or round commit */
+    struct histogram fsync_us;      /* every fsync()/fdatasync() */
+    struct histogram round_us;      /* round due -> round committed */
+} metrics;
+
+static inline void stat_add(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+static void hist_record(struct histogram *h, long long us) {
+    uint64_t u = us > 0 ? (uint64_t)us : 0;
+    int i = u <= 1 ? 0 : 64 - __builtin_clzll(u - 1);
+    if (i >= HIST_BUCKETS) i = HIST_BUCKETS - 1;
+    stat_add(&h->count, 1);
+    stat_add(&h->sum_us, u);
+    stat_add(&h->bucket[i], 1);
+}
+
+/* Upper bound (us) of the bucket holding quantile q */
+static uint64_t hist_quantile(const struct histogram *h, double q) {
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5), seen = 0;
+    if (rank == 0) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) return 1ull << i;
+    }
+    return 1ull << (HIST_BUCKETS - 1);
+}
+
+static int timed_sync(int fd, int data_only) {
+    long long t0 = now_us();
+    int rc = data_only ? fdatasync(fd) : fsync(fd);
+    hist_record(&metrics.fsync_us, now_us() - t0);
+    return rc;
+}
+
+static int timed_fsync(int fd) { return timed_sync(fd, 0); }
+static int timed_fdatasync(int fd) { return timed_sync(fd, 1); }
+
+/* Decode a reply to REQUEST SINCE, text or FRAME_DELTA */
+static int parse_delta(const char *frame, size_t len, char *branch_id, size_t bid_len,
+                       unsigned long long *seq, int *kind, long long *records, long long *units) {
+    if ((unsigned char)frame[0] == FRAME_MAGIC) {
+        const unsigned char *f = (const unsigned char *)frame, *p = f + FRAME_HDR_SZ;
+        if (len < FRAME_HDR_SZ + 1 || f[1] != FRAME_DELTA) return -1;
+        size_t idlen = p[0];
+        if (len != FRAME_HDR_SZ + 1 + idlen + 25 || idlen >= bid_len) return -1;
+        memcpy(branch_id, p + 1, idlen);
+        branch_id[idlen] = '\0';
+        p += 1 + idlen;
+        *seq = get_be(p, 8);
+        *kind = p[8];
+        *records = (long long)get_be(p + 9, 8);
+        *units = (long long)get_be(p + 17, 8);
+        return *kind <= DELTA_UNCHANGED ? 0 : -1;
+    }
+    char fmt[32];
+    const char *p = strstr(frame, "BRANCH_ID:");
+    snprintf(fmt, sizeof(fmt), "BRANCH_ID: %%%zus", bid_len - 1);
+    if (!p || sscanf(p, fmt, branch_id) != 1) return -1;
+    if (!(p = strstr(frame, "SEQ:")) || sscanf(p, "SEQ: %llu", seq) != 1) return -1;
+    *records = *units = 0;
+    if (strstr(frame, "\nUNCHANGED\n")) {
+        *kind = DELTA_UNCHANGED;
+        return 0;
+    }
+    const char *r = strstr(frame, "DELTA_RECORDS:"), *u = strstr(frame, "DELTA_SUBTOTAL:");
+    *kind = r ? DELTA_CHANGED : DELTA_FULL;
+    if (!r) r = strstr(frame, "RECORDS:");
+    if (!u) u = strstr(frame, "SUBTOTAL:");
+    if (!r || !u || sscanf(strchr(r, ':') + 1, "%lld", records) != 1) return -1;
+    return parse_units(strchr(u, ':') + 1, units);
+}
+
 /* produce ISO8601 timestamp */
 void iso_time(char *buf, size_t n) {
     time_t t = time(NULL);
@@ -84,148 +348,4002 @@ void iso_time(char *buf, size_t n) {
     strftime(buf, n, "%Y-%m-%dT%H:%M:%SZ", &tm);
 }
 
-/* Atomically append an entry to main CSV: read-append-write via temp + rename, with flock for safety */
-int update_main_csv(const char *main_csv, const char *branch_id, int records, double subtotal) {
-    FILE *f = fopen(main_csv, "r");
-    if (!f) {
-        perror("fopen main csv");
-        return -1;
+static int write_all(int fd, const char *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t w = pwrite(fd, buf, len, off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += w;
+        len -= (size_t)w;
+        off += w;
     }
-    /* We will use flock on the file descriptor */
-    int fd = fileno(f);
-    if (flock(fd, LOCK_EX) != 0) {
-        perror("flock");
-        fclose(f);
-        return -1;
+    return 0;
+}
+
+/* ---- per-round arenas ----
+   What the network loop produces during a round (its rows, the items that
+   hand them to the persistence thread, replies too long for a connection's
+   inline buffer) is bump-allocated from the round's arena and released as
+   a whole. Every holder takes a reference: the loop while the round is
+   open, each queued item until the persistence thread is done with it,
+   each long reply until it is consumed. An idle arena is reused for a later
+   round, and one that needed several blocks is reset to a single block of
+   their total size, so once rounds have reached their size the loop does
+   not allocate at all. */
+
+#define ARENA_BLOCK (64 * 1024)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t cap, used;
+    char data[];
+};
+
+struct arena {
+    struct arena_block *head;   /* block being filled, older ones behind it */
+    int refs;
+    struct arena *next;         /* in its pool */
+};
+
+struct arena_pool {
+    struct arena *all;
+    struct arena *cur;          /* the open round's; NULL if out of memory */
+};
+
+static void *arena_alloc(struct arena *a, size_t n) {
+    if (!a) return NULL;
+    n = (n + 7) & ~(size_t)7;
+    struct arena_block *blk = a->head;
+    if (!blk || blk->cap - blk->used < n) {
+        size_t cap = blk ? blk->cap * 2 : ARENA_BLOCK;
+        while (cap < n) cap *= 2;
+        blk = malloc(sizeof(*blk) + cap);
+        if (!blk) return NULL;
+        blk->next = a->head;
+        blk->cap = cap;
+        blk->used = 0;
+        a->head = blk;
+    }
+    void *p = blk->data + blk->used;
+    blk->used += n;
+    return p;
+}
+
+static size_t arena_used(const struct arena *a) {
+    size_t n = 0;
+    for (const struct arena_block *blk = a ? a->head : NULL; blk; blk = blk->next) n += blk->used;
+    return n;
+}
+
+static void arena_reset(struct arena *a) {
+    struct arena_block *blk = a->head;
+    if (!blk || !blk->next) {
+        if (blk) blk->used = 0;
+        return;
+    }
+    size_t total = 0;
+    while (blk) {
+        struct arena_block *next = blk->next;
+        total += blk->cap;
+        free(blk);
+        blk = next;
+    }
+    a->head = malloc(sizeof(*blk) + total);
+    if (a->head) {
+        a->head->next = NULL;
+        a->head->cap = total;
+        a->head->used = 0;
+    }
+}
+
+static void arena_hold(struct arena *a) {
+    __atomic_add_fetch(&a->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* May be called from any thread; only the pool's owner reuses the arena */
+static void arena_put(struct arena *a) {
+    __atomic_sub_fetch(&a->refs, 1, __ATOMIC_RELEASE);
+}
+
+/* Close the open round and start the next one in an idle arena */
+static void arena_rotate(struct arena_pool *pool) {
+    struct arena *a;
+    for (a = pool->all; a; a = a->next) {
+        if (__atomic_load_n(&a->refs, __ATOMIC_ACQUIRE) == 0) break;
+    }
+    if (a) {
+        arena_reset(a);
+    } else {
+        a = calloc(1, sizeof(*a));
+        if (!a) return;     /* keep filling the old one */
+        a->next = pool->all;
+        pool->all = a;
+    }
+    __atomic_store_n(&a->refs, 1, __ATOMIC_RELAXED);
+    if (pool->cur) arena_put(pool->cur);
+    pool->cur = a;
+}
+
+static void arena_pool_free(struct arena_pool *pool) {
+    while (pool->all) {
+        struct arena *a = pool->all;
+        pool->all = a->next;
+        while (a->head) {
+            struct arena_block *blk = a->head;
+            a->head = blk->next;
+            free(blk);
+        }
+        free(a);
+    }
+    pool->cur = NULL;
+}
+
+/* ---- batched append mode ----
+   Rows from one aggregation round are collected in memory and committed
+   with a single append + fsync instead of one full rewrite per reply. A
+   small write-ahead journal (<MAIN_CSV>.journal) keeps the round atomic: the
+   rows and the file size they start at are made durable in the journal
+   first, so a crash mid-append is undone and redone on the next commit. */
+
+struct batch_row {
+    time_t ts;
+    char branch_id[64];
+    long long records;
+    long long units;
+};
+
+struct csv_batch {
+    char *buf;              /* rows as CSV text */
+    size_t len, cap;
+    struct batch_row *v;    /* the same rows, for the column store */
+    int rows, vcap;
+    struct arena *arena;    /* where buf and v live; NULL: the heap */
+};
+
+/* Room for need bytes in one of the batch's arrays: from its arena (the old
+   copy goes with the round), or realloc'd */
+static void *batch_grow(const struct csv_batch *b, void *p, size_t used, size_t need) {
+    if (!b->arena) return realloc(p, need);
+    void *q = arena_alloc(b->arena, need);
+    if (q && used) memcpy(q, p, used);
+    return q;
+}
+
+int batch_add(struct csv_batch *b, const char *branch_id, long long records, long long units) {
+    char timestr[64], row[256], amt[32];
+    time_t now = time(NULL);
+    iso_time(timestr, sizeof(timestr));
+    format_units(amt, sizeof(amt), units);
+    int n = snprintf(row, sizeof(row), "%s,%s,%lld,%s,%s\n",
+                     timestr, branch_id, records, amt, timestr);
+    if (n < 0 || (size_t)n >= sizeof(row)) return -1;
+    if (b->len + (size_t)n > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 4096;
+        while (cap < b->len + (size_t)n) cap *= 2;
+        char *p = batch_grow(b, b->buf, b->len, cap);
+        if (!p) return -1;
+        b->buf = p;
+        b->cap = cap;
+    }
+    if (b->rows == b->vcap) {
+        int cap = b->vcap ? b->vcap * 2 : 64;
+        struct batch_row *v = batch_grow(b, b->v, (size_t)b->rows * sizeof(*v),
+                                         (size_t)cap * sizeof(*v));
+        if (!v) return -1;
+        b->v = v;
+        b->vcap = cap;
+    }
+    memcpy(b->buf + b->len, row, (size_t)n);
+    b->len += (size_t)n;
+    struct batch_row *r = &b->v[b->rows++];
+    r->ts = now;
+    snprintf(r->branch_id, sizeof(r->branch_id), "%s", branch_id);
+    r->records = records;
+    r->units = units;
+    return 0;
+}
+
+static void batch_reset(struct csv_batch *b) {
+    b->len = 0;
+    b->rows = 0;
+}
+
+/* Journal layout: "JOURNAL <offset> <length>\n" followed by <length> bytes of
+   rows that belong at <offset> in the main CSV. An empty or incomplete
+   journal means there is nothing to redo. */
+static int journal_replay(int jfd, int fd) {
+    struct stat st;
+    if (fstat(jfd, &st) != 0) return -1;
+    if (st.st_size == 0) return 0;
+    char hdr[64];
+    ssize_t r = pread(jfd, hdr, sizeof(hdr) - 1, 0);
+    if (r <= 0) return -1;
+    hdr[r] = '\0';
+    long long off, len;
+    char *nl = strchr(hdr, '\n');
+    if (!nl || sscanf(hdr, "JOURNAL %lld %lld", &off, &len) != 2 ||
+        st.st_size != (off_t)(nl + 1 - hdr) + len) {
+        /* torn journal: the main CSV was never touched */
+        return ftruncate(jfd, 0);
+    }
+    char *rows = malloc((size_t)len);
+    if (!rows) return -1;
+    if (pread(jfd, rows, (size_t)len, nl + 1 - hdr) != len) { free(rows); return -1; }
+    /* The journal is only cleared lazily, so it may describe an append that
+       fully landed. Redo it only if the file stops short of its end. */
+    struct stat mst;
+    int rc = fstat(fd, &mst);
+    if (rc == 0 && mst.st_size < off + len && mst.st_size >= off) {
+        rc = ftruncate(fd, off) == 0 && write_all(fd, rows, (size_t)len, off) == 0 &&
+             timed_fsync(fd) == 0 ? 0 : -1;
+        if (rc == 0) fprintf(stderr, "Recovered %lld bytes from journal\n", len);
+    }
+    free(rows);
+    if (rc == 0) rc = ftruncate(jfd, 0);
+    return rc;
+}
+
+/* Lock the main CSV through *fdp, opened on first use and kept from one
+   commit to the next. It is reopened when the file has been replaced (a
+   rewrite renamed over it), including while we waited for the lock. */
+static int main_csv_lock(const char *main_csv, int *fdp) {
+    for (;;) {
+        if (*fdp < 0 && (*fdp = open(main_csv, O_RDWR | O_CLOEXEC)) < 0) {
+            perror("open main csv");
+            return -1;
+        }
+        if (flock(*fdp, LOCK_EX) != 0) { perror("flock"); return -1; }
+        struct stat held, cur;
+        if (fstat(*fdp, &held) == 0 && stat(main_csv, &cur) == 0 &&
+            held.st_dev == cur.st_dev && held.st_ino == cur.st_ino)
+            return *fdp;
+        flock(*fdp, LOCK_UN);
+        close(*fdp);
+        *fdp = -1;
     }
-    /* Read existing content to memory (small file expected) */
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char *contents = malloc(size + 1);
-    if (!contents) { flock(fd, LOCK_UN); fclose(f); return -1; }
-    fread(contents, 1, size, f);
-    contents[size] = '\0';
+}
 
-    /* Create temp file */
+/* Make a rename() into the directory holding path durable */
+static int fsync_parent(const char *path) {
+    char dir[512];
+    const char *slash = strrchr(path, '/');
+    if (!slash) snprintf(dir, sizeof(dir), ".");
+    else snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return -1;
+    int rc = timed_fsync(dfd);
+    close(dfd);
+    return rc;
+}
+
+/* Atomically append an entry to main CSV: copy + append into a temp file,
+   then rename, with flock for safety. The lock is taken through
+   main_csv_lock(), so a rewrite that replaced the file while we waited
+   (a compaction, another aggregator) is copied rather than undone. The old
+   rows are streamed through a stack buffer, so a long history costs one
+   pass over it but no memory. */
+int update_main_csv(const char *main_csv, const char *branch_id, long long records, long long units) {
+    int fd = -1;
+    if (main_csv_lock(main_csv, &fd) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    int rc = -1;
     char tmpname[512];
     snprintf(tmpname, sizeof(tmpname), "%s.tmp", main_csv);
-    FILE *tf = fopen(tmpname, "w");
-    if (!tf) { perror("fopen tmp"); free(contents); flock(fd, LOCK_UN); fclose(f); return -1; }
+    int tfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tfd < 0) { perror("open tmp"); goto out; }
 
     /* write old content and append new line */
-    fputs(contents, tf);
-    free(contents);
-
-    char timestr[64];
+    char chunk[64 * 1024];
+    off_t off = 0;
+    for (;;) {
+        ssize_t r = read(fd, chunk, sizeof(chunk));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) { perror("read main csv"); goto out; }
+        if (r == 0) break;
+        if (write_all(tfd, chunk, (size_t)r, off) != 0) { perror("write tmp"); goto out; }
+        off += r;
+    }
+    char timestr[64], amt[32], row[256];
     iso_time(timestr, sizeof(timestr));
-    fprintf(tf, "%s,%s,%d,%.2f,%s\n", timestr, branch_id, records, subtotal, timestr);
-    fflush(tf);
-    fsync(fileno(tf));
-    fclose(tf);
+    format_units(amt, sizeof(amt), units);
+    int n = snprintf(row, sizeof(row), "%s,%s,%lld,%s,%s\n", timestr, branch_id, records, amt, timestr);
+    if (n < 0 || (size_t)n >= sizeof(row)) goto out;
+    if (write_all(tfd, row, (size_t)n, off) != 0 || timed_fsync(tfd) != 0) {
+        perror("write tmp");
+        goto out;
+    }
 
     /* rename atomically */
     if (rename(tmpname, main_csv) != 0) {
         perror("rename");
-        flock(fd, LOCK_UN);
-        fclose(f);
+        goto out;
+    }
+    rc = 0;
+out:
+    if (tfd >= 0) close(tfd);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return rc;
+}
+
+/* Durably append the batch to main_csv and empty it. held[0] and held[1]
+   keep the CSV and its journal open between commits (-1: not yet). */
+int commit_main_csv(const char *main_csv, int held[2], struct csv_batch *b) {
+    int fd = main_csv_lock(main_csv, &held[0]);
+    if (fd < 0) return -1;
+
+    int rc = -1;
+    if (held[1] < 0) {
+        char jname[512];
+        snprintf(jname, sizeof(jname), "%s.journal", main_csv);
+        held[1] = open(jname, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    int jfd = held[1];
+    if (jfd < 0) { perror("open journal"); goto out; }
+    if (journal_replay(jfd, fd) != 0) { perror("journal replay"); goto out; }
+    if (b->len == 0) { rc = 0; goto out; }
+
+    off_t off = lseek(fd, 0, SEEK_END);
+    char hdr[64];
+    int hlen = snprintf(hdr, sizeof(hdr), "JOURNAL %lld %zu\n", (long long)off, b->len);
+    if (off < 0 || write_all(jfd, hdr, (size_t)hlen, 0) != 0 ||
+        write_all(jfd, b->buf, b->len, hlen) != 0 || timed_fsync(jfd) != 0) {
+        perror("write journal");
+        goto out;
+    }
+    if (write_all(fd, b->buf, b->len, off) != 0 || timed_fsync(fd) != 0) {
+        /* the journal is still there; the next commit redoes this one */
+        perror("append main csv");
+        goto out;
+    }
+    /* no fsync needed: a stale journal for a completed append is ignored */
+    if (ftruncate(jfd, 0) != 0) perror("truncate journal");
+    rc = 0;
+    batch_reset(b);
+out:
+    flock(fd, LOCK_UN);
+    return rc;
+}
+
+/* ---- columnar store ----
+   Optional history backend (--store DIR). Each column lives in its own file
+   of fixed-width native integers, so a scan maps only the columns it needs:
+     ts.i64        unix time of the reply
+     branch.u32    branch id, dictionary-encoded through branches.dict
+                   (one id per line, code = line number)
+     records.i64   record count
+     subtotal.i64  subtotal in 1/AMOUNT_SCALE units
+     meta          magic + committed row count
+   Columns are appended first and the row count in meta is written last, so
+   a crash leaves at most some ignored bytes past the committed rows. */
+
+#define STORE_MAGIC "BSCOL001"
+#define STORE_MAX_BRANCHES 65536
+
+enum { COL_TS, COL_BRANCH, COL_RECORDS, COL_SUBTOTAL, N_COLS };
+static const char *const col_names[N_COLS] = { "ts.i64", "branch.u32", "records.i64", "subtotal.i64" };
+static const size_t col_width[N_COLS] = { 8, 4, 8, 8 };
+
+struct col_store {
+    char dir[400];
+    int col_fd[N_COLS];
+    int meta_fd;
+    int dict_fd;
+    long long rows;
+    char **dict;
+    int ndict, dictcap;
+    int *hash;              /* open addressing over dict codes, -1 = empty */
+    int hashcap;
+};
+
+static unsigned str_hash(const char *s) {
+    unsigned h = 2166136261u;
+    for (; *s; s++) h = (h ^ (unsigned char)*s) * 16777619u;
+    return h;
+}
+
+static int dict_insert(struct col_store *cs, const char *id) {
+    if (cs->ndict == cs->dictcap) {
+        int cap = cs->dictcap ? cs->dictcap * 2 : 64;
+        char **d = realloc(cs->dict, (size_t)cap * sizeof(*d));
+        if (!d) return -1;
+        cs->dict = d;
+        cs->dictcap = cap;
+    }
+    if ((cs->ndict + 1) * 2 > cs->hashcap) {
+        int cap = cs->hashcap ? cs->hashcap * 2 : 128;
+        int *h = malloc((size_t)cap * sizeof(*h));
+        if (!h) return -1;
+        for (int i = 0; i < cap; i++) h[i] = -1;
+        for (int c = 0; c < cs->ndict; c++) {
+            unsigned j = str_hash(cs->dict[c]) & (unsigned)(cap - 1);
+            while (h[j] >= 0) j = (j + 1) & (unsigned)(cap - 1);
+            h[j] = c;
+        }
+        free(cs->hash);
+        cs->hash = h;
+        cs->hashcap = cap;
+    }
+    char *copy = strdup(id);
+    if (!copy) return -1;
+    int code = cs->ndict++;
+    cs->dict[code] = copy;
+    unsigned j = str_hash(id) & (unsigned)(cs->hashcap - 1);
+    while (cs->hash[j] >= 0) j = (j + 1) & (unsigned)(cs->hashcap - 1);
+    cs->hash[j] = code;
+    return code;
+}
+
+static int dict_lookup(const struct col_store *cs, const char *id) {
+    if (cs->hashcap == 0) return -1;
+    unsigned j = str_hash(id) & (unsigned)(cs->hashcap - 1);
+    for (; cs->hash[j] >= 0; j = (j + 1) & (unsigned)(cs->hashcap - 1)) {
+        if (strcmp(cs->dict[cs->hash[j]], id) == 0) return cs->hash[j];
+    }
+    return -1;
+}
+
+static int store_path(const struct col_store *cs, const char *name, char *out, size_t n) {
+    int r = snprintf(out, n, "%s/%s", cs->dir, name);
+    return r < 0 || (size_t)r >= n ? -1 : 0;
+}
+
+/* Open (creating if needed) the store in dir */
+int store_open(struct col_store *cs, const char *dir) {
+    memset(cs, 0, sizeof(*cs));
+    cs->meta_fd = cs->dict_fd = -1;
+    for (int c = 0; c < N_COLS; c++) cs->col_fd[c] = -1;
+    snprintf(cs->dir, sizeof(cs->dir), "%s", dir);
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) { perror("mkdir store"); return -1; }
+
+    char path[512];
+    for (int c = 0; c < N_COLS; c++) {
+        if (store_path(cs, col_names[c], path, sizeof(path)) != 0) return -1;
+        cs->col_fd[c] = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (cs->col_fd[c] < 0) { perror(path); return -1; }
+    }
+    if (store_path(cs, "meta", path, sizeof(path)) != 0) return -1;
+    cs->meta_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (cs->meta_fd < 0) { perror(path); return -1; }
+    char meta[16];
+    ssize_t r = pread(cs->meta_fd, meta, sizeof(meta), 0);
+    if (r == (ssize_t)sizeof(meta)) {
+        if (memcmp(meta, STORE_MAGIC, 8) != 0) {
+            fprintf(stderr, "%s: not a column store\n", path);
+            return -1;
+        }
+        memcpy(&cs->rows, meta + 8, 8);
+    } else if (r != 0) {
+        fprintf(stderr, "%s: truncated\n", path);
+        return -1;
+    }
+
+    if (store_path(cs, "branches.dict", path, sizeof(path)) != 0) return -1;
+    cs->dict_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (cs->dict_fd < 0) { perror(path); return -1; }
+    FILE *df = fopen(path, "r");
+    if (!df) { perror(path); return -1; }
+    char line[256];
+    while (fgets(line, sizeof(line), df)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (dict_insert(cs, line) < 0) { fclose(df); return -1; }
+    }
+    fclose(df);
+    return 0;
+}
+
+void store_close(struct col_store *cs) {
+    for (int c = 0; c < N_COLS; c++) if (cs->col_fd[c] >= 0) close(cs->col_fd[c]);
+    if (cs->meta_fd >= 0) close(cs->meta_fd);
+    if (cs->dict_fd >= 0) close(cs->dict_fd);
+    for (int i = 0; i < cs->ndict; i++) free(cs->dict[i]);
+    free(cs->dict);
+    free(cs->hash);
+}
+
+/* Encode rows[i] of column c at p; returns the bytes written, -1 on error */
+static int store_cell(struct col_store *cs, int c, const struct batch_row *r, char *p,
+                      int *new_codes) {
+    if (c == COL_BRANCH) {
+        int code = dict_lookup(cs, r->branch_id);
+        if (code < 0) {
+            if (cs->ndict >= STORE_MAX_BRANCHES) return -1;
+            char line[80];
+            int len = snprintf(line, sizeof(line), "%s\n", r->branch_id);
+            if (write_all(cs->dict_fd, line, (size_t)len, lseek(cs->dict_fd, 0, SEEK_END)) != 0 ||
+                (code = dict_insert(cs, r->branch_id)) < 0)
+                return -1;
+            *new_codes = 1;
+        }
+        uint32_t v = (uint32_t)code;
+        memcpy(p, &v, 4);
+        return 4;
+    }
+    int64_t v = c == COL_TS ? (int64_t)r->ts
+              : c == COL_RECORDS ? (int64_t)r->records
+              : (int64_t)r->units;
+    memcpy(p, &v, 8);
+    return 8;
+}
+
+/* Append n rows as one commit; each column goes out STORE_CHUNK rows at a
+   time from a stack buffer */
+#define STORE_CHUNK 512
+
+int store_append(struct col_store *cs, const struct batch_row *rows, int n) {
+    if (n == 0) return 0;
+    char col[STORE_CHUNK * 8];
+    int rc = -1, new_codes = 0;
+    for (int c = 0; c < N_COLS; c++) {
+        off_t off = (off_t)(cs->rows * (long long)col_width[c]);
+        for (int i = 0; i < n;) {
+            char *p = col;
+            for (int end = i + STORE_CHUNK; i < n && i < end; i++) {
+                int w = store_cell(cs, c, &rows[i], p, &new_codes);
+                if (w < 0) goto out;
+                p += w;
+            }
+            if (write_all(cs->col_fd[c], col, (size_t)(p - col), off) != 0) goto out;
+            off += p - col;
+        }
+        if (timed_fdatasync(cs->col_fd[c]) != 0) goto out;
+    }
+    if (new_codes && timed_fdatasync(cs->dict_fd) != 0) goto out;
+    char meta[16];
+    long long rows_after = cs->rows + n;
+    memcpy(meta, STORE_MAGIC, 8);
+    memcpy(meta + 8, &rows_after, 8);
+    if (write_all(cs->meta_fd, meta, sizeof(meta), 0) != 0 || timed_fdatasync(cs->meta_fd) != 0) goto out;
+    cs->rows = rows_after;
+    rc = 0;
+out:
+    if (rc != 0) perror("store_append");
+    return rc;
+}
+
+/* Map the committed part of one column read-only; NULL when the store is empty */
+static const void *store_map(const struct col_store *cs, int c, size_t *maplen) {
+    *maplen = (size_t)cs->rows * col_width[c];
+    if (*maplen == 0) return NULL;
+    void *p = mmap(NULL, *maplen, PROT_READ, MAP_SHARED, cs->col_fd[c], 0);
+    if (p == MAP_FAILED) return NULL;
+    madvise(p, *maplen, MADV_SEQUENTIAL);
+    return p;
+}
+
+static void format_iso(int64_t t, char *buf, size_t n) {
+    time_t tt = (time_t)t;
+    struct tm tm;
+    gmtime_r(&tt, &tm);
+    strftime(buf, n, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+/* Parse an ISO8601 UTC timestamp or a bare YYYY-MM-DD date */
+static int parse_iso(const char *s, int64_t *out) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *e = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (!e) {
+        memset(&tm, 0, sizeof(tm));
+        e = strptime(s, "%Y-%m-%d", &tm);
+    }
+    if (!e || (*e != '\0' && strcmp(e, "Z") != 0)) return -1;
+    *out = (int64_t)timegm(&tm);
+    return 0;
+}
+
+/* Rewrite main_csv from the store (temp + rename, under the commit lock),
+   keeping the existing header line if there is one */
+int store_export_csv(const struct col_store *cs, const char *main_csv) {
+    char header[512] = "timestamp,branch,records,subtotal,timestamp\n";
+    int fd = open(main_csv, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) { perror("open main csv"); return -1; }
+    close(fd);
+    fd = -1;
+    /* as in update_main_csv(): lock the file that is current once we hold it */
+    if (main_csv_lock(main_csv, &fd) < 0) {
+        if (fd >= 0) close(fd);
         return -1;
     }
+    FILE *f = fdopen(fd, "r");
+    if (!f) { perror("fdopen main csv"); flock(fd, LOCK_UN); close(fd); return -1; }
+    char first[512];
+    char ts0[64];
+    int64_t t0;
+    if (fgets(first, sizeof(first), f) &&
+        !(sscanf(first, "%63[^,]", ts0) == 1 && parse_iso(ts0, &t0) == 0))
+        snprintf(header, sizeof(header), "%s", first);
 
+    char tmpname[512];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", main_csv);
+    FILE *tf = fopen(tmpname, "w");
+    if (!tf) { perror("fopen tmp"); flock(fd, LOCK_UN); fclose(f); return -1; }
+    fputs(header, tf);
+    size_t l[N_COLS];
+    const int64_t *ts = store_map(cs, COL_TS, &l[COL_TS]);
+    const uint32_t *br = store_map(cs, COL_BRANCH, &l[COL_BRANCH]);
+    const int64_t *rec = store_map(cs, COL_RECORDS, &l[COL_RECORDS]);
+    const int64_t *sub = store_map(cs, COL_SUBTOTAL, &l[COL_SUBTOTAL]);
+    int rc = 0;
+    if (cs->rows > 0 && (!ts || !br || !rec || !sub)) rc = -1;
+    for (long long i = 0; rc == 0 && i < cs->rows; i++) {
+        char timestr[64], amt[32];
+        format_iso(ts[i], timestr, sizeof(timestr));
+        format_units(amt, sizeof(amt), sub[i]);
+        const char *id = br[i] < (uint32_t)cs->ndict ? cs->dict[br[i]] : "?";
+        fprintf(tf, "%s,%s,%lld,%s,%s\n", timestr, id, (long long)rec[i], amt, timestr);
+    }
+    if (ts) munmap((void *)ts, l[COL_TS]);
+    if (br) munmap((void *)br, l[COL_BRANCH]);
+    if (rec) munmap((void *)rec, l[COL_RECORDS]);
+    if (sub) munmap((void *)sub, l[COL_SUBTOTAL]);
+    if (fflush(tf) != 0 || timed_fsync(fileno(tf)) != 0) rc = -1;
+    fclose(tf);
+    if (rc == 0 && rename(tmpname, main_csv) != 0) { perror("rename"); rc = -1; }
     flock(fd, LOCK_UN);
     fclose(f);
+    return rc;
+}
+
+/* One branch's totals over [since, until] (unix time, inclusive). Every row
+   is a snapshot of the branch's whole totals, so the answer is the last
+   snapshot at or before until, less the last one before since when since is
+   given; ROWS counts the polls in the window. Touches the branch and ts
+   columns for every row but records/subtotal only for the two snapshots. */
+int store_query(const struct col_store *cs, const char *branch_id, int64_t since, int64_t until) {
+    int code = dict_lookup(cs, branch_id);
+    long long rows = 0, records = 0, units = 0;
+    size_t l[N_COLS];
+    if (code >= 0 && cs->rows > 0) {
+        const uint32_t *br = store_map(cs, COL_BRANCH, &l[COL_BRANCH]);
+        const int64_t *ts = store_map(cs, COL_TS, &l[COL_TS]);
+        const int64_t *rec = store_map(cs, COL_RECORDS, &l[COL_RECORDS]);
+        const int64_t *sub = store_map(cs, COL_SUBTOTAL, &l[COL_SUBTOTAL]);
+        if (!br || !ts || !rec || !sub) { perror("mmap store"); return -1; }
+        madvise((void *)rec, l[COL_RECORDS], MADV_RANDOM);
+        madvise((void *)sub, l[COL_SUBTOTAL], MADV_RANDOM);
+        /* rows are in commit order; on equal times the later one wins */
+        long long at = -1, before = -1;
+        for (long long i = 0; i < cs->rows; i++) {
+            if (br[i] != (uint32_t)code || ts[i] > until) continue;
+            if (ts[i] < since) {
+                if (before < 0 || ts[i] >= ts[before]) before = i;
+                continue;
+            }
+            rows++;
+            if (at < 0 || ts[i] >= ts[at]) at = i;
+        }
+        if (at >= 0) {
+            records = rec[at];
+            units = sub[at];
+            if (before >= 0) {
+                records -= rec[before];
+                units -= sub[before];
+            }
+        }
+        munmap((void *)br, l[COL_BRANCH]);
+        munmap((void *)ts, l[COL_TS]);
+        munmap((void *)rec, l[COL_RECORDS]);
+        munmap((void *)sub, l[COL_SUBTOTAL]);
+    }
+    char amt[32];
+    format_units(amt, sizeof(amt), units);
+    printf("BRANCH_ID: %s\nROWS: %lld\nRECORDS: %lld\nSUBTOTAL: %s\n", branch_id, rows,
+           records, amt);
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 6) {
-        fprintf(stderr, "Usage: %s <MAIN_CSV> <B1_HOST> <B1_PORT> <B2_HOST> <B2_PORT>\n", argv[0]);
-        return 1;
+/* Seed an empty store with the rows already in main_csv, so that exporting
+   from the store never drops history written before --store was used */
+int store_import_csv(struct col_store *cs, const char *main_csv) {
+    FILE *f = fopen(main_csv, "r");
+    if (!f) return 0;
+    struct csv_batch b;
+    memset(&b, 0, sizeof(b));
+    char line[512];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), f)) {
+        char ts[64], id[64];
+        long long records, units;
+        int64_t t;
+        int amt = 0;
+        if (sscanf(line, "%63[^,],%63[^,],%lld,%n", ts, id, &records, &amt) != 3 || !amt ||
+            parse_units(line + amt, &units) != 0 || parse_iso(ts, &t) != 0)
+            continue;   /* header or foreign line */
+        rc = batch_add(&b, id, records, units);
+        if (rc == 0) b.v[b.rows - 1].ts = (time_t)t;
+    }
+    fclose(f);
+    if (rc == 0 && b.rows > 0) {
+        rc = store_append(cs, b.v, b.rows);
+        if (rc == 0) printf("Imported %d existing rows from %s into store\n", b.rows, main_csv);
     }
-    const char *main_csv = argv[1];
-    const char *b1_host = argv[2];
-    const char *b1_port = argv[3];
-    const char *b2_host = argv[4];
-    const char *b2_port = argv[5];
+    free(b.buf);
+    free(b.v);
+    return rc;
+}
 
-    int s1 = connect_to(b1_host, b1_port);
-    if (s1 < 0) { fprintf(stderr, "Could not connect to branch1 %s:%s\n", b1_host, b1_port); }
-    int s2 = connect_to(b2_host, b2_port);
-    if (s2 < 0) { fprintf(stderr, "Could not connect to branch2 %s:%s\n", b2_host, b2_port); }
+/* ---- compaction (--compact hour|day|month) ----
+   Each main CSV row is a snapshot of one branch's totals, so the rows of a
+   branch within a period are summed up by the last of them. Compaction
+   replaces them, for every period before the cutoff, by one row holding
+   that snapshot, with the period's first and last reply times in the two
+   timestamp columns (a plain row has the same time in both, so compacting
+   again folds summaries like any other row). The header, foreign lines and
+   rows from the cutoff on are kept as they are.
+   The mapped file is split at line boundaries over --threads workers that
+   each roll up their part into a table of their own; the tables are merged
+   in file order, and the new file replaces the old one through temp +
+   rename under the commit lock, once any pending journal has been redone
+   and its truncation made durable (its offsets are only meaningful in the
+   old file: a stale journal surviving a crash could otherwise be "redone"
+   into the smaller compacted one). The temp file is <MAIN_CSV>.compact,
+   apart from the .tmp of per-reply writers and store exports. */
 
-    if (s1 < 0 && s2 < 0) {
-        fprintf(stderr, "No branches available. Exiting.\n");
-        return 1;
+enum { PERIOD_HOUR, PERIOD_DAY, PERIOD_MONTH };
+static const char *const period_names[] = { "hour", "day", "month" };
+
+static int64_t period_start(int64_t t, int period) {
+    time_t tt = (time_t)t;
+    struct tm tm;
+    gmtime_r(&tt, &tm);
+    tm.tm_sec = tm.tm_min = 0;
+    if (period != PERIOD_HOUR) tm.tm_hour = 0;
+    if (period == PERIOD_MONTH) tm.tm_mday = 1;
+    return (int64_t)timegm(&tm);
+}
+
+struct rollup {
+    char id[64];                /* '\0': empty slot */
+    int64_t period;
+    int64_t first, last;        /* the reply times it spans */
+    long long records, units;   /* the snapshot at 'last' */
+};
+
+struct span { size_t off, len; };   /* lines copied as they are */
+
+struct compact_part {
+    const char *base;
+    size_t begin, end;          /* whole lines */
+    int period;
+    int64_t cutoff;
+    struct rollup *v;           /* open addressing on (id, period) */
+    size_t n, cap;
+    struct span *keep;
+    size_t nkeep, keepcap;
+    long long rows;             /* rows rolled up */
+    int rc;
+    pthread_t tid;
+};
+
+/* One row -> its snapshot and span; -1 for a header or foreign line */
+static int rollup_parse(const char *line, size_t len, struct rollup *r) {
+    char buf[512], ts[64], ts2[64];
+    if (len >= sizeof(buf)) return -1;
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    int amt = 0;
+    if (sscanf(buf, "%63[^,],%63[^,],%lld,%n", ts, r->id, &r->records, &amt) != 3 || !amt ||
+        parse_units(buf + amt, &r->units) != 0 || parse_iso(ts, &r->first) != 0)
+        return -1;
+    r->last = r->first;
+    const char *tail = strchr(buf + amt, ',');
+    int64_t t;
+    if (tail && sscanf(tail + 1, "%63[^,\r\n]", ts2) == 1 && parse_iso(ts2, &t) == 0 && t > r->first)
+        r->last = t;
+    return 0;
+}
+
+static size_t rollup_hash(const char *id, int64_t period, size_t cap) {
+    return (str_hash(id) ^ (size_t)(uint64_t)period * 0x9e3779b97f4a7c15ULL) & (cap - 1);
+}
+
+/* Fold row into the part's table; later rows win ties, as in the file */
+static int rollup_add(struct compact_part *cp, const struct rollup *row) {
+    if ((cp->n + 1) * 2 > cp->cap) {
+        size_t cap = cp->cap ? cp->cap * 2 : 256;
+        struct rollup *v = calloc(cap, sizeof(*v));
+        if (!v) return -1;
+        for (size_t i = 0; i < cp->cap; i++) {
+            if (!cp->v[i].id[0]) continue;
+            size_t j = rollup_hash(cp->v[i].id, cp->v[i].period, cap);
+            while (v[j].id[0]) j = (j + 1) & (cap - 1);
+            v[j] = cp->v[i];
+        }
+        free(cp->v);
+        cp->v = v;
+        cp->cap = cap;
+    }
+    size_t j = rollup_hash(row->id, row->period, cp->cap);
+    for (; cp->v[j].id[0]; j = (j + 1) & (cp->cap - 1)) {
+        struct rollup *r = &cp->v[j];
+        if (r->period != row->period || strcmp(r->id, row->id) != 0) continue;
+        if (row->first < r->first) r->first = row->first;
+        if (row->last >= r->last) {
+            r->last = row->last;
+            r->records = row->records;
+            r->units = row->units;
+        }
+        return 0;
     }
+    cp->v[j] = *row;
+    cp->n++;
+    return 0;
+}
 
-    /* Send REQUEST to connected branches */
-    const char *req = "REQUEST\n";
-    if (s1 >= 0) robust_send(s1, req, strlen(req));
-    if (s2 >= 0) robust_send(s2, req, strlen(req));
+static int keep_span(struct compact_part *cp, size_t off, size_t len) {
+    if (cp->nkeep > 0 && cp->keep[cp->nkeep - 1].off + cp->keep[cp->nkeep - 1].len == off) {
+        cp->keep[cp->nkeep - 1].len += len;
+        return 0;
+    }
+    if (cp->nkeep == cp->keepcap) {
+        size_t cap = cp->keepcap ? cp->keepcap * 2 : 64;
+        struct span *k = realloc(cp->keep, cap * sizeof(*k));
+        if (!k) return -1;
+        cp->keep = k;
+        cp->keepcap = cap;
+    }
+    cp->keep[cp->nkeep++] = (struct span){ off, len };
+    return 0;
+}
 
-    /* Use select to wait for both sockets with TIMEOUT_SEC timeout */
-    fd_set readfds;
-    int maxfd = (s1 > s2 ? s1 : s2);
-    char buf[BUF_SZ+1];
-    if (maxfd < 0) maxfd = 0;
+static void *compact_worker(void *arg) {
+    struct compact_part *cp = arg;
+    const char *p = cp->base + cp->begin, *end = cp->base + cp->end;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *next = nl ? nl + 1 : end;
+        struct rollup row;
+        if (rollup_parse(p, (size_t)((nl ? nl : end) - p), &row) == 0 && row.first < cp->cutoff) {
+            row.period = period_start(row.first, cp->period);
+            cp->rc = rollup_add(cp, &row);
+            cp->rows++;
+        } else {
+            cp->rc = keep_span(cp, (size_t)(p - cp->base), (size_t)(next - p));
+        }
+        if (cp->rc != 0) break;
+        p = next;
+    }
+    return NULL;
+}
 
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT_SEC;
-    tv.tv_usec = 0;
+static int cmp_rollup_branch(const void *a, const void *b) {
+    const struct rollup *x = a, *y = b;
+    int c = strcmp(x->id, y->id);
+    return c ? c : (x->period > y->period) - (x->period < y->period);
+}
 
-    int remaining = 0;
-    if (s1 >= 0) remaining++;
-    if (s2 >= 0) remaining++;
+static int cmp_rollup_period(const void *a, const void *b) {
+    const struct rollup *x = a, *y = b;
+    if (x->period != y->period) return (x->period > y->period) - (x->period < y->period);
+    return strcmp(x->id, y->id);
+}
 
-    while (remaining > 0) {
-        FD_ZERO(&readfds);
-        if (s1 >= 0) FD_SET(s1, &readfds);
-        if (s2 >= 0) FD_SET(s2, &readfds);
+/* Roll up the rows of main_csv from before the period holding 'until' */
+int compact_main_csv(const char *main_csv, int period, int64_t until, int nthreads) {
+    int fd = -1;
+    if (main_csv_lock(main_csv, &fd) < 0) return -1;
+    int rc = -1, tfd = -1;
+    struct compact_part *parts = NULL;
+    const char *map = NULL;
+    struct stat st;
+    size_t len = 0;
+    char jname[512], tmpname[512];
+    snprintf(jname, sizeof(jname), "%s.journal", main_csv);
+    snprintf(tmpname, sizeof(tmpname), "%s.compact", main_csv);
+    int jfd = open(jname, O_RDWR | O_CLOEXEC);
+    if (jfd >= 0) {
+        int jrc = journal_replay(jfd, fd);
+        if (jrc == 0) jrc = timed_fsync(jfd);
+        close(jfd);
+        if (jrc != 0) { perror("journal replay"); goto out; }
+    }
+    if (fstat(fd, &st) != 0) { perror("fstat main csv"); goto out; }
+    len = (size_t)st.st_size;
+    if (len == 0) { printf("%s is empty, nothing to compact\n", main_csv); rc = 0; goto out; }
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) { map = NULL; perror("mmap main csv"); goto out; }
+    madvise((void *)map, len, MADV_SEQUENTIAL);
 
-        struct timeval tv2 = tv; /* select may modify */
-        int rv = select(maxfd + 1, &readfds, NULL, NULL, &tv2);
-        if (rv < 0) {
-            if (errno == EINTR) continue;
-            perror("select");
-            break;
-        } else if (rv == 0) {
-            fprintf(stderr, "Timeout waiting for branches.\n");
-            break;
+    /* a first line that is no row is the header, and stays first */
+    const char *nl = memchr(map, '\n', len);
+    size_t hlen = nl ? (size_t)(nl + 1 - map) : len;
+    struct rollup row;
+    if (rollup_parse(map, nl ? (size_t)(nl - map) : len, &row) == 0) hlen = 0;
+
+    parts = calloc((size_t)nthreads, sizeof(*parts));
+    if (!parts) goto out;
+    int64_t cutoff = period_start(until, period);
+    size_t at = hlen;
+    for (int i = 0; i < nthreads; i++) {
+        struct compact_part *cp = &parts[i];
+        cp->base = map;
+        cp->period = period;
+        cp->cutoff = cutoff;
+        cp->begin = at;
+        size_t cut = hlen + (len - hlen) * (size_t)(i + 1) / (size_t)nthreads;
+        if (cut < at) cut = at;
+        if (cut < len) {
+            const char *e = memchr(map + cut, '\n', len - cut);
+            cut = e ? (size_t)(e + 1 - map) : len;
         }
+        cp->end = at = cut;
+    }
+    int started = 1;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&parts[started].tid, NULL, compact_worker, &parts[started]) != 0) break;
+    }
+    compact_worker(&parts[0]);
+    /* parts the pool could not start are done here */
+    for (int i = started; i < nthreads; i++) compact_worker(&parts[i]);
+    for (int i = 1; i < started; i++) pthread_join(parts[i].tid, NULL);
 
-        for (int s = 0; s <= maxfd; ++s) {
-            if ((s == s1 || s == s2) && FD_ISSET(s, &readfds)) {
-                ssize_t r = robust_recv(s, buf, BUF_SZ);
-                if (r <= 0) {
-                    // connection closed or error
-                    close(s);
-                    if (s == s1) s1 = -1;
-                    if (s == s2) s2 = -1;
-                    remaining--;
-                    continue;
-                }
-                buf[r] = '\0';
-                // we expect the branch to send full message in one shot (small)
-                char branch_id[64];
-                int records = 0;
-                double subtotal = 0.0;
-                if (parse_reply(buf, branch_id, sizeof(branch_id), &records, &subtotal) == 0) {
-                    printf("Received from %s: records=%d subtotal=%.2f\n", branch_id, records, subtotal);
-                    if (update_main_csv(main_csv, branch_id, records, subtotal) == 0) {
-                        printf("main CSV updated for branch %s\n", branch_id);
-                    } else {
-                        fprintf(stderr, "Failed to update main CSV for branch %s\n", branch_id);
-                    }
-                } else {
-                    fprintf(stderr, "Malformed reply from socket %d: [%s]\n", s, buf);
-                }
-                close(s);
-                if (s == s1) s1 = -1;
-                if (s == s2) s2 = -1;
-                remaining--;
-            }
-        } /* end for */
-    } /* end while */
+    struct compact_part *all = &parts[0];
+    long long rows = 0;
+    for (int i = 0; i < nthreads; i++) {
+        if (parts[i].rc != 0) { perror("compact"); goto out; }
+        rows += parts[i].rows;
+        for (size_t j = 0; i > 0 && j < parts[i].cap; j++) {
+            if (parts[i].v[j].id[0] && rollup_add(all, &parts[i].v[j]) != 0) { perror("compact"); goto out; }
+        }
+    }
+    if (all->n == (size_t)rows) {
+        printf("%s: no %s before the cutoff has more than one row per branch, nothing to compact\n",
+               main_csv, period_names[period]);
+        rc = 0;
+        goto out;
+    }
+    size_t n = 0;
+    for (size_t j = 0; j < all->cap; j++) if (all->v[j].id[0]) all->v[n++] = all->v[j];
+
+    /* where each branch stood at the cutoff: its last summary */
+    qsort(all->v, n, sizeof(*all->v), cmp_rollup_branch);
+    long long branches = 0, records = 0, units = 0;
+    for (size_t j = 0; j < n; j++) {
+        if (j + 1 < n && strcmp(all->v[j].id, all->v[j + 1].id) == 0) continue;
+        branches++;
+        records += all->v[j].records;
+        units += all->v[j].units;
+    }
+    qsort(all->v, n, sizeof(*all->v), cmp_rollup_period);
+
+    tfd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tfd < 0) { perror("open tmp"); goto out; }
+    off_t off = 0;
+    if (write_all(tfd, map, hlen, off) != 0) { perror("write tmp"); goto out; }
+    off += (off_t)hlen;
+    char chunk[64 * 1024];
+    size_t used = 0;
+    for (size_t j = 0; j <= n; j++) {
+        if (j == n || used + 256 > sizeof(chunk)) {
+            if (write_all(tfd, chunk, used, off) != 0) { perror("write tmp"); goto out; }
+            off += (off_t)used;
+            used = 0;
+            if (j == n) break;
+        }
+        const struct rollup *r = &all->v[j];
+        char first[64], last[64], amt[32];
+        format_iso(r->first, first, sizeof(first));
+        format_iso(r->last, last, sizeof(last));
+        format_units(amt, sizeof(amt), r->units);
+        used += (size_t)snprintf(chunk + used, sizeof(chunk) - used, "%s,%s,%lld,%s,%s\n",
+                                 first, r->id, r->records, amt, last);
+    }
+    long long kept = 0;
+    for (int i = 0; i < nthreads; i++) {
+        for (size_t k = 0; k < parts[i].nkeep; k++) {
+            const struct span *s = &parts[i].keep[k];
+            if (write_all(tfd, map + s->off, s->len, off) != 0) { perror("write tmp"); goto out; }
+            off += (off_t)s->len;
+            kept += (long long)s->len;
+        }
+    }
+    if (timed_fsync(tfd) != 0) { perror("fsync tmp"); goto out; }
+    if (rename(tmpname, main_csv) != 0) { perror("rename"); goto out; }
+    rc = 0;
+    if (fsync_parent(main_csv) != 0) perror("fsync main csv directory");
+
+    char when[64], amt[32];
+    format_iso(cutoff, when, sizeof(when));
+    format_units(amt, sizeof(amt), units);
+    printf("Compacted %s by %s: %lld rows before %s -> %zu, %lld bytes kept as they were; %lld -> %lld bytes\n",
+           main_csv, period_names[period], rows, when, n, kept, (long long)len, (long long)off);
+    printf("At %s: %lld branches, records %lld, subtotal %s\n", when, branches, records, amt);
+out:
+    if (tfd >= 0) close(tfd);
+    if (rc != 0 && tfd >= 0) unlink(tmpname);
+    if (map) munmap((void *)map, len);
+    for (int i = 0; parts && i < nthreads; i++) {
+        free(parts[i].v);
+        free(parts[i].keep);
+    }
+    free(parts);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return rc;
+}
+
+/* Where the rows of a completed round go in batched mode */
+struct round_sink {
+    const char *main_csv;
+    struct col_store *store;    /* --store; NULL appends to main_csv */
+    int export_every;           /* with a store: re-export main_csv every N commits */
+    int commits;
+    int held[2];                /* main_csv and its journal, kept open; -1: closed */
+};
+
+static void sink_close(struct round_sink *rs) {
+    for (int i = 0; i < 2; i++) {
+        if (rs->held[i] >= 0) close(rs->held[i]);
+        rs->held[i] = -1;
+    }
+}
+
+static int commit_round_untimed(struct round_sink *rs, struct csv_batch *b) {
+    if (!rs->store) return commit_main_csv(rs->main_csv, rs->held, b);
+    if (store_append(rs->store, b->v, b->rows) != 0) return -1;
+    batch_reset(b);
+    rs->commits++;
+    if (rs->export_every > 0 && rs->commits % rs->export_every == 0 &&
+        store_export_csv(rs->store, rs->main_csv) != 0)
+        fprintf(stderr, "Failed to export main CSV from store\n");
+    return 0;
+}
+
+static int commit_round(struct round_sink *rs, struct csv_batch *b) {
+    long long t0 = now_us();
+    int rc = commit_round_untimed(rs, b);
+    hist_record(&metrics.write_us, now_us() - t0);
+    return rc;
+}
+
+/* ---- persistence stage ----
+   The network loop never touches the disk: per-reply rewrites, round commits
+   and the metrics file are handed to one persistence thread through an
+   intrusive multi-producer single-consumer queue (Vyukov's: producers swap
+   the head, only the consumer walks from the tail). The consumer blocks on
+   an eventfd only after announcing it in 'sleeping', so producers pay for a
+   write() only when it is idle. A slow disk lets the queue grow; it never
+   holds up a recv(). */
+
+enum { PERSIST_ROW, PERSIST_BATCH, PERSIST_METRICS, PERSIST_FENCE, PERSIST_STOP };
+
+struct persist_item {
+    struct persist_item *next;
+    int kind;
+    int round;                  /* PERSIST_BATCH: round number, 0 for none */
+    char branch_id[64];         /* PERSIST_ROW */
+    long long records, units;
+    struct csv_batch batch;     /* PERSIST_BATCH: owned by the item */
+    struct arena *arena;        /* the item (and its batch) lives here; NULL: the heap */
+};
+
+struct branch_list;
+static int write_metrics(const char *path, const struct branch_list *bl);
+
+struct persister {
+    struct persist_item *head;  /* last pushed; swapped by producers */
+    struct persist_item *tail;  /* next to pop; consumer only */
+    struct persist_item stub;
+    int sleeping;
+    int efd;
+    int fence_efd;              /* signalled when a PERSIST_FENCE is reached */
+    pthread_t tid;
+    struct round_sink *sink;
+    struct csv_batch pending;   /* rows whose commit failed, retried with the next batch */
+    struct arena_pool *arenas;  /* producers: items go in the open round's arena */
+    const char *metrics_file;
+    const struct branch_list *bl;
+};
+
+static void persist_link(struct persister *ps, struct persist_item *it) {
+    __atomic_store_n(&it->next, NULL, __ATOMIC_RELAXED);
+    struct persist_item *prev = __atomic_exchange_n(&ps->head, it, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&prev->next, it, __ATOMIC_SEQ_CST);
+}
+
+static void persist_push(struct persister *ps, struct persist_item *it) {
+    persist_link(ps, it);
+    if (__atomic_exchange_n(&ps->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        while (write(ps->efd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* NULL if the queue is empty, or a push is halfway through */
+static struct persist_item *persist_pop(struct persister *ps) {
+    struct persist_item *tail = ps->tail;
+    struct persist_item *next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    if (tail == &ps->stub) {
+        if (!next) return NULL;
+        ps->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+    }
+    if (!next) {
+        /* tail is the newest item: queue the stub behind it to take it */
+        if (tail != __atomic_load_n(&ps->head, __ATOMIC_SEQ_CST)) return NULL;
+        persist_link(ps, &ps->stub);
+        next = __atomic_load_n(&tail->next, __ATOMIC_SEQ_CST);
+        if (!next) return NULL;
+    }
+    ps->tail = next;
+    return tail;
+}
+
+/* Move the rows of src to the end of dst; src is left empty */
+static int batch_move(struct csv_batch *dst, struct csv_batch *src) {
+    if (dst->rows == 0 && !dst->arena && !src->arena) {
+        struct csv_batch t = *dst;
+        *dst = *src;
+        *src = t;
+        batch_reset(src);
+        return 0;
+    }
+    if (dst->len + src->len > dst->cap) {
+        size_t cap = dst->len + src->len;
+        char *p = realloc(dst->buf, cap);
+        if (!p) return -1;
+        dst->buf = p;
+        dst->cap = cap;
+    }
+    if (dst->rows + src->rows > dst->vcap) {
+        int cap = dst->rows + src->rows;
+        struct batch_row *v = realloc(dst->v, (size_t)cap * sizeof(*v));
+        if (!v) return -1;
+        dst->v = v;
+        dst->vcap = cap;
+    }
+    memcpy(dst->buf + dst->len, src->buf, src->len);
+    dst->len += src->len;
+    memcpy(dst->v + dst->rows, src->v, (size_t)src->rows * sizeof(*src->v));
+    dst->rows += src->rows;
+    batch_reset(src);
+    return 0;
+}
+
+static void persist_run(struct persister *ps, struct persist_item *it) {
+    const char *dest = ps->sink->store ? "store" : "main CSV";
+    if (it->kind == PERSIST_ROW) {
+        long long t0 = now_us();
+        int urc = update_main_csv(ps->sink->main_csv, it->branch_id, it->records, it->units);
+        hist_record(&metrics.write_us, now_us() - t0);
+        if (urc == 0)
+            printf("main CSV updated for branch %s\n", it->branch_id);
+        else
+            fprintf(stderr, "Failed to update main CSV for branch %s\n", it->branch_id);
+    } else if (it->kind == PERSIST_BATCH) {
+        /* the rows are committed from where they are; only a failed commit
+           copies them to the heap, to be retried before the next batch */
+        struct csv_batch *rows = &it->batch;
+        if (ps->pending.rows > 0) {
+            if (batch_move(&ps->pending, &it->batch) != 0) {
+                fprintf(stderr, "Out of memory queueing rows for the %s\n", dest);
+                return;
+            }
+            rows = &ps->pending;
+        }
+        int nrows = rows->rows;
+        if (commit_round(ps->sink, rows) != 0) {
+            if (rows != &ps->pending && batch_move(&ps->pending, rows) != 0)
+                fprintf(stderr, "Out of memory keeping rows for the %s\n", dest);
+            if (it->round) fprintf(stderr, "Failed to append round %d to %s\n", it->round, dest);
+            else fprintf(stderr, "Failed to append rows to %s\n", dest);
+        } else if (it->round) {
+            printf("%s appended %d rows (round %d)\n", dest, nrows, it->round);
+        } else {
+            printf("%s appended %d rows\n", dest, nrows);
+        }
+    } else if (it->kind == PERSIST_METRICS) {
+        write_metrics(ps->metrics_file, ps->bl);
+    } else if (it->kind == PERSIST_FENCE) {
+        uint64_t one = 1;
+        while (write(ps->fence_efd, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+static void *persist_thread(void *arg) {
+    struct persister *ps = arg;
+    for (;;) {
+        struct persist_item *it = persist_pop(ps);
+        if (!it) {
+            __atomic_store_n(&ps->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (!(it = persist_pop(ps))) {
+                uint64_t cnt;
+                while (read(ps->efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+                    ;
+                continue;
+            }
+            __atomic_store_n(&ps->sleeping, 0, __ATOMIC_SEQ_CST);
+        }
+        int stop = it->kind == PERSIST_STOP;
+        persist_run(ps, it);
+        if (it->arena) {
+            arena_put(it->arena);
+        } else {
+            free(it->batch.buf);
+            free(it->batch.v);
+            free(it);
+        }
+        if (stop) break;
+    }
+    return NULL;
+}
+
+static int persist_start(struct persister *ps, struct round_sink *sink, const char *metrics_file,
+                         const struct branch_list *bl, struct arena_pool *arenas) {
+    memset(ps, 0, sizeof(*ps));
+    ps->arenas = arenas;
+    ps->head = ps->tail = &ps->stub;
+    ps->sink = sink;
+    ps->metrics_file = metrics_file;
+    ps->bl = bl;
+    ps->efd = eventfd(0, EFD_CLOEXEC);
+    if (ps->efd < 0) return -1;
+    ps->fence_efd = eventfd(0, EFD_CLOEXEC);
+    if (ps->fence_efd < 0 || pthread_create(&ps->tid, NULL, persist_thread, ps) != 0) {
+        close(ps->efd);
+        if (ps->fence_efd >= 0) close(ps->fence_efd);
+        return -1;
+    }
+    return 0;
+}
+
+/* A zeroed item in arena a, or on the heap if a is NULL */
+static struct persist_item *persist_item(struct arena *a, int kind) {
+    struct persist_item *it = a ? arena_alloc(a, sizeof(*it)) : malloc(sizeof(*it));
+    if (!it) return NULL;
+    memset(it, 0, sizeof(*it));
+    it->kind = kind;
+    it->arena = a;
+    if (a) arena_hold(a);
+    return it;
+}
+
+static int persist_simple(struct persister *ps, int kind) {
+    struct persist_item *it = persist_item(ps->arenas ? ps->arenas->cur : NULL, kind);
+    if (!it) return -1;
+    persist_push(ps, it);
+    return 0;
+}
+
+static int persist_row(struct persister *ps, const char *branch_id, long long records,
+                       long long units) {
+    struct persist_item *it = persist_item(ps->arenas ? ps->arenas->cur : NULL, PERSIST_ROW);
+    if (!it) return -1;
+    snprintf(it->branch_id, sizeof(it->branch_id), "%s", branch_id);
+    it->records = records;
+    it->units = units;
+    persist_push(ps, it);
+    return 0;
+}
+
+/* Hand the batch's rows over; b is left empty for the next round */
+static int persist_batch(struct persister *ps, struct csv_batch *b, int round) {
+    struct persist_item *it = persist_item(b->arena, PERSIST_BATCH);
+    if (!it) return -1;
+    it->round = round;
+    it->batch = *b;
+    memset(b, 0, sizeof(*b));
+    persist_push(ps, it);
+    return 0;
+}
+
+/* Wait until everything queued so far has been handled, e.g. before
+   changing the branch list the metrics are written from */
+static int persist_fence(struct persister *ps) {
+    if (persist_simple(ps, PERSIST_FENCE) != 0) return -1;
+    uint64_t cnt;
+    while (read(ps->fence_efd, &cnt, sizeof(cnt)) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+/* Wait for everything queued so far to be written, then end the thread */
+static void persist_stop(struct persister *ps) {
+    if (persist_simple(ps, PERSIST_STOP) == 0) pthread_join(ps->tid, NULL);
+    close(ps->efd);
+    close(ps->fence_efd);
+    free(ps->pending.buf);
+    free(ps->pending.v);
+}
+
+/* ---- name resolution ----
+   getaddrinfo() blocks the network loop, so every host:port is resolved once
+   and reused for --dns-ttl seconds (the libc resolver does not expose record
+   TTLs). A failed lookup is retried after DNS_RETRY_MS and meanwhile the last
+   good addresses, if any, keep being used. Addresses are stored with the
+   families interleaved (RFC 8305) for the connect race below. */
+
+#define DNS_BUCKETS 1024
+#define DNS_MAX_ADDRS 8
+#define DNS_RETRY_MS 1000
+
+struct dns_entry {
+    struct dns_entry *next;
+    char *host, *port;
+    long long expires_ms;
+    int naddr;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t addrlen[DNS_MAX_ADDRS];
+};
+
+static struct dns_entry *dns_table[DNS_BUCKETS];
+static long long dns_ttl_ms = 60000;
+
+static const struct dns_entry *dns_lookup(const char *host, const char *port, long long now) {
+    unsigned h = (str_hash(host) * 31 + str_hash(port)) & (DNS_BUCKETS - 1);
+    struct dns_entry *e = dns_table[h];
+    while (e && (strcmp(e->host, host) != 0 || strcmp(e->port, port) != 0)) e = e->next;
+    if (e && now < e->expires_ms) {
+        stat_add(&metrics.dns_hits, 1);
+        return e;
+    }
+    if (!e) {
+        e = calloc(1, sizeof(*e));
+        if (!e) return NULL;
+        e->host = strdup(host);
+        e->port = strdup(port);
+        if (!e->host || !e->port) {
+            free(e->host);
+            free(e->port);
+            free(e);
+            return NULL;
+        }
+        e->next = dns_table[h];
+        dns_table[h] = e;
+    }
+    stat_add(&metrics.dns_lookups, 1);
+    if (host[0] == '/') {
+        /* a Unix socket path; the port is ignored */
+        struct sockaddr_un *sa = (struct sockaddr_un *)&e->addr[0];
+        e->naddr = strlen(host) < sizeof(sa->sun_path);
+        sa->sun_family = AF_UNIX;
+        if (e->naddr) strcpy(sa->sun_path, host);
+        e->addrlen[0] = sizeof(*sa);
+        e->expires_ms = LLONG_MAX;
+        return e;
+    }
+    struct addrinfo hints, *res, *rp;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    long long t0 = now_us();
+    int rc = getaddrinfo(host, port, &hints, &res);
+    hist_record(&metrics.resolve_us, now_us() - t0);
+    if (rc != 0) {
+        e->expires_ms = now + DNS_RETRY_MS;
+        return e;
+    }
+    /* the resolver's first family leads, then alternate */
+    const struct addrinfo *fam[2][DNS_MAX_ADDRS];
+    int nfam[2] = { 0, 0 };
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        int k = rp->ai_family != res->ai_family;
+        if (nfam[k] < DNS_MAX_ADDRS && rp->ai_addrlen <= sizeof(e->addr[0])) fam[k][nfam[k]++] = rp;
+    }
+    e->naddr = 0;
+    for (int i = 0; i < nfam[0] || i < nfam[1]; i++) {
+        for (int k = 0; k < 2; k++) {
+            if (i >= nfam[k] || e->naddr == DNS_MAX_ADDRS) continue;
+            memcpy(&e->addr[e->naddr], fam[k][i]->ai_addr, fam[k][i]->ai_addrlen);
+            e->addrlen[e->naddr++] = fam[k][i]->ai_addrlen;
+        }
+    }
+    freeaddrinfo(res);
+    e->expires_ms = now + dns_ttl_ms;
+    return e;
+}
+
+/* ---- branch connections ----
+   Replies are framed by a terminating "END" line, so a reply may arrive in
+   any number of recv() calls and several pipelined replies may arrive in one.
+   Every branch socket is non-blocking and multiplexed through one epoll set,
+   so the number of branches is not limited by FD_SETSIZE.
+   A connect races the resolved addresses happy-eyeballs style: the next one
+   is started every HE_DELAY_MS (or as soon as all running attempts failed)
+   and the first to complete wins. Without keep-alive the connection for the
+   next round is opened as soon as a reply is in, so it is warm when the
+   request is due; an idle connection the server closes is simply dropped. */
+
+#define PIPE_RING 64    /* most requests in flight per branch */
+#define HE_DELAY_MS 250 /* head start of each connect attempt */
+#define LAT_WINDOW 64   /* replies a branch's p95 is taken over */
+#define LAT_MIN 8       /* ... and how many it needs before it counts */
+#define WAIT_FLOOR_MS 10    /* shortest adaptive round wait */
+
+/* Latest totals and reply latency of one branch, read by the persistence
+   thread for the metrics file. Each slot fills its own cache line, so updates
+   to one branch never contend with another's; the single writer brackets an
+   update by bumping 'ver' (odd while it is in progress) and readers retry
+   until they see the same even 'ver' on both sides of their copy. */
+struct branch_state {
+    _Alignas(64) uint64_t ver;
+    long long records, units;
+    long long replies, reply_us, reply_max_us;
+    long long reply_p95_us, wait_ms;    /* the branch's adaptive round wait */
+};
+
+static void state_begin(struct branch_state *st) {
+    __atomic_store_n(&st->ver, st->ver + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void state_end(struct branch_state *st) {
+    __atomic_store_n(&st->ver, st->ver + 1, __ATOMIC_RELEASE);
+}
+
+static void state_set_totals(struct branch_state *st, long long records, long long units) {
+    state_begin(st);
+    __atomic_store_n(&st->records, records, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->units, units, __ATOMIC_RELAXED);
+    state_end(st);
+}
+
+static void state_add_reply(struct branch_state *st, long long lat, long long p95, long long wait_ms) {
+    state_begin(st);
+    __atomic_store_n(&st->reply_p95_us, p95, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->wait_ms, wait_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->replies, st->replies + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->reply_us, st->reply_us + lat, __ATOMIC_RELAXED);
+    if (lat > st->reply_max_us) __atomic_store_n(&st->reply_max_us, lat, __ATOMIC_RELAXED);
+    state_end(st);
+}
+
+static void state_read(const struct branch_state *st, struct branch_state *out) {
+    uint64_t v;
+    do {
+        while ((v = __atomic_load_n(&st->ver, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        out->records = __atomic_load_n(&st->records, __ATOMIC_RELAXED);
+        out->units = __atomic_load_n(&st->units, __ATOMIC_RELAXED);
+        out->replies = __atomic_load_n(&st->replies, __ATOMIC_RELAXED);
+        out->reply_us = __atomic_load_n(&st->reply_us, __ATOMIC_RELAXED);
+        out->reply_max_us = __atomic_load_n(&st->reply_max_us, __ATOMIC_RELAXED);
+        out->reply_p95_us = __atomic_load_n(&st->reply_p95_us, __ATOMIC_RELAXED);
+        out->wait_ms = __atomic_load_n(&st->wait_ms, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&st->ver, __ATOMIC_RELAXED) != v);
+    out->ver = v;
+}
+
+struct branch_conn {
+    int index;              /* position in the branch list, for messages */
+    char *host;
+    char *port;
+    char *route;            /* branch to ask a multi-branch host for, or NULL */
+    int timeout_ms;         /* per-branch reply deadline */
+    unsigned long long seq; /* --delta: sequence number of the last reply */
+    long long tot_records, tot_units;   /* --delta, --serve: latest totals of the branch */
+    int have_totals;        /* --serve: tot_* are valid */
+    int want;               /* --serve: the running refresh waits for this branch */
+    int answered;           /* --serve: ... and has its answer */
+    long long win_records, win_units;   /* --serve: ... to a windowed query */
+    int no_delta;           /* --serve: answered SINCE with an error, gets plain REQUESTs */
+    int fd;
+    int connecting;         /* non-blocking connect() still in progress */
+    int alt_fd[DNS_MAX_ADDRS];  /* ... and further attempts racing fd */
+    int nalt;
+    int next_addr;          /* next address of 'dns' to try */
+    long long next_try_ms;  /* when to start it, -1: none left */
+    const struct dns_entry *dns;
+    int keepalive;          /* server acknowledged HELLO KEEPALIVE */
+    int hello_sent;         /* HELLO went out on the current connection */
+    int hello_acked;        /* ... and the server answered it */
+    int subscribed;         /* --subscribe: SUBSCRIBE went out on the current connection */
+    int no_hello;           /* old server: dropped us on HELLO, send plain REQUESTs */
+    int failed;             /* gave up on this branch */
+    int down;               /* --daemon: missed its last round, not given up on */
+    long long offset_ms;    /* --jitter: this branch's slot within each round */
+    int sent, received;     /* REQUESTs over the whole run */
+    int conn_replies;       /* replies on the current connection */
+    long long deadline_ms;  /* give up if nothing arrives by then */
+    long long connect_us;   /* when the current connect started */
+    long long sent_us[PIPE_RING];   /* send time of outstanding REQUESTs */
+    long long srtt_us, rttvar_us;   /* reply latency: smoothed mean and deviation */
+    long long lat_us[LAT_WINDOW];   /* the last replies' latencies */
+    int lat_n, lat_next;
+    long long p95_us;       /* of lat_us, once there are LAT_MIN of them */
+    int replica;            /* index of the replica hedges go to, -1: none */
+    int primary;            /* this is a replica: index of its branch, else -1 */
+    int hedged;             /* replica the oldest outstanding REQUEST also went to, or -1 */
+    int hedge_for;          /* ... which one (by 'received'), so it goes just once */
+    int hedge_seq;          /* replica: which of its REQUESTs is the live hedge */
+    int hedge_want;         /* replica: send the hedge once connected */
+    struct branch_state *state;     /* this branch's slot in the shared table */
+    int is_shm;             /* host is shm:NAME, read from the segment */
+    struct shm_seg *shm;    /* ... once mapped */
+    int shm_slot;           /* ... and its slot there */
+    char buf[BUF_SZ+1];
+    size_t len;
+    char *big;              /* a reply longer than buf: received here instead */
+    size_t big_cap;
+    struct arena *big_arena;
+    char saved;             /* byte under the NUL next_frame() put after a reply */
+    int rx_queued;          /* --io-uring: a RECV went out for this batch of events */
+    int rx_res;             /* ... and its result */
+    struct iovec tx_iov[PIPE_RING];     /* --io-uring: the SENDMSG in flight */
+    struct msghdr tx_msg;
+    char tx_line[384];
+    int tx_n;               /* its entries, 0: none */
+};
+
+struct branch_list {
+    struct branch_conn *v;
+    int n, cap;
+};
+
+static int add_branch(struct branch_list *bl, const char *host, const char *port, int timeout_ms,
+                      const char *route) {
+    if (bl->n == bl->cap) {
+        int cap = bl->cap ? bl->cap * 2 : 16;
+        struct branch_conn *v = realloc(bl->v, (size_t)cap * sizeof(*v));
+        if (!v) return -1;
+        bl->v = v;
+        bl->cap = cap;
+    }
+    struct branch_conn *b = &bl->v[bl->n];
+    memset(b, 0, sizeof(*b));
+    b->index = bl->n;
+    b->host = strdup(host);
+    b->port = strdup(port);
+    b->route = route ? strdup(route) : NULL;
+    b->timeout_ms = timeout_ms;
+    b->fd = -1;
+    b->replica = b->primary = b->hedged = b->hedge_for = -1;
+    b->is_shm = strncmp(host, "shm:", 4) == 0;
+    b->shm_slot = -1;
+    if (!b->host || !b->port || (route && !b->route)) return -1;
+    bl->n++;
+    return 0;
+}
+
+/* Branch list file: one "<host> <port> [timeout_ms] [branch_id] [+<host>:<port>]..."
+   per line (branch_id picks one branch of a multi-branch host; each
+   +<host>:<port>, "+[v6addr]:<port>" for IPv6, is a replica serving the same
+   data, for hedged requests); blank lines and anything after '#' are ignored */
+static int load_branches(const char *path, struct branch_list *bl, int default_timeout_ms) {
+    FILE *f = fopen(path, "r");
+    if (!f) { perror("fopen branch list"); return -1; }
+    char line[512];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *save, *tok[16], *rport[16];
+        int n = 0, nrep = 0, bad = 0;
+        for (char *t = strtok_r(line, " \t\r\n", &save); t; t = strtok_r(NULL, " \t\r\n", &save)) {
+            if (n == 16) { bad = 1; break; }
+            tok[n++] = t;
+        }
+        if (n == 0) continue;
+        const char *route = NULL;
+        int timeout_ms = default_timeout_ms, i = 2;
+        if (i < n && tok[i][0] != '+' && strspn(tok[i], "0123456789") == strlen(tok[i]))
+            timeout_ms = atoi(tok[i++]);
+        if (i < n && tok[i][0] != '+') route = tok[i++];
+        for (int j = i; j < n; j++) {
+            /* split at the last ':', outside any [] around an IPv6 address */
+            char *h = tok[j] + 1, *colon = strrchr(h, ':');
+            if (tok[j][0] != '+' || !colon || colon == h || !colon[1]) { bad = 1; break; }
+            *colon = '\0';
+            if (h[0] == '[' && colon[-1] == ']') {
+                h++;
+                colon[-1] = '\0';
+            }
+            tok[j] = h;
+            rport[j] = colon + 1;
+            nrep++;
+        }
+        if (n < 2 || bad || timeout_ms <= 0) {
+            fprintf(stderr, "%s:%d: expected <host> <port> [timeout_ms] [branch_id] [+<host>:<port>]...\n",
+                    path, lineno);
+            fclose(f);
+            return -1;
+        }
+        /* replicas follow their branch, linked in a ring its hedges go round */
+        int first = bl->n;
+        if (add_branch(bl, tok[0], tok[1], timeout_ms, route) != 0) { fclose(f); return -1; }
+        for (int j = n - nrep; j < n; j++) {
+            if (add_branch(bl, tok[j], rport[j], timeout_ms, route) != 0) { fclose(f); return -1; }
+            bl->v[bl->n - 1].primary = first;
+            bl->v[bl->n - 1].replica = first + 1;
+            bl->v[bl->n - 2].replica = bl->n - 1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static void drop_fd(int epfd, int fd) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+}
+
+static void branch_close(int epfd, struct branch_conn *b) {
+    if (b->fd >= 0) drop_fd(epfd, b->fd);
+    for (int i = 0; i < b->nalt; i++) drop_fd(epfd, b->alt_fd[i]);
+    b->fd = -1;
+    b->nalt = 0;
+    b->connecting = 0;
+    b->rx_queued = b->tx_n = 0;
+}
+
+/* Start a connect to the next resolved address -> its fd, or -1 if none
+   is left */
+static int branch_try_next(int epfd, struct branch_conn *b, long long now) {
+    while (b->dns && b->next_addr < b->dns->naddr) {
+        int i = b->next_addr++;
+        int fd = connect_addr(&b->dns->addr[i], b->dns->addrlen[i]);
+        if (fd < 0) continue;
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLIN, .data.ptr = b };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            close(fd);
+            continue;
+        }
+        if (b->fd < 0) b->fd = fd;
+        else b->alt_fd[b->nalt++] = fd;
+        b->next_try_ms = b->next_addr < b->dns->naddr ? now + HE_DELAY_MS : -1;
+        return fd;
+    }
+    b->next_try_ms = -1;
+    return -1;
+}
+
+/* Start the next connect attempt once the running ones had their head
+   start; folds the time of the next one into *wake */
+static void branch_stagger(int epfd, struct branch_conn *b, long long now, long long *wake) {
+    if (!b->connecting || b->next_try_ms < 0) return;
+    if (now >= b->next_try_ms) branch_try_next(epfd, b, now);
+    if (b->next_try_ms >= 0 && (*wake < 0 || b->next_try_ms < *wake)) *wake = b->next_try_ms;
+}
+
+/* ---- receive buffers ----
+   Replies are parsed where they were received. Most fit the inline buffer
+   of their connection; a longer one (REQUEST ALL to a big host) moves to a
+   buffer twice the size in the open round's arena, up to MAX_REPLY, and
+   back once it has been consumed. */
+
+#define MAX_REPLY (1 << 20)
+
+static char *rx_data(struct branch_conn *b) {
+    return b->big ? b->big : b->buf;
+}
+
+static void rx_shrink(struct branch_conn *b) {
+    if (!b->big || b->len > BUF_SZ) return;
+    memcpy(b->buf, b->big, b->len);
+    arena_put(b->big_arena);
+    b->big = NULL;
+}
+
+/* Room left for input; a full buffer is grown first (ENOMEM if it cannot be) */
+static ssize_t rx_room(struct branch_conn *b, struct arena_pool *arenas) {
+    size_t cap = b->big ? b->big_cap : BUF_SZ;
+    if (b->len == cap) {
+        size_t ncap = cap * 2 > MAX_REPLY ? MAX_REPLY : cap * 2;
+        char *p = ncap > cap ? arena_alloc(arenas->cur, ncap + 1) : NULL;
+        if (!p) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(p, rx_data(b), b->len);
+        if (b->big) arena_put(b->big_arena);
+        arena_hold(arenas->cur);
+        b->big = p;
+        b->big_cap = cap = ncap;
+        b->big_arena = arenas->cur;
+    }
+    return (ssize_t)(cap - b->len);
+}
+
+static void rx_got(struct branch_conn *b, ssize_t r) {
+    if (r > 0) {
+        b->len += (size_t)r;
+        stat_add(&metrics.bytes_in, (uint64_t)r);
+    }
+}
+
+/* recv() whatever fits */
+static ssize_t branch_recv(struct branch_conn *b, struct arena_pool *arenas) {
+    ssize_t room = rx_room(b, arenas);
+    if (room < 0) return -1;
+    ssize_t r = robust_recv(b->fd, rx_data(b) + b->len, (size_t)room);
+    rx_got(b, r);
+    return r;
+}
+
+/* Start a (re)connect; it completes asynchronously via EPOLLOUT */
+static int branch_open(int epfd, struct branch_conn *b, long long now) {
+    b->len = 0;
+    rx_shrink(b);
+    b->keepalive = 0;
+    b->conn_replies = 0;
+    b->hello_sent = b->hello_acked = 0;
+    b->subscribed = 0;
+    b->connect_us = now_us();
+    b->dns = dns_lookup(b->host, b->port, now);
+    b->next_addr = 0;
+    if (branch_try_next(epfd, b, now) < 0) { stat_add(&metrics.connect_failures, 1); return -1; }
+    b->connecting = 1;
+    b->deadline_ms = now + b->timeout_ms;
+    return 0;
+}
+
+/* A connect attempt finished: keep the first one that succeeded, drop the
+   others and send the HELLO, if any. Returns 1 while attempts are still
+   running, -1 once all of them failed. */
+static int branch_connected(int epfd, struct branch_conn *b, const char *hello, long long now) {
+    struct pollfd p[DNS_MAX_ADDRS + 1];
+    int n = 0, running = 0, winner = -1;
+    p[n++] = (struct pollfd){ .fd = b->fd, .events = POLLOUT };
+    for (int i = 0; i < b->nalt; i++) p[n++] = (struct pollfd){ .fd = b->alt_fd[i], .events = POLLOUT };
+    if (poll(p, n, 0) < 0) return 1;
+    for (int i = 0; i < n; i++) {
+        if (!p[i].revents) {
+            p[running++].fd = p[i].fd;
+            continue;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (winner < 0 && getsockopt(p[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+            winner = p[i].fd;
+        else
+            drop_fd(epfd, p[i].fd);
+    }
+    if (winner < 0) {
+        b->fd = running > 0 ? p[0].fd : -1;
+        b->nalt = running > 0 ? running - 1 : 0;
+        for (int i = 1; i < running; i++) b->alt_fd[i - 1] = p[i].fd;
+        if (running == 0 && branch_try_next(epfd, b, now) < 0) {
+            stat_add(&metrics.connect_failures, 1);
+            return -1;
+        }
+        return 1;
+    }
+    for (int i = 0; i < running; i++) drop_fd(epfd, p[i].fd);
+    b->fd = winner;
+    b->nalt = 0;
+    b->next_try_ms = -1;
+    hist_record(&metrics.connect_us, now_us() - b->connect_us);
+    b->connecting = 0;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = b };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, b->fd, &ev);
+    if (hello && !b->no_hello) {
+        b->hello_sent = 1;
+        if (robust_send(b->fd, hello, strlen(hello)) < 0) return -1;
+        stat_add(&metrics.bytes_out, strlen(hello));
+    }
+    return 0;
+}
+
+/* Find the next complete reply (text or binary) at the start of b's buffer.
+   Returns its length, 0 if more input is needed, -1 if it is longer than
+   MAX_REPLY. The reply is left in place, NUL-terminated, for frame_done(). */
+static ssize_t next_frame(struct branch_conn *b, char **frame) {
+    char *data = rx_data(b);
+    size_t flen;
+    *frame = data;
+    if (b->len > 0 && (unsigned char)data[0] == FRAME_MAGIC) {
+        if (b->len < FRAME_HDR_SZ) return 0;
+        flen = FRAME_HDR_SZ + (size_t)get_be((const unsigned char *)data + 4, 4);
+        if (flen > MAX_REPLY) return -1;
+        if (b->len < flen) return 0;
+    } else {
+        data[b->len] = '\0';
+        char *end = NULL;
+        if (b->len >= 4 && strncmp(data, "END\n", 4) == 0) {
+            end = data;
+        } else {
+            char *p = strstr(data, "\nEND\n");
+            if (p) end = p + 1;
+        }
+        if (!end) return b->len >= MAX_REPLY ? -1 : 0;
+        flen = (size_t)(end + 4 - data);
+    }
+    b->saved = data[flen];
+    data[flen] = '\0';
+    return (ssize_t)flen;
+}
+
+/* Drop the reply next_frame() returned */
+static void frame_done(struct branch_conn *b, size_t flen) {
+    char *data = rx_data(b);
+    data[flen] = b->saved;
+    memmove(data, data + flen, b->len - flen);
+    b->len -= flen;
+    rx_shrink(b);
+}
+
+/* A compressed frame becomes the plain one it stands for, inflated into
+   arena a (NUL-terminated, like next_frame() leaves a reply); others are
+   left alone. -1 if it is corrupt, inflates past MAX_REPLY, or uses a codec
+   not built in. */
+static int frame_unpack(struct arena *a, const char **frame, size_t *flen) {
+    const unsigned char *f = (const unsigned char *)*frame;
+    if (f[0] != FRAME_MAGIC || get_be(f + 2, 2) == 0) return 0;
+    if (*flen < FRAME_HDR_SZ + 4) return -1;
+    unsigned long long flags = get_be(f + 2, 2), ulen = get_be(f + FRAME_HDR_SZ, 4);
+    const unsigned char *src = f + FRAME_HDR_SZ + 4;
+    size_t clen = *flen - FRAME_HDR_SZ - 4, n = 0;
+    unsigned char *out = ulen <= MAX_REPLY ? arena_alloc(a, FRAME_HDR_SZ + ulen + 1) : NULL;
+    if (!out) return -1;
+#ifdef HAVE_ZSTD
+    if (flags == FRAME_F_ZSTD) {
+        n = ZSTD_decompress(out + FRAME_HDR_SZ, ulen, src, clen);
+        if (ZSTD_isError(n)) return -1;
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (flags == FRAME_F_LZ4) {
+        int r = LZ4_decompress_safe((const char *)src, (char *)out + FRAME_HDR_SZ, (int)clen, (int)ulen);
+        if (r < 0) return -1;
+        n = (size_t)r;
+    }
+#endif
+    (void)flags;
+    (void)src;
+    (void)clen;     /* without a codec built in */
+    if (n != ulen || ulen == 0) return -1;
+    out[0] = FRAME_MAGIC;
+    out[1] = f[1];
+    put_be(out + 2, 0, 2);
+    put_be(out + 4, ulen, 4);
+    out[FRAME_HDR_SZ + ulen] = '\0';
+    *frame = (const char *)out;
+    *flen = FRAME_HDR_SZ + ulen;
+    return 0;
+}
+
+/* base is a request line ending in '\n'; address it to b's branch */
+static const char *branch_line(const struct branch_conn *b, const char *base, char *buf, size_t n) {
+    if (!b->route) return base;
+    snprintf(buf, n, "%.*s BRANCH %s\n", (int)strcspn(base, "\n"), base, b->route);
+    return buf;
+}
+
+/* ---- adaptive deadlines ----
+   Every branch keeps a smoothed mean and deviation of its reply latency (as
+   TCP does for its retransmission timeout) and its p95 over the last
+   LAT_WINDOW replies. A round waits for a branch only as long as that
+   history says it should; once a branch is past its wait the round is
+   committed without it, and its reply, if it comes before --timeout, goes
+   into the next commit. */
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* How long a round waits for b: mean plus four deviations, but at least twice
+   the p95, capped by the branch timeout (also the wait until there is
+   LAT_MIN replies' worth of history) */
+static long long branch_wait_ms(const struct branch_conn *b) {
+    if (b->lat_n < LAT_MIN) return b->timeout_ms;
+    long long us = b->srtt_us + 4 * b->rttvar_us;
+    if (us < 2 * b->p95_us) us = 2 * b->p95_us;
+    long long ms = (us + 999) / 1000;
+    if (ms < WAIT_FLOOR_MS) ms = WAIT_FLOOR_MS;
+    return ms < b->timeout_ms ? ms : b->timeout_ms;
+}
+
+/* Fold one reply latency into b's history (gains 1/8 and 1/4, RFC 6298) */
+static void branch_latency(struct branch_conn *b, long long lat) {
+    if (b->lat_n == 0) {
+        b->srtt_us = lat;
+        b->rttvar_us = lat / 2;
+    } else {
+        long long err = lat - b->srtt_us;
+        b->srtt_us += err / 8;
+        b->rttvar_us += ((err < 0 ? -err : err) - b->rttvar_us) / 4;
+    }
+    b->lat_us[b->lat_next] = lat;
+    b->lat_next = (b->lat_next + 1) % LAT_WINDOW;
+    if (b->lat_n < LAT_WINDOW) b->lat_n++;
+    if (b->lat_n >= LAT_MIN) {
+        long long v[LAT_WINDOW];
+        memcpy(v, b->lat_us, (size_t)b->lat_n * sizeof(*v));
+        qsort(v, (size_t)b->lat_n, sizeof(*v), cmp_ll);
+        b->p95_us = v[(b->lat_n * 95 - 1) / 100];
+    }
+    hist_record(&metrics.reply_us, lat);
+    state_add_reply(b->state, lat, b->p95_us, branch_wait_ms(b));
+}
+
+/* The rounds b counts as done: once its oldest outstanding request is past
+   its wait, also every round whose own wait has run out (with --interval);
+   folds the next such moment into *wake */
+static int branch_done(const struct branch_conn *b, long long start, int interval_ms, long long now,
+                       long long *wake) {
+    if (b->sent == b->received) return b->received;
+    long long wait = branch_wait_ms(b);
+    long long until = b->sent_us[b->received % PIPE_RING] / 1000 + wait;
+    int done = b->received;
+    if (now >= until) {
+        done++;
+        if (interval_ms > 0) {
+            long long t = now - wait - start - b->offset_ms;
+            int due = t < 0 ? 0 : (int)(t / interval_ms + 1);
+            if (due > done) done = due;
+            until = start + b->offset_ms + (long long)done * interval_ms + wait;
+        }
+    }
+    if (now < until && (*wake < 0 || until < *wake)) *wake = until;
+    return done;
+}
+
+static void queue_row(struct persister *ps, struct csv_batch *batch, const char *branch_id,
+                      long long records, long long units) {
+    char amt[32];
+    format_units(amt, sizeof(amt), units);
+    printf("Received from %s: records=%lld subtotal=%s\n", branch_id, records, amt);
+    if (batch ? batch_add(batch, branch_id, records, units) != 0
+              : persist_row(ps, branch_id, records, units) != 0)
+        fprintf(stderr, "Failed to queue row for branch %s\n", branch_id);
+}
+
+/* The per-branch part of a REQUEST ALL reply (text "BRANCH: <id> <records>
+   <subtotal>" lines, or FRAME_BRANCHES): one row for each branch the host
+   could read. Returns the number of branches, -1 if malformed. */
+static int queue_hosted(const char *frame, size_t flen, struct persister *ps,
+                        struct csv_batch *batch) {
+    char id[64];
+    long long records, units;
+    int n = 0;
+    if ((unsigned char)frame[0] == FRAME_MAGIC) {
+        const unsigned char *p = (const unsigned char *)frame + FRAME_HDR_SZ;
+        const unsigned char *end = (const unsigned char *)frame + flen;
+        p += 1 + p[0] + 16;
+        unsigned long long count = get_be(p, 4);
+        for (p += 4; count > 0; count--, n++) {
+            if (p >= end || p + 1 + p[0] + 17 > end || p[0] >= sizeof(id)) return -1;
+            memcpy(id, p + 1, p[0]);
+            id[p[0]] = '\0';
+            p += 1 + p[0];
+            records = (long long)get_be(p + 1, 8);
+            units = (long long)get_be(p + 9, 8);
+            if (p[0]) queue_row(ps, batch, id, records, units);
+            p += 17;
+        }
+        return p == end ? n : -1;
+    }
+    for (const char *p = strstr(frame, "\nBRANCH: "); p; p = strstr(p + 1, "\nBRANCH: "), n++) {
+        int used = 0;
+        if (sscanf(p + 9, "%63s%n", id, &used) != 1 || p[9 + used] != ' ') return -1;
+        used++;
+        if (strncmp(p + 9 + used, "ERROR", 5) == 0) continue;
+        if (sscanf(p + 9 + used, "%lld", &records) != 1) return -1;
+        const char *amt = strchr(p + 9 + used, ' ');
+        if (!amt || parse_units(amt, &units) != 0) return -1;
+        queue_row(ps, batch, id, records, units);
+    }
+    return n;
+}
+
+/* Process one reply; rows are appended to 'batch' in append mode (non-NULL)
+   and queued for update_main_csv() otherwise */
+static void handle_frame(struct branch_conn *b, const char *frame, size_t flen,
+                         struct persister *ps, struct csv_batch *batch, int delta) {
+    int binary = (unsigned char)frame[0] == FRAME_MAGIC;
+    if (!binary && strncmp(frame, "HELLO", 5) == 0) {
+        b->hello_acked = 1;
+        b->keepalive = strstr(frame, "KEEPALIVE") != NULL;
+        return;
+    }
+    /* pushed updates (--subscribe) answer no request of ours */
+    if (b->received < b->sent) branch_latency(b, now_us() - b->sent_us[b->received % PIPE_RING]);
+    b->received++;
+    __atomic_store_n(&b->down, 0, __ATOMIC_RELAXED);
+    b->conn_replies++;
+    char branch_id[64];
+    long long records = 0, units = 0;
+    int rc;
+    if (delta) {
+        /* fold the reply into our copy of the branch totals; quiet branches
+           cost one short reply and add no row */
+        unsigned long long seq;
+        int kind;
+        long long dr, du;
+        rc = parse_delta(frame, flen, branch_id, sizeof(branch_id), &seq, &kind, &dr, &du);
+        if (rc == 0) {
+            b->seq = seq;
+            if (kind == DELTA_UNCHANGED) {
+                printf("No change from %s\n", branch_id);
+                return;
+            }
+            if (kind == DELTA_FULL) b->tot_records = b->tot_units = 0;
+            b->tot_records += dr;
+            b->tot_units += du;
+            records = b->tot_records;
+            units = b->tot_units;
+        }
+    } else if (binary) {
+        rc = parse_frame((const unsigned char *)frame, flen, branch_id, sizeof(branch_id),
+                         &records, &units);
+    } else {
+        rc = parse_reply(frame, branch_id, sizeof(branch_id), &records, &units);
+    }
+    /* a multi-branch host answers a plain REQUEST for all its branches:
+       keep one row per branch rather than the host's sum */
+    int hosted = !delta && (binary ? frame[1] == FRAME_BRANCHES : strstr(frame, "\nBRANCH: ") != NULL);
+    if (rc == 0 && hosted) {
+        state_set_totals(b->state, records, units);
+        if (queue_hosted(frame, flen, ps, batch) < 0)
+            fprintf(stderr, "Malformed branch list from %s:%s\n", b->host, b->port);
+    } else if (rc == 0) {
+        state_set_totals(b->state, records, units);
+        queue_row(ps, batch, branch_id, records, units);
+    } else if (binary && flen >= FRAME_HDR_SZ && frame[1] == FRAME_ERROR) {
+        fprintf(stderr, "Error from %s:%s: %.*s\n", b->host, b->port,
+                (int)(flen - FRAME_HDR_SZ), frame + FRAME_HDR_SZ);
+    } else {
+        fprintf(stderr, "Malformed reply from %s:%s: [%s]\n", b->host, b->port,
+                binary ? "binary" : frame);
+    }
+}
+
+/* The connection closed or failed: requests still unanswered on it are sent
+   again on a fresh connection, unless it made no progress at all */
+static void branch_lost(int epfd, struct branch_conn *b) {
+    int progressed = b->conn_replies > 0;
+    int rejected_hello = b->hello_sent && !b->hello_acked && !progressed;
+    int idle = b->sent == b->received;     /* a warm connection went stale */
+    branch_close(epfd, b);
+    b->sent = b->received;
+    if (rejected_hello) b->no_hello = 1;
+    else if (!progressed && !idle) b->failed = 1;
+}
+
+/* ---- hedged requests ----
+   A branch listed with replicas (+<host>:<port> in the branch file) sends a
+   request that is still unanswered at its p95 to the next replica as well.
+   Whichever answers first is taken; when the replica wins, the branch's own
+   connection is dropped with its copy still in flight, and a late answer
+   from the replica is skipped. Replicas connect on their first hedge and
+   are otherwise left alone: they never fail their branch. */
+
+static void branch_hedge(int epfd, struct branch_list *bl, struct branch_conn *b, long long now,
+                         long long *wake) {
+    if (b->replica < 0 || b->hedged >= 0 || b->sent == b->received || b->hedge_for == b->received ||
+        b->lat_n < LAT_MIN)
+        return;
+    long long at = (b->sent_us[b->received % PIPE_RING] + b->p95_us) / 1000 + 1;
+    if (now < at) {
+        if (*wake < 0 || at < *wake) *wake = at;
+        return;
+    }
+    struct branch_conn *r = &bl->v[b->replica];
+    b->replica = r->replica;    /* spread hedges over the replicas */
+    b->hedge_for = b->received;
+    if (r->fd < 0 && branch_open(epfd, r, now) < 0) return;
+    r->hedge_want = 1;
+    b->hedged = r->index;
+}
+
+/* A replica's turn in the main loop: send the hedge once connected, give up
+   on it at its timeout */
+static void replica_step(int epfd, struct branch_list *bl, struct branch_conn *r, const char *base,
+                         int delta, long long now, long long *wake) {
+    struct branch_conn *p = &bl->v[r->primary];
+    if (r->failed || (r->fd >= 0 && (r->connecting || r->sent > r->received) && now >= r->deadline_ms)) {
+        branch_close(epfd, r);
+        r->failed = r->hedge_want = 0;
+        r->sent = r->received;
+        if (p->hedged == r->index) p->hedged = -1;
+        return;
+    }
+    branch_stagger(epfd, r, now, wake);
+    if (r->hedge_want && r->fd >= 0 && !r->connecting) {
+        r->hedge_want = 0;
+        if (p->hedged != r->index) return;
+        char req[64], line[384];
+        if (delta) snprintf(req, sizeof(req), "REQUEST SINCE %llu\n", p->seq);
+        const char *msg = branch_line(r, delta ? req : base, line, sizeof(line));
+        if (robust_send(r->fd, msg, strlen(msg)) < 0) {
+            branch_lost(epfd, r);
+            p->hedged = -1;
+            return;
+        }
+        stat_add(&metrics.bytes_out, strlen(msg));
+        stat_add(&metrics.hedges, 1);
+        if (r->sent == r->received) r->deadline_ms = now + r->timeout_ms;
+        r->hedge_seq = r->sent++;
+    }
+    if (r->fd >= 0 && (r->connecting || r->sent > r->received) && (*wake < 0 || r->deadline_ms < *wake))
+        *wake = r->deadline_ms;
+}
+
+/* A reply arrived on b's connection; a replica's is credited to its branch
+   if it answers the live hedge */
+static void branch_reply(int epfd, struct branch_list *bl, struct branch_conn *b, const char *frame,
+                         size_t flen, struct persister *ps, struct csv_batch *batch, int delta) {
+    int hello = (unsigned char)frame[0] != FRAME_MAGIC && strncmp(frame, "HELLO", 5) == 0;
+    if (hello || b->primary < 0) {
+        handle_frame(b, frame, flen, ps, batch, delta);
+        if (!hello) b->hedged = -1;     /* beat its hedge, if any */
+        return;
+    }
+    struct branch_conn *p = &bl->v[b->primary];
+    int seq = b->received++;
+    b->conn_replies++;
+    if (p->hedged != b->index || seq != b->hedge_seq) return;
+    p->hedged = -1;
+    stat_add(&metrics.hedge_wins, 1);
+    handle_frame(p, frame, flen, ps, batch, delta);
+    branch_close(epfd, p);
+    p->sent = p->received;
+    __atomic_store_n(&p->failed, 0, __ATOMIC_RELAXED);
+}
+
+/* ---- shared-memory branches ----
+   A branch server started with --shm NAME keeps its branches' latest totals
+   in the shared memory segment NAME. A branch listed as host shm:NAME (the
+   port is ignored; branch_id picks the slot of a multi-branch host) is read
+   from there: each round is answered the moment it is due, by a seqlock
+   read with no system call. The layout matches the server's. */
+#define SHM_MAGIC "BSSHM001"
+#define SHM_TRIES 1000      /* a torn read is retried; a writer that died mid-update is not waited for */
+#define SHM_POLL_MS 50      /* --subscribe: how often a segment is looked at */
+
+struct shm_hdr {
+    _Alignas(64) char magic[8];
+    uint32_t nslots;
+    uint32_t slot_size;
+};
+
+struct shm_slot {
+    _Alignas(64) uint64_t ver;
+    uint64_t seq;
+    int64_t records, units;
+    int64_t updated_ns;
+    char id[64];
+};
+
+struct shm_seg {
+    struct shm_seg *next;
+    char *name;
+    const struct shm_hdr *hdr;
+    size_t len;
+};
+
+static struct shm_seg *shm_segs;
+
+/* Map the segment 'name' (again, if it has grown past the mapping); an
+   outgrown mapping is left in place for the branches still reading it */
+static struct shm_seg *shm_map(const char *name) {
+    struct shm_seg *g = shm_segs;
+    while (g && strcmp(g->name, name) != 0) g = g->next;
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shm_hdr)) {
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    if (g && g->len >= (size_t)st.st_size) {
+        close(fd);
+        return g;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    if (!g) {
+        g = calloc(1, sizeof(*g));
+        if (!g || !(g->name = strdup(name))) {
+            free(g);
+            munmap(p, (size_t)st.st_size);
+            return NULL;
+        }
+        g->next = shm_segs;
+        shm_segs = g;
+    }
+    g->hdr = p;
+    g->len = (size_t)st.st_size;
+    return g;
+}
+
+static const struct shm_slot *shm_slots(const struct shm_seg *g) {
+    return (const struct shm_slot *)(g->hdr + 1);
+}
+
+/* Whether b's slot is still the one of its branch */
+static int shm_valid(const struct branch_conn *b) {
+    const struct shm_seg *g = b->shm;
+    if (!g || b->shm_slot < 0) return 0;
+    const struct shm_hdr *h = g->hdr;
+    if (memcmp((const char *)h->magic, SHM_MAGIC, 8) != 0 || h->slot_size != sizeof(struct shm_slot) ||
+        (uint32_t)b->shm_slot >= h->nslots ||
+        sizeof(*h) + ((size_t)b->shm_slot + 1) * sizeof(struct shm_slot) > g->len)
+        return 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    const char *id = shm_slots(g)[b->shm_slot].id;
+    return b->route ? strncmp(id, b->route, 64) == 0 : h->nslots == 1;
+}
+
+/* (Re)find b's slot: the one named by its branch_id, or the only one */
+static int shm_attach(struct branch_conn *b) {
+    if (shm_valid(b)) return 0;
+    b->shm = shm_map(b->host + 4);
+    b->shm_slot = -1;
+    if (!b->shm || memcmp((const char *)b->shm->hdr->magic, SHM_MAGIC, 8) != 0) return -1;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t n = b->shm->hdr->nslots;
+    if (sizeof(struct shm_hdr) + (size_t)n * sizeof(struct shm_slot) > b->shm->len) return -1;
+    for (uint32_t i = 0; i < n && b->shm_slot < 0; i++)
+        if (b->route ? strncmp(shm_slots(b->shm)[i].id, b->route, 64) == 0 : n == 1) b->shm_slot = (int)i;
+    return shm_valid(b) ? 0 : -1;
+}
+
+static int shm_read(const struct shm_slot *s, struct shm_slot *out) {
+    for (int i = 0; i < SHM_TRIES; i++) {
+        uint64_t v = __atomic_load_n(&s->ver, __ATOMIC_ACQUIRE);
+        if (v & 1) continue;
+        out->seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+        out->records = __atomic_load_n(&s->records, __ATOMIC_RELAXED);
+        out->units = __atomic_load_n(&s->units, __ATOMIC_RELAXED);
+        out->updated_ns = __atomic_load_n(&s->updated_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->ver, __ATOMIC_RELAXED) == v) {
+            out->ver = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* The branch's current totals from its slot; -1 if there are none (yet) */
+static int shm_totals(struct branch_conn *b, struct shm_slot *out) {
+    if (shm_attach(b) != 0) return -1;
+    const struct shm_slot *s = &shm_slots(b->shm)[b->shm_slot];
+    if (shm_read(s, out) != 0 || out->ver == 0) return -1;
+    memcpy(out->id, s->id, sizeof(out->id));
+    out->id[sizeof(out->id) - 1] = '\0';
+    return 0;
+}
+
+static void shm_row(struct branch_conn *b, const struct shm_slot *t, struct persister *ps,
+                    struct csv_batch *batch) {
+    b->seq = t->seq;
+    b->tot_records = t->records;
+    b->tot_units = t->units;
+    state_set_totals(b->state, t->records, t->units);
+    queue_row(ps, batch, t->id, t->records, t->units);
+}
+
+/* A shm: branch's turn in the main loop: every round due is answered from
+   the segment at once (with --delta, an unchanged slot adds no row); with
+   --subscribe, the slot is looked at every SHM_POLL_MS and adds a row
+   whenever it changed */
+static void shm_step(struct branch_conn *b, int rounds, long long start, int interval_ms, int subscribe,
+                     int delta, long long now, long long *wake, struct persister *ps,
+                     struct csv_batch *batch) {
+    struct shm_slot t;
+    while (subscribe || b->received < rounds) {
+        long long due = start + b->offset_ms + (long long)b->received * interval_ms;
+        if (subscribe) due = now;
+        if (due > now) {
+            if (*wake < 0 || due < *wake) *wake = due;
+            return;
+        }
+        long long t0 = now_us();
+        if (shm_totals(b, &t) != 0) {
+            fprintf(stderr, "No shared totals for branch%d %s %s\n", b->index + 1, b->host,
+                    b->route ? b->route : "");
+            b->failed = 1;
+            return;
+        }
+        if (subscribe) {
+            if (*wake < 0 || now + SHM_POLL_MS < *wake) *wake = now + SHM_POLL_MS;
+            if (t.seq != b->seq) shm_row(b, &t, ps, batch);
+            return;
+        }
+        branch_latency(b, now_us() - t0);
+        b->sent = ++b->received;
+        __atomic_store_n(&b->down, 0, __ATOMIC_RELAXED);
+        if (delta && t.seq == b->seq) printf("No change from %s\n", t.id);
+        else shm_row(b, &t, ps, batch);
+    }
+}
+
+/* ---- io_uring ----
+   A minimal ring over the raw system calls (no liburing). One thread owns
+   it; there is no SQ polling, so the kernel reads SQEs only inside
+   io_uring_enter() and an SQE may be filled in after uring_sqe() returns.
+   Without <linux/io_uring.h>, or on a kernel that refuses io_uring_setup(),
+   uring_init() fails and callers keep to plain system calls. */
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+#ifdef HAVE_IO_URING
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+    void *sq_ring, *cq_ring, *sqe_mem;
+    size_t sq_len, cq_len, sqe_len;
+    unsigned queued;        /* SQEs filled in since the last uring_submit() */
+};
+
+static void uring_free(struct uring *u) {
+    if (u->sq_ring && u->sq_ring != MAP_FAILED) munmap(u->sq_ring, u->sq_len);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED) munmap(u->cq_ring, u->cq_len);
+    if (u->sqe_mem && u->sqe_mem != MAP_FAILED) munmap(u->sqe_mem, u->sqe_len);
+    if (u->fd >= 0) close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+static int uring_init(struct uring *u, unsigned entries) {
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+#ifdef HAVE_IO_URING
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    u->entries = p.sq_entries;
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_CQ_RING);
+    u->sqe_mem = mmap(NULL, u->sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQES);
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqe_mem == MAP_FAILED) {
+        uring_free(u);
+        return -1;
+    }
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->sqes = u->sqe_mem;
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+#else
+    (void)entries;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/* The next SQE, zeroed, or NULL if the submission ring is full */
+static struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) return NULL;
+    unsigned i = tail & *u->sq_mask;
+    memset(&u->sqes[i], 0, sizeof(u->sqes[i]));
+    u->sq_array[i] = i;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return &u->sqes[i];
+}
+
+/* Submit the queued SQEs and wait for wait_nr completions */
+static int uring_submit(struct uring *u, unsigned wait_nr) {
+    unsigned n = u->queued;
+    u->queued = 0;
+    for (;;) {
+        long r = syscall(__NR_io_uring_enter, u->fd, n, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+                         NULL, 0);
+        if (r >= 0) return 0;
+        if (errno != EINTR) return -1;
+        n = 0;      /* an interrupted wait has submitted them already */
+    }
+}
+
+/* Take the next completion: 1 and *cqe, or 0 if there is none */
+static int uring_reap(struct uring *u, struct io_uring_cqe *cqe) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *cqe = u->cqes[head & *u->cq_mask];
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+#endif
+
+/* ---- io_uring networking ----
+   With --io-uring the main loop still waits in epoll_wait(), but moves the
+   bytes through one ring: the REQUESTs due across all branches go out as a
+   SENDMSG each, submitted together after the fan-out, and every branch that
+   epoll reports readable gets a RECV, again submitted together before the
+   replies are parsed. A round then costs one io_uring_enter() each way
+   instead of a system call per branch. Connects stay non-blocking connect()s,
+   raced as before. */
+
+#define NET_RX 1    /* low bit of user_data: a RECV, else a SENDMSG */
+
+struct net_ring {
+    struct uring u;
+    int on;                 /* --io-uring, and the ring is set up */
+    unsigned inflight;
+};
+
+#ifdef HAVE_IO_URING
+/* A SENDMSG completed: a full socket buffer is finished off with a plain
+   write, as before */
+static void tx_done(int epfd, struct branch_conn *b, int res) {
+    struct iovec *iov = b->tx_iov;
+    int n = b->tx_n;
+    if (n == 0) return;     /* the connection went meanwhile */
+    b->tx_n = 0;
+    if (res < 0 && res != -EAGAIN) {
+        branch_lost(epfd, b);
+        return;
+    }
+    size_t done = res > 0 ? (size_t)res : 0;
+    stat_add(&metrics.bytes_out, done);
+    while (n > 0 && done >= iov->iov_len) {
+        done -= iov->iov_len;
+        iov++;
+        n--;
+    }
+    if (n == 0) return;
+    iov->iov_base = (char *)iov->iov_base + done;
+    iov->iov_len -= done;
+    ssize_t w = robust_writev(b->fd, iov, n);
+    if (w < 0) branch_lost(epfd, b);
+    else stat_add(&metrics.bytes_out, (uint64_t)w);
+}
+#endif
+
+/* Submit what is queued and wait for all of it to complete */
+static int net_wait(int epfd, struct net_ring *nr) {
+#ifdef HAVE_IO_URING
+    struct io_uring_cqe cqe;
+    if (nr->inflight > 0 && uring_submit(&nr->u, nr->inflight) != 0) return -1;
+    while (nr->inflight > 0) {
+        if (!uring_reap(&nr->u, &cqe)) {
+            if (uring_submit(&nr->u, nr->inflight) != 0) return -1;
+            continue;
+        }
+        nr->inflight--;
+        struct branch_conn *b = (struct branch_conn *)(uintptr_t)(cqe.user_data & ~(uint64_t)NET_RX);
+        if (!(cqe.user_data & NET_RX)) tx_done(epfd, b, cqe.res);
+        else if (b->rx_queued) b->rx_res = cqe.res;
+    }
+#else
+    (void)epfd; (void)nr;
+#endif
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+/* An SQE, making room by completing what is queued if the ring is full */
+static struct io_uring_sqe *net_sqe(int epfd, struct net_ring *nr) {
+    struct io_uring_sqe *sqe = uring_sqe(&nr->u);
+    if (!sqe && net_wait(epfd, nr) == 0) sqe = uring_sqe(&nr->u);
+    return sqe;
+}
+#endif
+
+/* Queue niov copies of line to b as one SENDMSG; -1: send it the plain way */
+static int tx_queue(int epfd, struct net_ring *nr, struct branch_conn *b, const char *line, int niov) {
+#ifdef HAVE_IO_URING
+    size_t len = strlen(line);
+    struct io_uring_sqe *sqe;
+    if (len >= sizeof(b->tx_line) || !(sqe = net_sqe(epfd, nr))) return -1;
+    memcpy(b->tx_line, line, len);
+    for (int i = 0; i < niov; i++) b->tx_iov[i] = (struct iovec){ b->tx_line, len };
+    b->tx_msg = (struct msghdr){ .msg_iov = b->tx_iov, .msg_iovlen = (size_t)niov };
+    b->tx_n = niov;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = b->fd;
+    sqe->addr = (uintptr_t)&b->tx_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = (uintptr_t)b;
+    nr->inflight++;
+    return 0;
+#else
+    (void)epfd; (void)nr; (void)b; (void)line; (void)niov;
+    return -1;
+#endif
+}
+
+/* Queue a RECV into b's buffer; -1: leave it to branch_recv() */
+static int rx_queue(int epfd, struct net_ring *nr, struct branch_conn *b, struct arena_pool *arenas) {
+#ifdef HAVE_IO_URING
+    ssize_t room = rx_room(b, arenas);
+    struct io_uring_sqe *sqe;
+    if (room <= 0 || !(sqe = net_sqe(epfd, nr))) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = b->fd;
+    sqe->addr = (uintptr_t)(rx_data(b) + b->len);
+    sqe->len = (unsigned)room;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->user_data = (uintptr_t)b | NET_RX;
+    b->rx_queued = 1;
+    nr->inflight++;
+    return 0;
+#else
+    (void)epfd; (void)nr; (void)b; (void)arenas;
+    return -1;
+#endif
+}
+
+/* The outcome of b's queued RECV, as branch_recv() would have reported it */
+static ssize_t rx_take(struct branch_conn *b) {
+    b->rx_queued = 0;
+    if (b->rx_res < 0) {
+        errno = -b->rx_res;
+        return -1;
+    }
+    rx_got(b, b->rx_res);
+    return b->rx_res;
+}
+
+/* ---- daemon mode ----
+   --daemon runs a round every --interval MS until SIGTERM or SIGINT, over
+   connections kept warm from one round to the next, with one append per
+   round. Every branch has a fixed slot in the round (a hash of its address
+   spread over --jitter MS), so the fan-out does not land all at once, and
+   a branch that fails a round is tried again at its next slot. SIGHUP
+   re-reads --branches FILE. */
+
+static void branch_slot(struct branch_conn *b, int jitter_ms) {
+    char key[384];
+    snprintf(key, sizeof(key), "%s %s %s", b->host, b->port, b->route ? b->route : "");
+    b->offset_ms = jitter_ms > 0 ? str_hash(key) % (unsigned)jitter_ms : 0;
+}
+
+/* The first round whose slot for b is still ahead */
+static int next_round(const struct branch_conn *b, long long start, int interval_ms, long long now) {
+    long long t = now - start - b->offset_ms;
+    return t < 0 ? 0 : (int)(t / interval_ms + 1);
+}
+
+/* The branch moved in memory: point its epoll registrations at it again */
+static void branch_rebind(int epfd, struct branch_conn *b) {
+    struct epoll_event ev = { .events = b->connecting ? EPOLLOUT | EPOLLIN : EPOLLIN, .data.ptr = b };
+    if (b->fd >= 0) epoll_ctl(epfd, EPOLL_CTL_MOD, b->fd, &ev);
+    for (int i = 0; i < b->nalt; i++) epoll_ctl(epfd, EPOLL_CTL_MOD, b->alt_fd[i], &ev);
+}
+
+static int same_branch(const struct branch_conn *a, const struct branch_conn *b) {
+    return strcmp(a->host, b->host) == 0 && strcmp(a->port, b->port) == 0 &&
+           (a->route ? b->route && strcmp(a->route, b->route) == 0 : !b->route);
+}
+
+/* SIGHUP: re-read the branch file. The first nfixed branches (from the
+   command line) stay; listed ones keep their connection, totals and slot;
+   new ones start at their next slot and dropped ones are closed. On error
+   the old list stays in place. */
+static int reload_branches(int epfd, struct branch_list *bl, struct branch_state **states,
+                           int nfixed, const char *path, int timeout_ms, int jitter_ms,
+                           long long start, int interval_ms, struct persister *ps) {
+    struct branch_list fresh = { NULL, 0, 0 };
+    int n = -1;
+    struct branch_conn *v = NULL;
+    struct branch_state *st = NULL;
+    if (load_branches(path, &fresh, timeout_ms) == 0) {
+        n = nfixed + fresh.n;
+        v = malloc((size_t)(n > 0 ? n : 1) * sizeof(*v));
+        st = aligned_alloc(64, (size_t)(n > 0 ? n : 1) * sizeof(*st));
+    }
+    /* the persistence thread reads the list when it writes the metrics */
+    if (!v || !st || persist_fence(ps) != 0) {
+        for (int i = 0; i < fresh.n; i++) {
+            free(fresh.v[i].host);
+            free(fresh.v[i].port);
+            free(fresh.v[i].route);
+        }
+        free(fresh.v);
+        free(v);
+        free(st);
+        return -1;
+    }
+    memcpy(v, bl->v, (size_t)nfixed * sizeof(*v));
+    int added = 0, dropped = 0;
+    long long now = now_ms();
+    for (int i = 0; i < fresh.n; i++) {
+        struct branch_conn *f = &fresh.v[i], *b = &v[nfixed + i], *old = NULL;
+        for (int j = nfixed; j < bl->n && !old; j++) {
+            if (bl->v[j].host && same_branch(&bl->v[j], f)) old = &bl->v[j];
+        }
+        if (old) {
+            *b = *old;
+            b->timeout_ms = f->timeout_ms;
+            old->host = NULL;
+            free(f->host);
+            free(f->port);
+            free(f->route);
+        } else {
+            *b = *f;
+            branch_slot(b, jitter_ms);
+            b->sent = b->received = next_round(b, start, interval_ms, now);
+            added++;
+        }
+    }
+    for (int j = nfixed; j < bl->n; j++) {
+        struct branch_conn *o = &bl->v[j];
+        if (!o->host) continue;
+        printf("Dropped branch %s:%s\n", o->host, o->port);
+        branch_close(epfd, o);
+        o->len = 0;
+        rx_shrink(o);
+        free(o->host);
+        free(o->port);
+        free(o->route);
+        dropped++;
+    }
+    /* replica links come from the file, shifted past the fixed branches */
+    for (int i = 0; i < fresh.n; i++) {
+        struct branch_conn *b = &v[nfixed + i];
+        b->replica = fresh.v[i].replica >= 0 ? fresh.v[i].replica + nfixed : -1;
+        b->primary = fresh.v[i].primary >= 0 ? fresh.v[i].primary + nfixed : -1;
+        b->hedged = -1;
+        b->hedge_want = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (v[i].state) st[i] = *v[i].state;
+        else memset(&st[i], 0, sizeof(st[i]));
+        v[i].state = &st[i];
+        v[i].index = i;
+        branch_rebind(epfd, &v[i]);
+    }
+    free(fresh.v);
+    free(bl->v);
+    free(*states);
+    bl->v = v;
+    bl->n = bl->cap = n;
+    *states = st;
+    printf("Reloaded %s: %d branches (%d new, %d dropped)\n", path, n, added, dropped);
+    return 0;
+}
+
+static void metrics_hist_prom(FILE *f, const char *name, const struct histogram *h) {
+    fprintf(f, "# TYPE %s histogram\n", name);
+    uint64_t cum = 0;
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        cum += h->bucket[i];
+        fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ull << i) / 1e6,
+                (unsigned long long)cum);
+    }
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+    fprintf(f, "%s_sum %.6f\n%s_count %llu\n", name, h->sum_us / 1e6, name,
+            (unsigned long long)h->count);
+}
+
+/* Dump the metrics in the Prometheus text format (for a textfile collector),
+   replacing path atomically. They are formatted into a memory stream and a
+   snapshot table kept from one call to the next, so once those have grown
+   to size a dump allocates nothing. Not reentrant. */
+static int write_metrics(const char *path, const struct branch_list *bl) {
+    static FILE *f;
+    static char *mem;
+    static size_t memlen;
+    static struct branch_state *st;
+    static int st_n;
+    if (!f && !(f = open_memstream(&mem, &memlen))) { perror("open_memstream"); return -1; }
+    if (st_n < bl->n) {
+        free(st);
+        st_n = 0;
+        st = aligned_alloc(64, (size_t)bl->n * sizeof(*st));
+        if (!st) return -1;
+        st_n = bl->n;
+    }
+    rewind(f);
+    fprintf(f, "# TYPE aggregator_connect_failures_total counter\n"
+               "aggregator_connect_failures_total %llu\n"
+               "# TYPE aggregator_timeouts_total counter\n"
+               "aggregator_timeouts_total %llu\n"
+               "# TYPE aggregator_received_bytes_total counter\n"
+               "aggregator_received_bytes_total %llu\n"
+               "# TYPE aggregator_sent_bytes_total counter\n"
+               "aggregator_sent_bytes_total %llu\n"
+               "# TYPE aggregator_dns_cache_hits_total counter\n"
+               "aggregator_dns_cache_hits_total %llu\n"
+               "# TYPE aggregator_dns_lookups_total counter\n"
+               "aggregator_dns_lookups_total %llu\n"
+               "# TYPE aggregator_hedged_requests_total counter\n"
+               "aggregator_hedged_requests_total %llu\n"
+               "# TYPE aggregator_hedge_wins_total counter\n"
+               "aggregator_hedge_wins_total %llu\n"
+               "# TYPE aggregator_late_branches_total counter\n"
+               "aggregator_late_branches_total %llu\n"
+               "# TYPE aggregator_query_cache_hits_total counter\n"
+               "aggregator_query_cache_hits_total %llu\n"
+               "# TYPE aggregator_query_cache_misses_total counter\n"
+               "aggregator_query_cache_misses_total %llu\n"
+               "# TYPE aggregator_query_cache_revalidations_total counter\n"
+               "aggregator_query_cache_revalidations_total %llu\n",
+            (unsigned long long)metrics.connect_failures, (unsigned long long)metrics.timeouts,
+            (unsigned long long)metrics.bytes_in, (unsigned long long)metrics.bytes_out,
+            (unsigned long long)metrics.dns_hits, (unsigned long long)metrics.dns_lookups,
+            (unsigned long long)metrics.hedges, (unsigned long long)metrics.hedge_wins,
+            (unsigned long long)metrics.late, (unsigned long long)metrics.cache_hits,
+            (unsigned long long)metrics.cache_misses, (unsigned long long)metrics.cache_revalidations);
+    metrics_hist_prom(f, "aggregator_resolve_seconds", &metrics.resolve_us);
+    metrics_hist_prom(f, "aggregator_connect_seconds", &metrics.connect_us);
+    metrics_hist_prom(f, "aggregator_reply_seconds", &metrics.reply_us);
+    metrics_hist_prom(f, "aggregator_epoll_wait_seconds", &metrics.wait_us);
+    metrics_hist_prom(f, "aggregator_csv_write_seconds", &metrics.write_us);
+    metrics_hist_prom(f, "aggregator_fsync_seconds", &metrics.fsync_us);
+    metrics_hist_prom(f, "aggregator_round_seconds", &metrics.round_us);
+    fprintf(f, "# TYPE aggregator_branch_up gauge\n");
+    for (int i = 0; i < bl->n; i++)
+        fprintf(f, "aggregator_branch_up{branch=\"%s:%s\"} %d\n", bl->v[i].host, bl->v[i].port,
+                !__atomic_load_n(&bl->v[i].failed, __ATOMIC_RELAXED) &&
+                !__atomic_load_n(&bl->v[i].down, __ATOMIC_RELAXED));
+    for (int i = 0; i < bl->n; i++) state_read(bl->v[i].state, &st[i]);
+    fprintf(f, "# TYPE aggregator_branch_reply_seconds summary\n");
+    for (int i = 0; i < bl->n; i++) {
+        const struct branch_conn *b = &bl->v[i];
+        fprintf(f, "aggregator_branch_reply_seconds_sum{branch=\"%s:%s\"} %.6f\n"
+                   "aggregator_branch_reply_seconds_count{branch=\"%s:%s\"} %lld\n",
+                b->host, b->port, st[i].reply_us / 1e6, b->host, b->port, st[i].replies);
+    }
+    fprintf(f, "# TYPE aggregator_branch_reply_max_seconds gauge\n");
+    for (int i = 0; i < bl->n; i++)
+        fprintf(f, "aggregator_branch_reply_max_seconds{branch=\"%s:%s\"} %.6f\n",
+                bl->v[i].host, bl->v[i].port, st[i].reply_max_us / 1e6);
+    fprintf(f, "# TYPE aggregator_branch_reply_p95_seconds gauge\n");
+    for (int i = 0; i < bl->n; i++)
+        fprintf(f, "aggregator_branch_reply_p95_seconds{branch=\"%s:%s\"} %.6f\n",
+                bl->v[i].host, bl->v[i].port, st[i].reply_p95_us / 1e6);
+    fprintf(f, "# TYPE aggregator_branch_wait_seconds gauge\n");
+    for (int i = 0; i < bl->n; i++)
+        fprintf(f, "aggregator_branch_wait_seconds{branch=\"%s:%s\"} %.3f\n",
+                bl->v[i].host, bl->v[i].port, st[i].wait_ms / 1e3);
+    fprintf(f, "# TYPE aggregator_branch_records gauge\n");
+    for (int i = 0; i < bl->n; i++)
+        fprintf(f, "aggregator_branch_records{branch=\"%s:%s\"} %lld\n",
+                bl->v[i].host, bl->v[i].port, st[i].records);
+    fprintf(f, "# TYPE aggregator_branch_subtotal gauge\n");
+    for (int i = 0; i < bl->n; i++) {
+        char amt[32];
+        format_units(amt, sizeof(amt), st[i].units);
+        fprintf(f, "aggregator_branch_subtotal{branch=\"%s:%s\"} %s\n",
+                bl->v[i].host, bl->v[i].port, amt);
+    }
+    long len = fflush(f) == 0 ? ftell(f) : -1;
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = len < 0 ? -1 : open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) { perror("open metrics"); return -1; }
+    int rc = write_all(fd, mem, (size_t)len, 0);
+    if (close(fd) != 0) rc = -1;
+    if (rc != 0 || rename(tmp, path) != 0) {
+        perror("write metrics");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* ---- tier mode (--serve PORT) ----
+   The aggregator answers REQUEST like a branch server, with the combined
+   totals of its children, so aggregators can be stacked into regional
+   tiers. Children are refreshed in parallel over one epoll set, one refresh
+   at a time, and answers are cached for --stale MS:
+   - a check asks every child REQUEST SINCE its last seq, which keeps the
+     plain totals current and bumps the tier's generation whenever a child
+     moved on (or did not answer);
+   - REQUEST FROM <date> TO <date> is cached by its words; an answer is good
+     while no check has seen a child change since it was computed, so once
+     its TTL is up one check (short UNCHANGED replies) revalidates it and
+     only a change costs a windowed fan-out;
+   - identical requests arriving while theirs is refreshed all wait for
+     that one refresh.
+   A child that fails or times out contributes its last known plain totals;
+   a windowed answer missing a child is sent as is but not cached. */
+
+#define MAX_EVENTS 256
+#define DAEMON_INTERVAL_MS 60000    /* --daemon without --interval */
+#define TIER_BACKLOG 1024
+#define TIER_IN_SZ 1024
+#define QCACHE_SLOTS 64             /* windowed queries cached at once */
+#define QUERY_KEY_SZ 64
+
+#define TIER_CHECK 1
+#define TIER_WINDOW 2
+
+struct tier_client {
+    int fd;
+    int keepalive, binary;  /* negotiated with HELLO, as on a branch server */
+    int waiting;            /* parked until a refresh completes */
+    int woken;              /* ... which it has: answer from what there is */
+    int dead;               /* hung up while parked; freed after the refresh */
+    int eof, done;
+    char in[TIER_IN_SZ];
+    size_t inlen;
+    char *out;
+    size_t outlen, outoff, outcap;
+    struct tier_client *next_waiter;
+};
+
+/* One windowed query's answer */
+struct qentry {
+    char key[QUERY_KEY_SZ];     /* normalised words after REQUEST, "" if free */
+    long long records, units;
+    int have;                   /* they are a complete answer */
+    long long computed_us;
+    unsigned long long gen;     /* tier generation they were computed at */
+    long long queued_us;        /* 0: not queued for a refresh */
+    long long used_us;          /* last asked for, for eviction */
+    struct tier_client *waiters;
+    struct qentry *next;        /* refresh queue */
+};
+
+struct tier {
+    const char *id;         /* BRANCH_ID we answer with */
+    long long stale_us;     /* TTL of cached answers */
+    uint32_t boot;          /* high half of the seqs we answer SINCE with */
+    unsigned long long gen; /* ... and the low: bumped when a child changes */
+    long long checked_us;   /* end of the last check, 0 before the first */
+    int check_wanted;
+    int running;            /* TIER_CHECK, TIER_WINDOW or 0 */
+    struct qentry *job;     /* TIER_WINDOW: the query being refreshed */
+    long long records, units;   /* combined totals as of checked_us */
+    struct tier_client *waiters;    /* for the next check */
+    struct qentry *queue, *queue_tail;
+    struct qentry cache[QCACHE_SLOTS];
+};
+
+static int start_listener(const char *port) {
+    struct addrinfo hints, *res, *rp;
+    int sfd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0) return -1;
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        sfd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+        if (sfd < 0) continue;
+        int opt = 1;
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(sfd, rp->ai_addr, rp->ai_addrlen) == 0 && listen(sfd, TIER_BACKLOG) == 0) break;
+        close(sfd);
+        sfd = -1;
+    }
+    freeaddrinfo(res);
+    return sfd;
+}
+
+static int tier_append(struct tier_client *c, const void *data, size_t len) {
+    if (c->outlen + len > c->outcap) {
+        size_t cap = c->outcap ? c->outcap : 512;
+        while (cap < c->outlen + len) cap *= 2;
+        char *p = realloc(c->out, cap);
+        if (!p) return -1;
+        c->out = p;
+        c->outcap = cap;
+    }
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
+    return 0;
+}
+
+/* The reply a branch server would give, for combined totals */
+static int tier_reply(struct tier_client *c, const struct tier *t, long long records, long long units) {
+    if (c->binary) {
+        unsigned char frame[FRAME_HDR_SZ + 1 + 255 + 16], *p = frame + FRAME_HDR_SZ;
+        size_t idlen = strlen(t->id);
+        if (idlen > 255) idlen = 255;
+        *p++ = (unsigned char)idlen;
+        memcpy(p, t->id, idlen);
+        p += idlen;
+        p = put_be(p, (unsigned long long)records, 8);
+        p = put_be(p, (unsigned long long)units, 8);
+        frame[0] = FRAME_MAGIC;
+        frame[1] = FRAME_TOTALS;
+        put_be(frame + 2, 0, 2);
+        put_be(frame + 4, (unsigned long long)(p - frame - FRAME_HDR_SZ), 4);
+        return tier_append(c, frame, (size_t)(p - frame));
+    }
+    char out[512], amt[32];
+    format_units(amt, sizeof(amt), units);
+    int len = snprintf(out, sizeof(out), "BRANCH_ID: %s\nRECORDS: %lld\nSUBTOTAL: %s\nEND\n",
+                       t->id, records, amt);
+    if (len < 0 || (size_t)len >= sizeof(out)) return -1;
+    return tier_append(c, out, (size_t)len);
+}
+
+/* Reply to REQUEST SINCE: UNCHANGED if 'since' is our current seq, else
+   the full totals (we keep no history to take a difference from) */
+static int tier_delta(struct tier_client *c, const struct tier *t, unsigned long long since) {
+    unsigned long long seq = (unsigned long long)t->boot << 32 | (t->gen & 0xffffffffu);
+    int kind = since == seq ? DELTA_UNCHANGED : DELTA_FULL;
+    long long records = kind == DELTA_FULL ? t->records : 0, units = kind == DELTA_FULL ? t->units : 0;
+    if (c->binary) {
+        unsigned char frame[FRAME_HDR_SZ + 1 + 255 + 25], *p = frame + FRAME_HDR_SZ;
+        size_t idlen = strlen(t->id);
+        if (idlen > 255) idlen = 255;
+        *p++ = (unsigned char)idlen;
+        memcpy(p, t->id, idlen);
+        p += idlen;
+        p = put_be(p, seq, 8);
+        *p++ = (unsigned char)kind;
+        p = put_be(p, (unsigned long long)records, 8);
+        p = put_be(p, (unsigned long long)units, 8);
+        frame[0] = FRAME_MAGIC;
+        frame[1] = FRAME_DELTA;
+        put_be(frame + 2, 0, 2);
+        put_be(frame + 4, (unsigned long long)(p - frame - FRAME_HDR_SZ), 4);
+        return tier_append(c, frame, (size_t)(p - frame));
+    }
+    char out[512], amt[32];
+    int len;
+    format_units(amt, sizeof(amt), units);
+    if (kind == DELTA_UNCHANGED)
+        len = snprintf(out, sizeof(out), "BRANCH_ID: %s\nSEQ: %llu\nUNCHANGED\nEND\n", t->id, seq);
+    else
+        len = snprintf(out, sizeof(out), "BRANCH_ID: %s\nSEQ: %llu\nRECORDS: %lld\nSUBTOTAL: %s\nEND\n",
+                       t->id, seq, records, amt);
+    if (len < 0 || (size_t)len >= sizeof(out)) return -1;
+    return tier_append(c, out, (size_t)len);
+}
+
+static int tier_error(struct tier_client *c, const char *msg) {
+    if (c->binary) {
+        unsigned char hdr[FRAME_HDR_SZ] = { FRAME_MAGIC, FRAME_ERROR, 0, 0 };
+        put_be(hdr + 4, strlen(msg), 4);
+        if (tier_append(c, hdr, sizeof(hdr)) != 0) return -1;
+        return tier_append(c, msg, strlen(msg));
+    }
+    char out[256];
+    int len = snprintf(out, sizeof(out), "ERROR: %s\nEND\n", msg);
+    return tier_append(c, out, (size_t)len);
+}
+
+/* YYYY-MM-DD or YYYY-MM-DDTHH, as a branch server takes them */
+static int query_date(const char *d) {
+    static const char pat[] = "dddd-dd-ddTdd";
+    size_t n = strlen(d);
+    if (n != 10 && n != 13) return 0;
+    for (size_t i = 0; i < n; i++)
+        if (pat[i] == 'd' ? !isdigit((unsigned char)d[i]) : toupper((unsigned char)d[i]) != pat[i])
+            return 0;
+    return 1;
+}
+
+/* The words after REQUEST: "" for the plain totals (with *delta set if
+   SINCE was given) or the cache key of a window, normalised so spellings
+   of one query share an entry. -1: not a query we combine. */
+static int tier_query(const char *args, char *key, size_t n, int *delta, unsigned long long *since) {
+    char copy[TIER_IN_SZ], from[16] = "", to[16] = "";
+    char *save, *tok;
+    *delta = 0;
+    snprintf(copy, sizeof(copy), "%s", args);
+    for (tok = strtok_r(copy, " \t", &save); tok; tok = strtok_r(NULL, " \t", &save)) {
+        char *v = strtok_r(NULL, " \t", &save), *end;
+        if (!v) return -1;
+        if (strcasecmp(tok, "SINCE") == 0) {
+            errno = 0;
+            *since = strtoull(v, &end, 10);
+            if (errno || *end) return -1;
+            *delta = 1;
+            continue;
+        }
+        if ((strcasecmp(tok, "FROM") != 0 && strcasecmp(tok, "TO") != 0) || !query_date(v)) return -1;
+        char *dst = toupper((unsigned char)tok[0]) == 'F' ? from : to;
+        strcpy(dst, v);
+        if (dst[10]) dst[10] = 'T';
+    }
+    if (*delta && (from[0] || to[0])) return -1;
+    int len = snprintf(key, n, "%s%s%s%s%s", from[0] ? "FROM " : "", from, from[0] && to[0] ? " " : "",
+                       to[0] ? "TO " : "", to);
+    return len < 0 || (size_t)len >= n ? -1 : 0;
+}
+
+/* The entry for key, or a free or least recently used idle one taken for
+   it; NULL if every slot has a refresh pending */
+static struct qentry *qcache_get(struct tier *t, const char *key) {
+    struct qentry *victim = NULL;
+    for (int i = 0; i < QCACHE_SLOTS; i++) {
+        struct qentry *e = &t->cache[i];
+        if (strcmp(e->key, key) == 0) return e;
+        if (e->queued_us || e->waiters || e == t->job) continue;
+        if (!victim || !e->key[0] || (victim->key[0] && e->used_us < victim->used_us)) victim = e;
+    }
+    if (victim) {
+        memset(victim, 0, sizeof(*victim));
+        snprintf(victim->key, sizeof(victim->key), "%s", key);
+    }
+    return victim;
+}
+
+static int tier_fresh(const struct tier *t, long long asof_us, long long now) {
+    return asof_us && now - asof_us < t->stale_us;
+}
+
+/* Serve the client's complete lines. Returns 1 when a REQUEST waits for a
+   refresh (the client is parked on it), 0 when all input is used, -1 to
+   drop it. */
+static int tier_handle(struct tier_client *c, struct tier *t) {
+    while (!c->done && c->inlen > 0) {
+        char *nl = memchr(c->in, '\n', c->inlen);
+        if (!nl && !c->eof) return c->inlen == sizeof(c->in) ? -1 : 0;
+        size_t linelen = nl ? (size_t)(nl - c->in) : c->inlen;
+        size_t used = nl ? linelen + 1 : c->inlen;
+        char line[TIER_IN_SZ + 1];
+        memcpy(line, c->in, linelen);
+        line[linelen] = '\0';
+        if (linelen > 0 && line[linelen - 1] == '\r') line[--linelen] = '\0';
+        if (strncmp(line, "HELLO", 5) == 0) {
+            char out[64] = "HELLO";
+            if (strstr(line, "KEEPALIVE") && !c->keepalive) {
+                c->keepalive = 1;
+                strcat(out, " KEEPALIVE");
+            }
+            if (strstr(line, "BINARY") && !c->binary) {
+                c->binary = 1;
+                strcat(out, " BINARY");
+            }
+            strcat(out, "\nEND\n");
+            if (tier_append(c, out, strlen(out)) != 0) return -1;
+        } else if (strncmp(line, "REQUEST", 7) == 0) {
+            char key[QUERY_KEY_SZ];
+            unsigned long long since;
+            long long now = now_us();
+            int delta, woken = c->woken;
+            struct qentry *e = NULL;
+            c->woken = 0;
+            if ((line[7] != '\0' && line[7] != ' ' && line[7] != '\t') ||
+                tier_query(line + 7, key, sizeof(key), &delta, &since) != 0) {
+                if (tier_error(c, "unsupported query") != 0) return -1;
+            } else if (key[0] && !(e = qcache_get(t, key))) {
+                if (tier_error(c, "too many queries in flight") != 0) return -1;
+            } else if (!e) {
+                /* plain totals, or SINCE: current as of the last check */
+                if (!woken && !tier_fresh(t, t->checked_us, now)) {
+                    stat_add(&metrics.cache_misses, 1);
+                    c->waiting = 1;
+                    c->next_waiter = t->waiters;
+                    t->waiters = c;
+                    t->check_wanted = 1;
+                    return 1;
+                }
+                if (!woken) stat_add(&metrics.cache_hits, 1);
+                if ((delta ? tier_delta(c, t, since) : tier_reply(c, t, t->records, t->units)) != 0)
+                    return -1;
+            } else {
+                e->used_us = now;
+                if (e->have && e->gen != t->gen) e->have = 0;
+                if (!woken && !(e->have && tier_fresh(t, e->computed_us > t->checked_us ?
+                                                      e->computed_us : t->checked_us, now))) {
+                    stat_add(&metrics.cache_misses, 1);
+                    c->waiting = 1;
+                    c->next_waiter = e->waiters;
+                    e->waiters = c;
+                    if (!e->queued_us && t->job != e) {
+                        e->queued_us = now;
+                        e->next = NULL;
+                        if (t->queue_tail) t->queue_tail->next = e;
+                        else t->queue = e;
+                        t->queue_tail = e;
+                    }
+                    return 1;
+                }
+                if (!woken) stat_add(&metrics.cache_hits, 1);
+                if (tier_reply(c, t, e->records, e->units) != 0) return -1;
+            }
+            if (!c->keepalive) c->done = 1;
+        } else if (linelen > 0) {
+            if (!c->keepalive) return -1;
+            if (tier_error(c, "unknown command") != 0) return -1;
+        }
+        memmove(c->in, c->in + used, c->inlen - used);
+        c->inlen -= used;
+    }
+    return 0;
+}
+
+static void tier_close(int epfd, struct tier_client *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+/* Flush what the socket takes, then close or re-arm for what comes next */
+static void tier_settle(int epfd, struct tier_client *c) {
+    while (c->outoff < c->outlen) {
+        ssize_t r = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (r < 0) { tier_close(epfd, c); return; }
+        c->outoff += (size_t)r;
+        stat_add(&metrics.bytes_out, (uint64_t)r);
+    }
+    int flushed = c->outoff == c->outlen;
+    if (flushed) c->outoff = c->outlen = 0;
+    if (flushed && !c->waiting && (c->done || c->eof)) { tier_close(epfd, c); return; }
+    struct epoll_event ev = { .events = 0, .data.ptr = c };
+    if (!c->waiting && !c->done && !c->eof) ev.events |= EPOLLIN | EPOLLRDHUP;
+    if (!flushed) ev.events |= EPOLLOUT;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* A refresh completed: answer the clients parked on it */
+static void tier_wake(int epfd, struct tier *t, struct tier_client *list) {
+    while (list) {
+        struct tier_client *c = list;
+        list = c->next_waiter;
+        c->waiting = 0;
+        c->woken = 1;
+        if (c->dead) {
+            close(c->fd);
+            free(c->out);
+            free(c);
+        } else if (tier_handle(c, t) < 0) {
+            tier_close(epfd, c);
+        } else {
+            tier_settle(epfd, c);
+        }
+    }
+}
+
+/* Start the next refresh, answering queued windows a check has shown to be
+   unchanged without one of their own */
+static void tier_start(int epfd, struct tier *t, struct branch_list *bl) {
+    while (!t->running) {
+        struct qentry *e = t->queue;
+        if (!t->check_wanted && e && e->have && e->gen == t->gen && t->checked_us < e->queued_us)
+            t->check_wanted = 1;
+        if (t->check_wanted) {
+            t->check_wanted = 0;
+            t->running = TIER_CHECK;
+        } else if (!e) {
+            return;
+        } else {
+            if (!(t->queue = e->next)) t->queue_tail = NULL;
+            e->queued_us = 0;
+            if (e->have && e->gen == t->gen) {
+                stat_add(&metrics.cache_revalidations, 1);
+                struct tier_client *list = e->waiters;
+                e->waiters = NULL;
+                tier_wake(epfd, t, list);
+                continue;
+            }
+            e->gen = t->gen;
+            t->job = e;
+            t->running = TIER_WINDOW;
+        }
+        for (int i = 0; i < bl->n; i++) {
+            bl->v[i].want = bl->v[i].primary < 0;
+            bl->v[i].answered = 0;
+        }
+    }
+}
+
+/* The running refresh has every answer it will get */
+static void tier_finish(int epfd, struct tier *t, struct branch_list *bl) {
+    struct tier_client *list;
+    long long records = 0, units = 0;
+    int complete = 1;
+    for (int i = 0; i < bl->n; i++) {
+        const struct branch_conn *b = &bl->v[i];
+        if (b->primary >= 0) continue;
+        complete &= b->answered;
+        if (t->running == TIER_WINDOW && b->answered) {
+            records += b->win_records;
+            units += b->win_units;
+        } else if (t->running == TIER_CHECK && b->have_totals) {
+            records += b->tot_records;
+            units += b->tot_units;
+        }
+    }
+    if (t->running == TIER_CHECK) {
+        /* a child we did not hear from may have changed */
+        if (!complete) t->gen++;
+        t->records = records;
+        t->units = units;
+        t->checked_us = now_us();
+        list = t->waiters;
+        t->waiters = NULL;
+    } else {
+        struct qentry *e = t->job;
+        e->records = records;
+        e->units = units;
+        e->have = complete && e->gen == t->gen;
+        e->computed_us = now_us();
+        list = e->waiters;
+        e->waiters = NULL;
+        t->job = NULL;
+    }
+    t->running = 0;
+    tier_wake(epfd, t, list);
+}
+
+/* One reply from a child during a refresh */
+static void tier_frame(struct tier *t, struct branch_conn *b, const char *frame, size_t flen) {
+    int binary = (unsigned char)frame[0] == FRAME_MAGIC;
+    if (!binary && strncmp(frame, "HELLO", 5) == 0) {
+        b->hello_acked = 1;
+        b->keepalive = strstr(frame, "KEEPALIVE") != NULL;
+        return;
+    }
+    if (b->received < b->sent) branch_latency(b, now_us() - b->sent_us[b->received % PIPE_RING]);
+    b->received++;
+    b->conn_replies++;
+    b->want = 0;
+    char branch_id[64];
+    long long records, units;
+    int rc, check = t->running == TIER_CHECK;
+    if (check && !b->no_delta) {
+        unsigned long long seq;
+        int kind;
+        rc = parse_delta(frame, flen, branch_id, sizeof(branch_id), &seq, &kind, &records, &units);
+        if (rc == 0) {
+            if (!b->have_totals || seq != b->seq) t->gen++;
+            if (kind == DELTA_FULL) b->tot_records = b->tot_units = 0;
+            b->seq = seq;
+            b->tot_records += records;
+            b->tot_units += units;
+            b->have_totals = b->answered = 1;
+            state_set_totals(b->state, b->tot_records, b->tot_units);
+        } else if (binary ? flen >= FRAME_HDR_SZ && frame[1] == FRAME_ERROR
+                          : strncmp(frame, "ERROR:", 6) == 0) {
+            /* a child that keeps no seqs: plain REQUESTs from now on */
+            b->no_delta = 1;
+        }
+    } else {
+        rc = binary ? parse_frame((const unsigned char *)frame, flen, branch_id,
+                                  sizeof(branch_id), &records, &units)
+                    : parse_reply(frame, branch_id, sizeof(branch_id), &records, &units);
+        if (rc == 0 && check) {
+            if (!b->have_totals || records != b->tot_records || units != b->tot_units) t->gen++;
+            b->tot_records = records;
+            b->tot_units = units;
+            b->have_totals = b->answered = 1;
+            state_set_totals(b->state, records, units);
+        } else if (rc == 0) {
+            b->win_records = records;
+            b->win_units = units;
+            b->answered = 1;
+        }
+    }
+    if (rc != 0 && !b->no_delta)
+        fprintf(stderr, "Malformed reply from %s:%s: [%s]\n", b->host, b->port,
+                binary ? "binary" : frame);
+}
+
+static int serve_tier(const char *port, struct tier *t, struct branch_list *bl,
+                      const char *hello, struct persister *ps, const char *metrics_file) {
+    int sfd = start_listener(port);
+    if (sfd < 0) { perror("listen"); return -1; }
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { perror("epoll_create1"); close(sfd); return -1; }
+    struct timespec boot;
+    clock_gettime(CLOCK_REALTIME, &boot);
+    t->boot = (uint32_t)(boot.tv_sec ^ boot.tv_nsec ^ ((uint32_t)getpid() << 16));
+    /* branch conns are told apart from clients by where they live */
+    static char listen_tag;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listen_tag };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+    printf("Tier %s listening on port %s (%d children, stale=%lldms)\n", t->id, port, bl->n,
+           t->stale_us / 1000);
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        long long now = now_ms(), wake = -1;
+        if (t->running) {
+            int pending = 0;
+            for (int i = 0; i < bl->n; i++) {
+                struct branch_conn *b = &bl->v[i];
+                if (!b->want) continue;
+                if (b->is_shm) {
+                    /* a segment holds the plain totals only */
+                    struct shm_slot st;
+                    if (t->running == TIER_CHECK && shm_totals(b, &st) == 0) {
+                        if (!b->have_totals || st.seq != b->seq) t->gen++;
+                        b->seq = st.seq;
+                        b->tot_records = st.records;
+                        b->tot_units = st.units;
+                        b->have_totals = b->answered = 1;
+                        state_set_totals(b->state, st.records, st.units);
+                    }
+                    b->want = 0;
+                    continue;
+                }
+                if (b->fd >= 0 && (b->connecting || b->sent > b->received) && now >= b->deadline_ms) {
+                    fprintf(stderr, "Timeout waiting for branch%d %s:%s\n", i + 1, b->host, b->port);
+                    stat_add(&metrics.timeouts, 1);
+                    branch_close(epfd, b);
+                    b->sent = b->received;
+                    b->want = 0;
+                    continue;
+                }
+                if (b->fd < 0) {
+                    if (branch_open(epfd, b, now) < 0) {
+                        fprintf(stderr, "Could not connect to branch%d %s:%s\n", i + 1, b->host, b->port);
+                        b->want = 0;
+                        continue;
+                    }
+                } else if (!b->connecting && b->sent == b->received) {
+                    char base[QUERY_KEY_SZ + 32], line[QUERY_KEY_SZ + 320];
+                    if (t->running == TIER_WINDOW) snprintf(base, sizeof(base), "REQUEST %s\n", t->job->key);
+                    else if (b->no_delta) snprintf(base, sizeof(base), "REQUEST\n");
+                    else snprintf(base, sizeof(base), "REQUEST SINCE %llu\n", b->seq);
+                    const char *req = branch_line(b, base, line, sizeof(line));
+                    if (robust_send(b->fd, req, strlen(req)) < 0) {
+                        branch_lost(epfd, b);
+                        if (b->failed) b->want = 0;
+                        continue;
+                    }
+                    stat_add(&metrics.bytes_out, strlen(req));
+                    b->sent_us[b->sent % PIPE_RING] = now_us();
+                    b->sent++;
+                    b->deadline_ms = now + b->timeout_ms;
+                }
+                pending++;
+                branch_stagger(epfd, b, now, &wake);
+                if (wake < 0 || b->deadline_ms < wake) wake = b->deadline_ms;
+            }
+            if (!pending) {
+                tier_finish(epfd, t, bl);
+                tier_start(epfd, t, bl);
+                if (arena_used(ps->arenas->cur) > 0) arena_rotate(ps->arenas);
+                if (metrics_file && persist_simple(ps, PERSIST_METRICS) != 0)
+                    fprintf(stderr, "Failed to queue metrics\n");
+                continue;
+            }
+        }
+        long long wait = wake < 0 ? -1 : wake - now_ms();
+        if (wake >= 0 && wait < 0) wait = 0;
+        long long t0 = now_us();
+        int n = epoll_wait(epfd, events, MAX_EVENTS, (int)wait);
+        hist_record(&metrics.wait_us, now_us() - t0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        now = now_ms();
+        for (int e = 0; e < n; e++) {
+            void *tag = events[e].data.ptr;
+            if (tag == &listen_tag) {
+                int cfd;
+                while ((cfd = accept4(sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    struct tier_client *c = calloc(1, sizeof(*c));
+                    struct epoll_event cev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = c };
+                    if (!c || epoll_ctl(epfd, EPOLL_CTL_ADD, cfd, &cev) != 0) {
+                        close(cfd);
+                        free(c);
+                        continue;
+                    }
+                    c->fd = cfd;
+                    int one = 1;
+                    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                }
+            } else if ((struct branch_conn *)tag >= bl->v && (struct branch_conn *)tag < bl->v + bl->n) {
+                struct branch_conn *b = tag;
+                if (b->fd < 0) continue;
+                if (b->connecting) {
+                    if (branch_connected(epfd, b, hello, now) < 0) {
+                        fprintf(stderr, "Could not connect to branch%d %s:%s\n", b->index + 1,
+                                b->host, b->port);
+                        branch_close(epfd, b);
+                        b->want = 0;
+                    }
+                    continue;
+                }
+                ssize_t r = branch_recv(b, ps->arenas);
+                if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                if (r > 0) {
+                    ssize_t fr;
+                    char *frame;
+                    while ((fr = next_frame(b, &frame)) > 0) {
+                        const char *f = frame;
+                        size_t flen = (size_t)fr;
+                        if (frame_unpack(ps->arenas->cur, &f, &flen) != 0) break;
+                        tier_frame(t, b, f, flen);
+                        frame_done(b, (size_t)fr);
+                        b->deadline_ms = now + b->timeout_ms;
+                    }
+                    if (fr != 0) {
+                        fprintf(stderr, "%s reply from branch%d %s:%s\n", fr < 0 ? "Oversized" : "Corrupt",
+                                b->index + 1, b->host, b->port);
+                        branch_close(epfd, b);
+                        b->sent = b->received;
+                        b->want = 0;
+                    } else if (!b->keepalive && b->conn_replies > 0) {
+                        branch_close(epfd, b);
+                        b->sent = b->received;
+                    }
+                    continue;
+                }
+                /* closed: retried on a fresh connection unless it got nowhere;
+                   either way the next refresh tries again */
+                branch_lost(epfd, b);
+                if (b->failed) {
+                    b->failed = 0;
+                    b->want = 0;
+                }
+            } else {
+                struct tier_client *c = tag;
+                uint32_t evs = events[e].events;
+                if (c->waiting) {
+                    if (evs & (EPOLLHUP | EPOLLERR)) {
+                        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+                        c->dead = 1;
+                    } else {
+                        tier_settle(epfd, c);
+                    }
+                    continue;
+                }
+                if (evs & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    while (c->inlen < sizeof(c->in)) {
+                        ssize_t r = robust_recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+                        if (r > 0) {
+                            c->inlen += (size_t)r;
+                            stat_add(&metrics.bytes_in, (uint64_t)r);
+                            continue;
+                        }
+                        if (r == 0) c->eof = 1;
+                        else if (errno != EAGAIN && errno != EWOULDBLOCK) c->eof = c->done = 1;
+                        break;
+                    }
+                }
+                int rc = tier_handle(c, t);
+                if (rc < 0) {
+                    tier_close(epfd, c);
+                    continue;
+                }
+                if (rc > 0) tier_start(epfd, t, bl);
+                tier_settle(epfd, c);
+            }
+        }
+    }
+    close(epfd);
+    close(sfd);
+    return -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--branches FILE] [--timeout MS] [--dns-ttl SECS] [--keepalive] [--binary] [--compress] [--append]\n"
+                    "       %*s [--store DIR [--export-every N]]\n"
+                    "       %*s [--rounds N | --daemon] [--interval MS] [--jitter MS] [--pipeline D]\n"
+                    "       %*s [--timing] [--metrics FILE] [--io-uring]\n"
+                    "       %*s [--range \"FROM <date> TO <date>\" | --delta | --subscribe SECS]\n"
+                    "       %*s <MAIN_CSV> [<HOST> <PORT>]...\n"
+                    "       %s --store DIR --query BRANCH_ID [--since TIME] [--until TIME]\n"
+                    "       %s --compact hour|day|month [--until TIME] [--threads N] <MAIN_CSV>\n"
+                    "       %s --serve PORT [--id ID] [--stale MS] [--branches FILE] [--timeout MS]\n"
+                    "       %*s [--keepalive] [--binary] [--compress] [--metrics FILE] [<HOST> <PORT>]...\n",
+            prog, (int)strlen(prog), "", (int)strlen(prog), "", (int)strlen(prog), "",
+            (int)strlen(prog), "", (int)strlen(prog), "", prog, prog, prog, (int)strlen(prog), "");
+}
+
+int main(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "branches",  required_argument, NULL, 'f' },
+        { "timeout",   required_argument, NULL, 't' },
+        { "keepalive", no_argument,       NULL, 'k' },
+        { "binary",    no_argument,       NULL, 'b' },
+        { "append",    no_argument,       NULL, 'a' },
+        { "store",     required_argument, NULL, 's' },
+        { "export-every", required_argument, NULL, 'e' },
+        { "query",     required_argument, NULL, 'q' },
+        { "since",     required_argument, NULL, 'S' },
+        { "until",     required_argument, NULL, 'U' },
+        { "rounds",    required_argument, NULL, 'r' },
+        { "interval",  required_argument, NULL, 'i' },
+        { "pipeline",  required_argument, NULL, 'p' },
+        { "timing",    no_argument,       NULL, 'T' },
+        { "metrics",   required_argument, NULL, 'm' },
+        { "range",     required_argument, NULL, 'R' },
+        { "delta",     no_argument,       NULL, 'D' },
+        { "subscribe", required_argument, NULL, 'P' },
+        { "serve",     required_argument, NULL, 'L' },
+        { "id",        required_argument, NULL, 'I' },
+        { "stale",     required_argument, NULL, 'W' },
+        { "dns-ttl",   required_argument, NULL, 'N' },
+        { "daemon",    no_argument,       NULL, 'd' },
+        { "jitter",    required_argument, NULL, 'j' },
+        { "compress",  no_argument,       NULL, 'z' },
+        { "io-uring",  no_argument,       NULL, 'u' },
+        { "compact",   required_argument, NULL, 'c' },
+        { "threads",   required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    const char *branch_file = NULL, *store_dir = NULL, *query = NULL, *metrics_file = NULL;
+    const char *range = NULL, *serve = NULL, *tier_id = "AGG";
+    int64_t since = INT64_MIN, until = INT64_MAX;
+    int export_every = 0, timing = 0, delta = 0, subscribe = 0, subscribe_sec = 0;
+    int stale_ms = 1000, daemon = 0, jitter_ms = -1, rounds_given = 0, compress = 0, io_uring = 0;
+    int compact = -1, threads = 1;
+    int timeout_ms = TIMEOUT_SEC * 1000;
+    int keepalive = 0, binary = 0, append = 0, rounds = 1, interval_ms = 0, depth = 1, opt;
+    while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'f': branch_file = optarg; break;
+        case 't': timeout_ms = atoi(optarg); break;
+        case 'k': keepalive = 1; break;
+        case 'b': binary = 1; break;
+        case 'a': append = 1; break;
+        case 's': store_dir = optarg; break;
+        case 'e': export_every = atoi(optarg); break;
+        case 'q': query = optarg; break;
+        case 'S':
+        case 'U':
+            if (parse_iso(optarg, opt == 'S' ? &since : &until) != 0) {
+                fprintf(stderr, "Bad time '%s' (want YYYY-MM-DD or YYYY-MM-DDTHH:MM:SSZ)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r': rounds = atoi(optarg); rounds_given = 1; break;
+        case 'i': interval_ms = atoi(optarg); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'T': timing = 1; break;
+        case 'm': metrics_file = optarg; break;
+        case 'R': range = optarg; break;
+        case 'D': delta = 1; break;
+        case 'P':
+            subscribe = delta = keepalive = 1;
+            subscribe_sec = atoi(optarg);
+            break;
+        case 'L': serve = optarg; break;
+        case 'I': tier_id = optarg; break;
+        case 'W': stale_ms = atoi(optarg); break;
+        case 'N': dns_ttl_ms = atoi(optarg) * 1000LL; break;
+        case 'd': daemon = 1; break;
+        case 'j': jitter_ms = atoi(optarg); break;
+        case 'z': compress = binary = 1; break;
+        case 'u': io_uring = 1; break;
+        case 'c':
+            for (int p = PERIOD_HOUR; p <= PERIOD_MONTH; p++)
+                if (strcmp(optarg, period_names[p]) == 0) compact = p;
+            if (compact < 0) {
+                fprintf(stderr, "Bad period '%s' (want hour, day or month)\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n': threads = atoi(optarg); break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    static struct col_store store;
+    if (query) {
+        if (!store_dir) { usage(argv[0]); return 1; }
+        if (store_open(&store, store_dir) != 0) return 1;
+        int rc = store_query(&store, query, since, until);
+        store_close(&store);
+        return rc == 0 ? 0 : 1;
+    }
+    if (compact >= 0) {
+        /* with --store the history lives in the store, and main CSV is re-exported from it */
+        if (argc - optind != 1 || threads < 1 || store_dir || serve) { usage(argv[0]); return 1; }
+        if (threads > 256) threads = 256;
+        return compact_main_csv(argv[optind], compact, until == INT64_MAX ? (int64_t)time(NULL) : until,
+                                threads) == 0 ? 0 : 1;
+    }
+    /* a tier has no main CSV, only children */
+    int nfixed = serve ? 0 : 1;
+    if (argc - optind < nfixed || (argc - optind - nfixed) % 2 != 0 || rounds < 1 ||
+        interval_ms < 0 || depth < 1 || timeout_ms <= 0 || subscribe_sec < 0 || stale_ms < 0 || dns_ttl_ms < 0 ||
+        (serve && (subscribe || delta || range || append || store_dir || daemon))) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (daemon) {
+        if (subscribe || rounds_given) {
+            fprintf(stderr, "--daemon runs rounds until stopped; it takes no --rounds or --subscribe\n");
+            return 1;
+        }
+        /* warm connections, one append per round */
+        keepalive = append = 1;
+        rounds = INT_MAX;
+        if (interval_ms == 0) interval_ms = DAEMON_INTERVAL_MS;
+        if (jitter_ms < 0) jitter_ms = interval_ms / 10;
+    }
+    if (jitter_ms < 0) jitter_ms = 0;
+    if (interval_ms > 0 && jitter_ms > interval_ms) jitter_ms = interval_ms;
+    if (depth > PIPE_RING) depth = PIPE_RING;
+    /* the window is evaluated by the branch servers; one row per branch */
+    char req[256];
+    if (range && (strcasestr(range, "GROUP") || strchr(range, '\n'))) {
+        fprintf(stderr, "--range takes \"FROM <date> TO <date>\"; GROUP BY is for direct queries\n");
+        return 1;
+    }
+    if (range && delta) {
+        fprintf(stderr, "--range and --delta/--subscribe cannot be combined\n");
+        return 1;
+    }
+    snprintf(req, sizeof(req), range ? "REQUEST %s\n" : "REQUEST\n", range);
+    const char *main_csv = serve ? NULL : argv[optind];
+    /* offer every codec built in, the preferred one first */
+    const char *codecs = ""
+#ifdef HAVE_ZSTD
+        " ZSTD"
+#endif
+#ifdef HAVE_LZ4
+        " LZ4"
+#endif
+        ;
+    if (compress && !codecs[0]) {
+        fprintf(stderr, "--compress needs a build with -DHAVE_ZSTD or -DHAVE_LZ4\n");
+        return 1;
+    }
+    char hello_buf[64];
+    const char *hello = NULL;
+    if (keepalive || binary) {
+        snprintf(hello_buf, sizeof(hello_buf), "HELLO%s%s%s\n",
+                 keepalive ? " KEEPALIVE" : "", binary ? " BINARY" : "", compress ? codecs : "");
+        hello = hello_buf;
+    }
+
+    struct branch_list bl = { NULL, 0, 0 };
+    for (int i = optind + nfixed; i + 1 < argc; i += 2) {
+        if (add_branch(&bl, argv[i], argv[i+1], timeout_ms, NULL) != 0) { perror("add_branch"); return 1; }
+    }
+    if (branch_file && load_branches(branch_file, &bl, timeout_ms) != 0) return 1;
+    if (bl.n == 0) {
+        fprintf(stderr, "No branches configured.\n");
+        usage(argv[0]);
+        return 1;
+    }
+    struct branch_state *states = aligned_alloc(64, (size_t)bl.n * sizeof(*states));
+    if (!states) { perror("aligned_alloc"); return 1; }
+    memset(states, 0, (size_t)bl.n * sizeof(*states));
+    for (int i = 0; i < bl.n; i++) {
+        bl.v[i].state = &states[i];
+        branch_slot(&bl.v[i], jitter_ms);
+    }
+    if (serve) {
+        struct round_sink none = { NULL, NULL, 0, 0, { -1, -1 } };
+        static struct persister tps;
+        static struct arena_pool tarenas;
+        arena_rotate(&tarenas);
+        if (metrics_file && persist_start(&tps, &none, metrics_file, &bl, &tarenas) != 0) {
+            perror("persistence thread");
+            return 1;
+        }
+        tps.arenas = &tarenas;
+        static struct tier t;
+        t.id = tier_id;
+        t.stale_us = stale_ms * 1000LL;
+        serve_tier(serve, &t, &bl, hello, &tps, metrics_file);
+        return 1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) { perror("epoll_create1"); return 1; }
+    static struct net_ring nr;
+    if (io_uring) {
+        if (uring_init(&nr.u, MAX_EVENTS) == 0) nr.on = 1;
+        else fprintf(stderr, "io_uring unavailable (%s), using plain sends and receives\n", strerror(errno));
+    }
+    /* the daemon takes its signals through the epoll set; the mask is set
+       before the persistence thread starts, so it inherits it */
+    static char signal_tag;
+    int sigfd = -1;
+    if (daemon) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGHUP);
+        sigaddset(&mask, SIGTERM);
+        sigaddset(&mask, SIGINT);
+        struct epoll_event sev = { .events = EPOLLIN, .data.ptr = &signal_tag };
+        if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0 ||
+            (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &sev) != 0) {
+            perror("signalfd");
+            return 1;
+        }
+        setvbuf(stdout, NULL, _IOLBF, 0);     /* logs go out as they happen */
+        printf("Daemon: %d branches every %d ms (jitter %d ms)\n", bl.n, interval_ms, jitter_ms);
+    }
+    long long start = now_ms();
+    int available = 0;
+    for (int i = 0; i < bl.n; i++) {
+        struct branch_conn *b = &bl.v[i];
+        if (b->primary >= 0) continue;      /* replicas connect on demand */
+        if (b->is_shm) {
+            available++;
+            continue;
+        }
+        if (branch_open(epfd, b, start) < 0) {
+            fprintf(stderr, "Could not connect to branch%d %s:%s\n", i + 1, b->host, b->port);
+            b->failed = 1;
+        } else {
+            available++;
+        }
+    }
+    if (available == 0 && !daemon) {
+        fprintf(stderr, "No branches available. Exiting.\n");
+        return 1;
+    }
+
+    /* Round r may be requested from start + r*interval on. Without keep-alive
+       every request gets its own connection; with it, up to 'depth' requests
+       are outstanding on one connection at a time. Each branch has its own
+       deadline, measured from its last request or reply. With --subscribe
+       there are no rounds: one SUBSCRIBE per connection, then the branch
+       pushes deltas until 'end' (subscribe_sec 0: forever); a lost
+       connection resubscribes from the last seq. */
+    if (subscribe) rounds = INT_MAX;
+    long long end = subscribe && subscribe_sec > 0 ? start + subscribe_sec * 1000LL : -1;
+    struct epoll_event events[MAX_EVENTS];
+    struct csv_batch batch;
+    memset(&batch, 0, sizeof(batch));
+    struct round_sink sink = { main_csv, NULL, export_every, 0, { -1, -1 } };
+    if (store_dir) {
+        if (store_open(&store, store_dir) != 0) return 1;
+        if (store.rows == 0 && store_import_csv(&store, main_csv) != 0) return 1;
+        sink.store = &store;
+        append = 1;
+    }
+    static struct persister ps;
+    static struct arena_pool arenas;
+    arena_rotate(&arenas);
+    if (persist_start(&ps, &sink, metrics_file, &bl, &arenas) != 0) {
+        perror("persistence thread");
+        return 1;
+    }
+    int committed_round = 0, reload = 0, stopping = 0;
+    while (!stopping) {
+        if (reload) {
+            reload = 0;
+            if (!branch_file)
+                fprintf(stderr, "SIGHUP: no --branches file to reload\n");
+            else if (reload_branches(epfd, &bl, &states, (argc - optind - nfixed) / 2, branch_file,
+                                     timeout_ms, jitter_ms, start, interval_ms, &ps) != 0)
+                fprintf(stderr, "Reload of %s failed; keeping the current branches\n", branch_file);
+        }
+        long long now = now_ms();
+        long long wake = -1;
+        int active = 0;
+        for (int i = 0; daemon && i < bl.n; i++) {
+            struct branch_conn *b = &bl.v[i];
+            if (!b->failed || b->primary >= 0) continue;
+            /* sit out the rest of this round, try again at the next slot */
+            branch_close(epfd, b);
+            int r = next_round(b, start, interval_ms, now);
+            b->sent = b->received = r > b->received ? r : b->received;
+            __atomic_store_n(&b->down, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&b->failed, 0, __ATOMIC_RELAXED);
+        }
+        /* a round is complete once every branch still in play has answered it,
+           dropped out or run past its adaptive wait; in append mode, commit
+           whatever has been collected */
+        int done_round = rounds;
+        for (int i = 0; i < bl.n; i++) {
+            struct branch_conn *b = &bl.v[i];
+            if (b->failed || b->primary >= 0) continue;
+            int d = branch_done(b, start, interval_ms, now, &wake);
+            if (d < done_round) done_round = d;
+        }
+        int closed = done_round > committed_round || (subscribe && batch.rows > 0);
+        for (int r = committed_round; !subscribe && r < done_round; r++)
+            hist_record(&metrics.round_us, now_us() - (start + (long long)r * interval_ms) * 1000);
+        for (int i = 0; !subscribe && done_round > committed_round && i < bl.n; i++) {
+            struct branch_conn *b = &bl.v[i];
+            if (b->failed || b->primary >= 0 || b->received >= done_round) continue;
+            fprintf(stderr, "Round %d closed without branch%d %s:%s (waited %lld ms)\n", done_round,
+                    i + 1, b->host, b->port, branch_wait_ms(b));
+            stat_add(&metrics.late, 1);
+        }
+        if (closed) {
+            if (append && batch.rows > 0 &&
+                persist_batch(&ps, &batch, subscribe ? 0 : done_round) != 0)
+                fprintf(stderr, "Failed to queue round %d\n", done_round);
+            if (metrics_file && persist_simple(&ps, PERSIST_METRICS) != 0)
+                fprintf(stderr, "Failed to queue metrics\n");
+            committed_round = done_round;
+        }
+        /* once its rows are handed over the round's arena is retired; so is
+           one that a stream of single rows (--subscribe) has half filled */
+        size_t used = arena_used(arenas.cur);
+        if (batch.rows == 0 && (closed ? used > 0 : used >= ARENA_BLOCK / 2)) arena_rotate(&arenas);
+        batch.arena = arenas.cur;
+        for (int i = 0; i < bl.n; i++) {
+            struct branch_conn *b = &bl.v[i];
+            if (b->primary >= 0) {
+                if (!subscribe) replica_step(epfd, &bl, b, req, delta, now, &wake);
+                continue;
+            }
+            if (b->failed || b->received >= rounds) continue;
+            if (b->fd >= 0 && (b->connecting || b->sent > b->received) && now >= b->deadline_ms) {
+                fprintf(stderr, "Timeout waiting for branch%d %s:%s\n", i + 1, b->host, b->port);
+                stat_add(&metrics.timeouts, 1);
+                branch_close(epfd, b);
+                b->failed = 1;
+                continue;
+            }
+            active++;
+            if (b->is_shm) {
+                shm_step(b, rounds, start, interval_ms, subscribe, delta, now, &wake, &ps,
+                         append ? &batch : NULL);
+                continue;
+            }
+            branch_stagger(epfd, b, now, &wake);
+            if (subscribe) {
+                if (b->fd < 0 && branch_open(epfd, b, now) < 0) {
+                    fprintf(stderr, "Could not connect to branch%d %s:%s\n", i + 1, b->host, b->port);
+                    b->failed = 1;
+                } else if (b->fd >= 0 && !b->connecting && !b->subscribed) {
+                    char sub[256], line[384];
+                    snprintf(sub, sizeof(sub), "SUBSCRIBE SINCE %llu\n", b->seq);
+                    const char *msg = branch_line(b, sub, line, sizeof(line));
+                    if (robust_send(b->fd, msg, strlen(msg)) < 0) {
+                        branch_lost(epfd, b);
+                    } else {
+                        stat_add(&metrics.bytes_out, strlen(msg));
+                        b->subscribed = 1;
+                        b->sent_us[b->received % PIPE_RING] = now_us();
+                        b->sent = b->received + 1;
+                        b->deadline_ms = now + b->timeout_ms;
+                    }
+                }
+            }
+            /* pipeline only once the server has confirmed keep-alive; a delta
+               request needs the seq from the previous reply */
+            int limit = b->keepalive && !delta ? depth : 1;
+            /* every request due now goes out in one write */
+            struct iovec iov[PIPE_RING];
+            char line[384];
+            int niov = 0;
+            size_t nbytes = 0;
+            while (!subscribe && !b->connecting && b->sent < rounds && b->sent - b->received < limit) {
+                long long due = start + b->offset_ms + (long long)b->sent * interval_ms;
+                if (due > now) {
+                    if (wake < 0 || due < wake) wake = due;
+                    break;
+                }
+                if (b->fd < 0) {
+                    if (branch_open(epfd, b, now) < 0) {
+                        fprintf(stderr, "Could not connect to branch%d %s:%s\n", i + 1, b->host, b->port);
+                        b->failed = 1;
+                    }
+                    break;
+                }
+                if (delta) snprintf(req, sizeof(req), "REQUEST SINCE %llu\n", b->seq);
+                /* the same line for every entry: only delta requests differ,
+                   and those go one at a time */
+                iov[niov].iov_base = (char *)branch_line(b, req, line, sizeof(line));
+                iov[niov].iov_len = strlen(iov[niov].iov_base);
+                nbytes += iov[niov++].iov_len;
+                b->sent_us[b->sent % PIPE_RING] = now_us();
+                if (b->sent == b->received) b->deadline_ms = now + b->timeout_ms;
+                b->sent++;
+            }
+            /* with the ring, queued for net_wait() after the fan-out */
+            if (niov > 0 && (!nr.on || tx_queue(epfd, &nr, b, iov[0].iov_base, niov) != 0)) {
+                if (robust_writev(b->fd, iov, niov) < 0) branch_lost(epfd, b);
+                else stat_add(&metrics.bytes_out, nbytes);
+            }
+            if (!subscribe) branch_hedge(epfd, &bl, b, now, &wake);
+            if (b->fd >= 0 && (b->connecting || b->sent > b->received) &&
+                (wake < 0 || b->deadline_ms < wake))
+                wake = b->deadline_ms;
+        }
+        if (nr.on && net_wait(epfd, &nr) != 0) {
+            perror("io_uring");
+            break;
+        }
+        if ((active == 0 && !daemon) || (end >= 0 && now >= end)) break;
+        if (end >= 0 && (wake < 0 || end < wake)) wake = end;
+
+        /* Wait for the branch sockets until the next deadline or due request */
+        long long wait = wake < 0 ? timeout_ms : wake - now_ms();
+        if (wait < 0) wait = 0;
+        long long t0 = now_us();
+        int n = epoll_wait(epfd, events, MAX_EVENTS, (int)wait);
+        hist_record(&metrics.wait_us, now_us() - t0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        /* with the ring, one RECV per readable branch, all at once */
+        for (int e = 0; nr.on && e < n; e++) {
+            struct branch_conn *b = events[e].data.ptr;
+            if (events[e].data.ptr != &signal_tag && b->fd >= 0 && !b->connecting)
+                rx_queue(epfd, &nr, b, &arenas);
+        }
+        if (nr.on && net_wait(epfd, &nr) != 0) {
+            perror("io_uring");
+            break;
+        }
+        now = now_ms();
+        for (int e = 0; e < n; e++) {
+            if (events[e].data.ptr == &signal_tag) {
+                /* acted on after this batch of events, which may point
+                   into the branch list a reload replaces */
+                struct signalfd_siginfo si;
+                while (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                    if (si.ssi_signo == SIGHUP) reload = 1;
+                    else stopping = 1;
+                }
+                continue;
+            }
+            struct branch_conn *b = events[e].data.ptr;
+            if (b->fd < 0) continue;
+            if (b->connecting) {
+                if (branch_connected(epfd, b, hello, now) < 0) {
+                    fprintf(stderr, "Could not connect to branch%d %s:%s\n", b->index + 1,
+                            b->host, b->port);
+                    branch_close(epfd, b);
+                    b->failed = 1;
+                }
+                continue;
+            }
+            ssize_t r = b->rx_queued ? rx_take(b) : branch_recv(b, &arenas);
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+            if (r > 0) {
+                ssize_t fr;
+                char *frame;
+                while ((fr = next_frame(b, &frame)) > 0) {
+                    const char *f = frame;
+                    size_t flen = (size_t)fr;
+                    if (frame_unpack(arenas.cur, &f, &flen) != 0) break;
+                    branch_reply(epfd, &bl, b, f, flen, &ps, append ? &batch : NULL, delta);
+                    frame_done(b, (size_t)fr);
+                    b->deadline_ms = now + b->timeout_ms;
+                }
+                if (fr != 0) {
+                    fprintf(stderr, "%s reply from branch%d %s:%s\n", fr < 0 ? "Oversized" : "Corrupt",
+                            b->index + 1, b->host, b->port);
+                    branch_close(epfd, b);
+                    b->failed = 1;
+                    continue;
+                }
+                /* one-shot servers close after their reply; so do we, and
+                   warm up the connection for the next one */
+                if (!b->keepalive && b->conn_replies > 0) {
+                    branch_close(epfd, b);
+                    b->sent = b->received;
+                    if (b->sent < rounds && b->primary < 0) branch_open(epfd, b, now);
+                }
+                continue;
+            }
+            branch_lost(epfd, b);
+        }
+    } /* end while */
+    if (append && batch.rows > 0 && persist_batch(&ps, &batch, 0) != 0)
+        fprintf(stderr, "Failed to queue final rows\n");
+    persist_stop(&ps);
+    sink_close(&sink);
+    if (store_dir) {
+        if (store_export_csv(&store, main_csv) == 0)
+            printf("main CSV exported from store (%lld rows)\n", store.rows);
+        else
+            fprintf(stderr, "Failed to export main CSV from store\n");
+        store_close(&store);
+    }
+    arena_pool_free(&arenas);
+    uring_free(&nr.u);
+    close(epfd);
+    if (metrics_file) write_metrics(metrics_file, &bl);
+    free(states);
+    if (timing) {
+        printf("TIMING: wall_ms=%.3f csv_writes=%llu csv_write_ms=%.3f\n",
+               (now_us() - start * 1000) / 1000.0, (unsigned long long)metrics.write_us.count,
+               metrics.write_us.sum_us / 1000.0);
+        printf("STATS: reply_us p50=%llu p99=%llu p999=%llu connect_us p99=%llu "
+               "fsyncs=%llu fsync_ms=%.3f timeouts=%llu\n"
+               "ROUNDS: round_us p50=%llu p99=%llu late=%llu hedges=%llu hedge_wins=%llu\n",
+               (unsigned long long)hist_quantile(&metrics.reply_us, 0.50),
+               (unsigned long long)hist_quantile(&metrics.reply_us, 0.99),
+               (unsigned long long)hist_quantile(&metrics.reply_us, 0.999),
+               (unsigned long long)hist_quantile(&metrics.connect_us, 0.99),
+               (unsigned long long)metrics.fsync_us.count, metrics.fsync_us.sum_us / 1000.0,
+               (unsigned long long)metrics.timeouts,
+               (unsigned long long)hist_quantile(&metrics.round_us, 0.50),
+               (unsigned long long)hist_quantile(&metrics.round_us, 0.99),
+               (unsigned long long)metrics.late, (unsigned long long)metrics.hedges,
+               (unsigned long long)metrics.hedge_wins);
+    }
     printf("Aggregator finished.\n");
     return 0;
 }
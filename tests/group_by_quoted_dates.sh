@@ -0,0 +1,50 @@
+#!/bin/bash
+# GROUP BY hour and hour windows over quoted "YYYY-MM-DDTHH:MM" dates; a
+# date that does not exist (2024-02-30) only counts towards a plain REQUEST,
+# and 2024-02-29 (a leap day) gets its bucket.
+# Usage: tests/group_by_quoted_dates.sh [PORT]   (run from the repo root)
+set -e
+port=${1:-5999}
+dir=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+gcc -O2 -pthread -o "$dir/branch_server" "Branch Server.c" -lm
+printf 'date,amount\n"2024-01-01T10:00",2.50\n"2024-01-01T10:30",5.00\n"2024-01-01T11:00",3.00\n"2024-01-01T11:30",4.50\n' > "$dir/b.csv"
+printf '"2024-02-29T09:00",1.00\n"2024-02-30T09:00",8.00\n' >> "$dir/b.csv"
+"$dir/branch_server" A "$dir/b.csv" "$port" > /dev/null 2>&1 &
+pid=$!
+sleep 0.5
+
+ask() {
+    exec 3<>"/dev/tcp/127.0.0.1/$port"
+    printf '%s\n' "$1" >&3
+    sed '/^END/q' <&3
+    exec 3<&-
+}
+
+expect() {
+    if [ "$2" != "$3" ]; then
+        printf 'FAIL: %s\n--- want\n%s\n--- got\n%s\n' "$1" "$3" "$2"
+        exit 1
+    fi
+}
+
+expect "plain REQUEST" "$(ask 'REQUEST')" "BRANCH_ID: A
+RECORDS: 6
+SUBTOTAL: 24.00
+END"
+expect "GROUP BY hour" "$(ask 'REQUEST GROUP BY hour')" "BRANCH_ID: A
+RECORDS: 5
+SUBTOTAL: 16.00
+BUCKET: 2024-01-01T10 2 7.50
+BUCKET: 2024-01-01T11 2 7.50
+BUCKET: 2024-02-29T09 1 1.00
+END"
+expect "FROM T11 TO T11" "$(ask 'REQUEST FROM 2024-01-01T11 TO 2024-01-01T11')" "BRANCH_ID: A
+RECORDS: 2
+SUBTOTAL: 7.50
+END"
+expect "FROM 2024-03-01 TO 2024-03-01" "$(ask 'REQUEST FROM 2024-03-01 TO 2024-03-01')" "BRANCH_ID: A
+RECORDS: 0
+SUBTOTAL: 0.00
+END"
+echo PASS
@@ -0,0 +1,27 @@
+#!/bin/bash
+# --store --query reports the branch's last snapshot, not the sum of its
+# polls: two identical rounds must not double the answer.
+# Usage: tests/store_query_snapshots.sh [PORT]   (run from the repo root)
+set -e
+port=${1:-5998}
+dir=$(mktemp -d)
+trap 'kill $pid 2>/dev/null; rm -rf "$dir"' EXIT
+gcc -O2 -pthread -o "$dir/branch_server" "Branch Server.c" -lm
+gcc -O2 -pthread -o "$dir/main_aggregator" "Main Aggregator.c" -lm
+printf 'date,amount\n2024-01-01,4.00\n2024-01-01,5.00\n2024-01-02,7.00\n' > "$dir/a.csv"
+"$dir/branch_server" A "$dir/a.csv" "$port" > /dev/null 2>&1 &
+pid=$!
+sleep 0.5
+: > "$dir/main.csv"
+"$dir/main_aggregator" --store "$dir/store" --rounds 2 "$dir/main.csv" 127.0.0.1 "$port" > /dev/null
+
+want="BRANCH_ID: A
+ROWS: 2
+RECORDS: 3
+SUBTOTAL: 16.00"
+got=$("$dir/main_aggregator" --store "$dir/store" --query A)
+if [ "$got" != "$want" ]; then
+    printf 'FAIL: --query A\n--- want\n%s\n--- got\n%s\n' "$want" "$got"
+    exit 1
+fi
+echo PASS